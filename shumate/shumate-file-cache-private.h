@@ -0,0 +1,39 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "shumate-file-cache.h"
+
+G_BEGIN_DECLS
+
+/* Region downloads save how far they got, as the index of the first tile
+ * that hasn't been downloaded, so an interrupted download can resume */
+void    shumate_file_cache_get_download_checkpoint_async  (ShumateFileCache    *self,
+                                                           const char          *region,
+                                                           GCancellable        *cancellable,
+                                                           GAsyncReadyCallback  callback,
+                                                           gpointer             user_data);
+guint64 shumate_file_cache_get_download_checkpoint_finish (ShumateFileCache    *self,
+                                                           GAsyncResult        *result,
+                                                           GError             **error);
+void    shumate_file_cache_set_download_checkpoint        (ShumateFileCache    *self,
+                                                           const char          *region,
+                                                           guint64              next_tile);
+void    shumate_file_cache_clear_download_checkpoint      (ShumateFileCache    *self,
+                                                           const char          *region);
+
+G_END_DECLS
@@ -25,6 +25,12 @@
  * used by [class@NetworkTileSource], but can also be used by custom map
  * sources.
  *
+ * Tiles are stored as blobs in an SQLite database named after the cache key,
+ * in the cache directory. The database follows the
+ * [MBTiles](https://github.com/mapbox/mbtiles-spec) layout, so it can be
+ * inspected with the usual tools. Identical tiles, such as the many tiles of
+ * open ocean, are only stored once.
+ *
  * The cache will be filled up to a certain size limit. When this limit is
  * reached, the cache can be purged, and the tiles that are accessed least are
  * deleted.
@@ -36,15 +42,33 @@
  * using the HTTP If-None-Match header).
  */
 
-#include "shumate-file-cache.h"
+#include "shumate-file-cache-private.h"
 
 #include <sqlite3.h>
 #include <errno.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <string.h>
 #include <stdlib.h>
 
+/* Bump this when the schema changes. Databases with a different version are
+ * cleared, since everything in them can be downloaded again. */
+#define SCHEMA_VERSION 5
+
+/* Once the cache grows past its size limit, tiles are evicted until it is
+ * back down to this fraction of the limit, so that evictions are batched
+ * rather than run for every few tiles stored */
+#define EVICTION_LOW_WATERMARK(size_limit) ((gint64) (size_limit) * 9 / 10)
+
+/* Cache hits are counted in memory and written to the popularity column in
+ * one transaction, once the database thread has been idle for
+ * POPULARITY_IDLE_DELAY, or at least every POPULARITY_FLUSH_INTERVAL while
+ * it is busy */
+#define POPULARITY_IDLE_DELAY (1 * G_TIME_SPAN_SECOND)
+#define POPULARITY_FLUSH_INTERVAL (10 * G_TIME_SPAN_SECOND)
+
+
 enum
 {
   PROP_0,
@@ -53,19 +77,56 @@ enum
   PROP_CACHE_KEY,
 };
 
+/* The database is owned by a thread of its own, which opens it and then runs
+ * the jobs queued by the cache one at a time. Nothing else touches the
+ * connection, so none of the disk I/O happens on the caller's thread. The
+ * thread closes the database and frees this struct when it exits, which the
+ * cache's finalizer waits for. */
 typedef struct
 {
-  guint size_limit;
+  GAsyncQueue *jobs;
+
   char *cache_dir;
   char *cache_key;
 
   sqlite3 *db;
   sqlite3_stmt *stmt_select;
-  sqlite3_stmt *stmt_update;
+  sqlite3_stmt *stmt_update_popularity;
+  sqlite3_stmt *stmt_store_image;
+  sqlite3_stmt *stmt_store;
+  sqlite3_stmt *stmt_mark_up_to_date;
+  sqlite3_stmt *stmt_get_size;
+  sqlite3_stmt *stmt_select_eviction;
+  sqlite3_stmt *stmt_delete;
+  sqlite3_stmt *stmt_age;
+
+  /* The popularity that counts as zero. See create_schema(). */
+  gint64 popularity_base;
+
+  /* TileCoords -> PopularityHits not written to the database yet */
+  GHashTable *popularity_hits;
+  gint64 last_popularity_flush;
+  guint64 n_hits;
+  guint64 n_popularity_writes;
+
+  /* Number of stored tiles whose contents were already in the cache */
+  guint64 n_shared_stores;
+} CacheDatabase;
+
+typedef struct
+{
+  guint size_limit;
+  char *cache_dir;
+  char *cache_key;
+
+  CacheDatabase *database;
+  GThread *database_thread;
+
+  /* Stores waiting to be written in the next transaction */
+  GMutex pending_lock;
+  GPtrArray *pending_stores;
+  gboolean flush_scheduled;
 
-  int size_estimate;
-  gboolean have_size_estimate;
-  gboolean purge_in_progress;
 } ShumateFileCachePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShumateFileCache, shumate_file_cache, G_TYPE_OBJECT);
@@ -76,16 +137,70 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (sqlite_str, sqlite3_free);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (sqlite3_stmt, sqlite3_finalize);
 
 
-static void finalize_sql (ShumateFileCache *file_cache);
-static void init_cache (ShumateFileCache *file_cache);
-static char *get_filename (ShumateFileCache *file_cache,
-    ShumateTile *tile);
-static void delete_tile (ShumateFileCache *file_cache,
-    const char *filename);
-static gboolean create_cache_dir (const char *dir_name);
+/* The primary key of a tile in the database. Following MBTiles, rows are
+ * counted from the bottom of the map (the TMS scheme), unlike ShumateTile's
+ * y coordinate. */
+typedef struct
+{
+  guint zoom_level;
+  guint column;
+  guint row;
+} TileCoords;
+
+static void
+tile_coords_init (TileCoords *coords, ShumateTile *tile)
+{
+  guint zoom_level = shumate_tile_get_zoom_level (tile);
+
+  coords->zoom_level = zoom_level;
+  coords->column = shumate_tile_get_x (tile);
+  coords->row = (1u << zoom_level) - 1 - shumate_tile_get_y (tile);
+}
+
+static guint
+tile_coords_hash (gconstpointer pointer)
+{
+  const TileCoords *coords = pointer;
+  return (coords->zoom_level * 31 + coords->column) * 31 + coords->row;
+}
+
+static gboolean
+tile_coords_equal (gconstpointer a, gconstpointer b)
+{
+  const TileCoords *coords_a = a;
+  const TileCoords *coords_b = b;
+  return coords_a->zoom_level == coords_b->zoom_level
+         && coords_a->column == coords_b->column
+         && coords_a->row == coords_b->row;
+}
 
-static void on_tile_filled (ShumateFileCache *self,
-    ShumateTile *tile);
+static int
+bind_tile_coords (sqlite3_stmt *stmt, const TileCoords *coords)
+{
+  int rc;
+
+  if ((rc = sqlite3_bind_int (stmt, 1, coords->zoom_level)) != SQLITE_OK)
+    return rc;
+  if ((rc = sqlite3_bind_int (stmt, 2, coords->column)) != SQLITE_OK)
+    return rc;
+  return sqlite3_bind_int (stmt, 3, coords->row);
+}
+
+
+typedef void (*DatabaseFunc) (GTask            *task,
+                              ShumateFileCache *self,
+                              CacheDatabase    *database,
+                              gpointer          task_data);
+
+typedef struct
+{
+  GTask *task;
+  DatabaseFunc func;
+} DatabaseJob;
+
+static void database_close (CacheDatabase *database);
+static void database_open (CacheDatabase *database);
+static gboolean create_cache_dir (const char *dir_name);
 
 static void
 shumate_file_cache_get_property (GObject *object,
@@ -146,19 +261,24 @@ shumate_file_cache_set_property (GObject *object,
 }
 
 static void
-finalize_sql (ShumateFileCache *file_cache)
+database_close (CacheDatabase *database)
 {
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
-
-  g_clear_pointer (&priv->stmt_select, sqlite3_finalize);
-  g_clear_pointer (&priv->stmt_update, sqlite3_finalize);
-
-  if (priv->db)
+  g_clear_pointer (&database->stmt_select, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_update_popularity, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_store_image, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_store, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_mark_up_to_date, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_get_size, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_select_eviction, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_delete, sqlite3_finalize);
+  g_clear_pointer (&database->stmt_age, sqlite3_finalize);
+
+  if (database->db)
     {
-      int error = sqlite3_close (priv->db);
+      int error = sqlite3_close (database->db);
       if (error != SQLITE_OK)
-        g_debug ("Sqlite returned error %d when closing cache.db", error);
-      priv->db = NULL;
+        g_debug ("Sqlite returned error %d when closing the cache database", error);
+      database->db = NULL;
     }
 }
 
@@ -169,7 +289,22 @@ shumate_file_cache_finalize (GObject *object)
   ShumateFileCache *file_cache = SHUMATE_FILE_CACHE (object);
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
 
-  finalize_sql (file_cache);
+  /* Tell the database thread to exit once it has run the jobs before this
+   * one, and wait for it to close the database. The thread may be the one
+   * running this finalizer, if it dropped the last reference, in which case
+   * it exits as soon as the finalizer returns. */
+  if (priv->database)
+    g_async_queue_push (priv->database->jobs, g_new0 (DatabaseJob, 1));
+  priv->database = NULL;
+
+  if (priv->database_thread == g_thread_self ())
+    g_thread_unref (priv->database_thread);
+  else if (priv->database_thread != NULL)
+    g_thread_join (priv->database_thread);
+  priv->database_thread = NULL;
+
+  g_clear_pointer (&priv->pending_stores, g_ptr_array_unref);
+  g_mutex_clear (&priv->pending_lock);
 
   g_clear_pointer (&priv->cache_dir, g_free);
   g_clear_pointer (&priv->cache_key, g_free);
@@ -195,80 +330,423 @@ create_cache_dir (const char *dir_name)
 }
 
 
+static int
+get_schema_version (sqlite3 *db)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+
+  if (sqlite3_prepare_v2 (db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK)
+    return -1;
+
+  if (sqlite3_step (stmt) != SQLITE_ROW)
+    return -1;
+
+  return sqlite3_column_int (stmt, 0);
+}
+
+
+static gboolean
+create_schema (CacheDatabase *database)
+{
+  g_autoptr(sqlite_str) error_msg = NULL;
+  g_autoptr(sqlite_str) query = NULL;
+  int version = get_schema_version (database->db);
+
+  if (version == SCHEMA_VERSION)
+    return TRUE;
+
+  if (version != 0)
+    {
+      g_debug ("Clearing cache database with schema version %d", version);
+
+      /* Older versions may have tables, views and triggers of the same
+       * names, so start from an empty database */
+      sqlite3_db_config (database->db, SQLITE_DBCONFIG_RESET_DATABASE, 1, 0);
+      sqlite3_exec (database->db, "VACUUM", NULL, NULL, &error_msg);
+      sqlite3_db_config (database->db, SQLITE_DBCONFIG_RESET_DATABASE, 0, 0);
+      if (error_msg != NULL)
+        {
+          g_debug ("Clearing the cache database failed: %s", error_msg);
+          return FALSE;
+        }
+    }
+
+  /* This is the deduplicated MBTiles layout: each distinct tile is stored
+   * once in images, keyed by the SHA-256 of its data, and map points every
+   * tile position at one of them, plus the columns the cache needs to
+   * validate and evict tiles. The tiles view is the table from the MBTiles
+   * spec.
+   *
+   * Triggers keep a reference count of the positions using each image,
+   * removing images nobody uses, and the total size of the images in the
+   * metadata table, so it never has to be computed by scanning them.
+   *
+   * Purging the cache ages the remaining tiles by the popularity of the last
+   * one evicted. Rather than rewriting every row, that raises the
+   * shumate_popularity_base in the metadata table, which is subtracted from
+   * the popularity column wherever it matters: new tiles start at the base
+   * plus one.
+   *
+   * The downloads table holds the checkpoints of region downloads. */
+  query = sqlite3_mprintf (
+      "BEGIN;"
+      "CREATE TABLE metadata ("
+      "  name TEXT PRIMARY KEY,"
+      "  value TEXT);"
+      "CREATE TABLE images ("
+      "  tile_id TEXT PRIMARY KEY,"
+      "  tile_data BLOB NOT NULL,"
+      "  refs INTEGER NOT NULL DEFAULT 0);"
+      "CREATE TABLE map ("
+      "  zoom_level INTEGER NOT NULL,"
+      "  tile_column INTEGER NOT NULL,"
+      "  tile_row INTEGER NOT NULL,"
+      "  tile_id TEXT NOT NULL,"
+      "  etag TEXT,"
+      "  modtime INTEGER NOT NULL,"
+      "  popularity INTEGER NOT NULL,"
+      "  last_access INTEGER NOT NULL,"
+      "  PRIMARY KEY (zoom_level, tile_column, tile_row));"
+      "CREATE TABLE downloads ("
+      "  region TEXT PRIMARY KEY,"
+      "  next_tile INTEGER NOT NULL);"
+      "CREATE INDEX map_eviction ON map (popularity, last_access);"
+      "CREATE VIEW tiles AS"
+      "  SELECT zoom_level, tile_column, tile_row, tile_data FROM map JOIN images USING (tile_id);"
+      "CREATE TRIGGER map_insert AFTER INSERT ON map BEGIN"
+      "  UPDATE images SET refs = refs + 1 WHERE tile_id = NEW.tile_id;"
+      "END;"
+      "CREATE TRIGGER map_delete AFTER DELETE ON map BEGIN"
+      "  UPDATE images SET refs = refs - 1 WHERE tile_id = OLD.tile_id;"
+      "  DELETE FROM images WHERE tile_id = OLD.tile_id AND refs = 0;"
+      "END;"
+      "CREATE TRIGGER map_update AFTER UPDATE OF tile_id ON map WHEN OLD.tile_id != NEW.tile_id BEGIN"
+      "  UPDATE images SET refs = refs + 1 WHERE tile_id = NEW.tile_id;"
+      "  UPDATE images SET refs = refs - 1 WHERE tile_id = OLD.tile_id;"
+      "  DELETE FROM images WHERE tile_id = OLD.tile_id AND refs = 0;"
+      "END;"
+      "CREATE TRIGGER images_size_insert AFTER INSERT ON images BEGIN"
+      "  UPDATE metadata SET value = value + length (NEW.tile_data) WHERE name = 'shumate_size';"
+      "END;"
+      "CREATE TRIGGER images_size_delete AFTER DELETE ON images BEGIN"
+      "  UPDATE metadata SET value = value - length (OLD.tile_data) WHERE name = 'shumate_size';"
+      "END;"
+      "INSERT INTO metadata (name, value) VALUES ('name', %Q);"
+      "INSERT INTO metadata (name, value) VALUES ('shumate_size', 0);"
+      "INSERT INTO metadata (name, value) VALUES ('shumate_popularity_base', 0);"
+      "PRAGMA user_version = %d;"
+      "COMMIT;",
+      database->cache_key, SCHEMA_VERSION);
+
+  sqlite3_exec (database->db, query, NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      g_debug ("Creating the cache database failed: %s", error_msg);
+      sqlite3_exec (database->db, "ROLLBACK", NULL, NULL, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+static gboolean
+read_popularity_base (CacheDatabase *database)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+
+  if (sqlite3_prepare_v2 (database->db,
+                          "SELECT value FROM metadata WHERE name = 'shumate_popularity_base'",
+                          -1, &stmt, NULL) != SQLITE_OK)
+    return FALSE;
+
+  if (sqlite3_step (stmt) != SQLITE_ROW)
+    return FALSE;
+
+  database->popularity_base = sqlite3_column_int64 (stmt, 0);
+  return TRUE;
+}
+
+
+static sqlite3_stmt *
+prepare (CacheDatabase *database, const char *query)
+{
+  sqlite3_stmt *stmt = NULL;
+  int error;
+
+  error = sqlite3_prepare_v3 (database->db, query, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+  if (error != SQLITE_OK)
+    {
+      g_debug ("Failed to prepare '%s', error %d: %s",
+          query, error, sqlite3_errmsg (database->db));
+      return NULL;
+    }
+
+  return stmt;
+}
+
+
+/* Removes the zoom level and column directories of an old style cache, and
+ * the tiles in them. Anything else is left alone. */
 static void
-init_cache (ShumateFileCache *file_cache)
+remove_legacy_tiles (const char *path, int depth)
 {
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
-  char *filename = NULL;
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      g_autofree char *child = g_build_filename (path, name, NULL);
+
+      if (depth < 2 && g_file_test (child, G_FILE_TEST_IS_DIR))
+        remove_legacy_tiles (child, depth + 1);
+      else if (depth == 2 && g_str_has_suffix (name, ".png"))
+        g_remove (child);
+    }
+
+  g_rmdir (path);
+}
+
+/* Before tiles were stored in a database, each one was a file
+ * <cache_dir>/<cache_key>/<z>/<x>/<y>.png, and their ETags were kept in
+ * <cache_dir>/cache.db. Nothing reads those anymore, and they don't count
+ * towards the size limit, so they are deleted rather than left behind. */
+static void
+remove_legacy_cache (CacheDatabase *database)
+{
+  g_autofree char *tiles_dir = g_build_filename (database->cache_dir, database->cache_key, NULL);
+  g_autofree char *legacy_db = g_build_filename (database->cache_dir, "cache.db", NULL);
+
+  if (g_file_test (tiles_dir, G_FILE_TEST_IS_DIR))
+    {
+      g_debug ("Removing old cached tiles in %s", tiles_dir);
+      remove_legacy_tiles (tiles_dir, 0);
+    }
+
+  if (g_remove (legacy_db) == 0)
+    g_debug ("Removed old cache database %s", legacy_db);
+}
+
+
+static void
+database_open (CacheDatabase *database)
+{
+  g_autofree char *basename = NULL;
+  g_autofree char *filename = NULL;
   char *error_msg = NULL;
   gint error;
 
-  g_return_if_fail (create_cache_dir (priv->cache_dir));
+  /* Without a cache key, every job fails because the database isn't open */
+  if (database->cache_key == NULL)
+    return;
 
-  filename = g_build_filename (priv->cache_dir,
-        "cache.db", NULL);
+  if (!create_cache_dir (database->cache_dir))
+    return;
 
-  /* Make sure the database is opened in serialized mode (OPEN_FULLMUTEX)
-   * because shumate_file_cache_purge_cache_async() runs in a separate thread.
-   * See <https://sqlite.org/threadsafe.html> */
-  error = sqlite3_open_v2 (filename, &priv->db,
-        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
-  g_free (filename);
+  remove_legacy_cache (database);
 
-  if (error == SQLITE_ERROR)
+  basename = g_strconcat (database->cache_key, ".mbtiles", NULL);
+  filename = g_build_filename (database->cache_dir, basename, NULL);
+
+  /* Only the database thread uses the connection, so SQLite doesn't need to
+   * serialize access to it */
+  error = sqlite3_open_v2 (filename, &database->db,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+
+  if (error != SQLITE_OK)
     {
-      g_debug ("Sqlite returned error %d when opening cache.db", error);
+      g_debug ("Sqlite returned error %d when opening %s", error, filename);
+      g_clear_pointer (&database->db, sqlite3_close);
       return;
     }
 
-  sqlite3_exec (priv->db,
+  sqlite3_exec (database->db,
       "PRAGMA synchronous=OFF;"
-      "PRAGMA auto_vacuum=INCREMENTAL;",
+      "PRAGMA auto_vacuum=INCREMENTAL;"
+      "PRAGMA mmap_size=268435456;",
       NULL, NULL, &error_msg);
   if (error_msg != NULL)
     {
       g_debug ("Set PRAGMA: %s", error_msg);
       sqlite3_free (error_msg);
+      database_close (database);
       return;
     }
 
-  sqlite3_exec (priv->db,
-      "CREATE TABLE IF NOT EXISTS tiles ("
-      "filename TEXT PRIMARY KEY, "
-      "etag TEXT, "
-      "popularity INT DEFAULT 1, "
-      "size INT DEFAULT 0)",
-      NULL, NULL, &error_msg);
-  if (error_msg != NULL)
+  if (!create_schema (database) || !read_popularity_base (database))
     {
-      g_debug ("Creating table 'tiles' failed: %s", error_msg);
-      sqlite3_free (error_msg);
+      database_close (database);
       return;
     }
 
-  error = sqlite3_prepare_v2 (priv->db,
-        "SELECT etag FROM tiles WHERE filename = ?", -1,
-        &priv->stmt_select, NULL);
-  if (error != SQLITE_OK)
+  database->stmt_select = prepare (database,
+      "SELECT images.rowid, etag, modtime FROM map JOIN images USING (tile_id) "
+      "WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3");
+  database->stmt_update_popularity = prepare (database,
+      "UPDATE map SET popularity = popularity + ?4, last_access = ?5 "
+      "WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3");
+  database->stmt_store_image = prepare (database,
+      "INSERT OR IGNORE INTO images (tile_id, tile_data) VALUES (?1, ?2)");
+  /* Replacing a tile resets its popularity, like a new one */
+  database->stmt_store = prepare (database,
+      "INSERT INTO map (zoom_level, tile_column, tile_row, tile_id, etag, modtime, popularity, last_access) "
+      "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?6) "
+      "ON CONFLICT (zoom_level, tile_column, tile_row) DO UPDATE SET "
+      "tile_id = excluded.tile_id, etag = excluded.etag, modtime = excluded.modtime, "
+      "popularity = excluded.popularity, last_access = excluded.last_access");
+  database->stmt_mark_up_to_date = prepare (database,
+      "UPDATE map SET modtime = ?4 "
+      "WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3");
+  database->stmt_get_size = prepare (database,
+      "SELECT value FROM metadata WHERE name = 'shumate_size'");
+  /* Walks the map_eviction index, so only the rows that are evicted are
+   * read */
+  database->stmt_select_eviction = prepare (database,
+      "SELECT map.rowid, popularity, tile_id, length (tile_data), refs "
+      "FROM map JOIN images USING (tile_id) "
+      "ORDER BY popularity, last_access");
+  database->stmt_delete = prepare (database,
+      "DELETE FROM map WHERE rowid = ?1");
+  database->stmt_age = prepare (database,
+      "UPDATE metadata SET value = ?1 WHERE name = 'shumate_popularity_base'");
+
+  if (!database->stmt_select || !database->stmt_update_popularity || !database->stmt_store_image || !database->stmt_store || !database->stmt_mark_up_to_date
+      || !database->stmt_get_size || !database->stmt_select_eviction || !database->stmt_delete || !database->stmt_age)
+    database_close (database);
+}
+
+
+typedef struct {
+  TileCoords coords;
+  guint hits;
+} PopularityHits;
+
+static void
+count_hit (CacheDatabase *database, const TileCoords *coords)
+{
+  PopularityHits *entry = g_hash_table_lookup (database->popularity_hits, coords);
+
+  if (entry == NULL)
     {
-      priv->stmt_select = NULL;
-      g_debug ("Failed to prepare the select Etag statement, error:%d: %s",
-          error, sqlite3_errmsg (priv->db));
-      return;
+      entry = g_new0 (PopularityHits, 1);
+      entry->coords = *coords;
+      g_hash_table_insert (database->popularity_hits, &entry->coords, entry);
     }
 
-  error = sqlite3_prepare_v2 (priv->db,
-        "UPDATE tiles SET popularity = popularity + 1 WHERE filename = ?", -1,
-        &priv->stmt_update, NULL);
-  if (error != SQLITE_OK)
+  entry->hits ++;
+  database->n_hits ++;
+}
+
+/* Writes the hits counted since the last flush, one UPDATE per tile, in a
+ * single transaction */
+static void
+flush_popularity (CacheDatabase *database)
+{
+  GHashTableIter iter;
+  PopularityHits *entry;
+  guint n_tiles = g_hash_table_size (database->popularity_hits);
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  database->last_popularity_flush = g_get_monotonic_time ();
+
+  if (n_tiles == 0 || database->db == NULL)
+    return;
+
+  sqlite3_exec (database->db, "BEGIN", NULL, NULL, NULL);
+
+  g_hash_table_iter_init (&iter, database->popularity_hits);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry))
     {
-      priv->stmt_update = NULL;
-      g_debug ("Failed to prepare the update popularity statement, error: %s",
-          sqlite3_errmsg (priv->db));
-      return;
+      sqlite3_reset (database->stmt_update_popularity);
+      bind_tile_coords (database->stmt_update_popularity, &entry->coords);
+      sqlite3_bind_int (database->stmt_update_popularity, 4, entry->hits);
+      sqlite3_bind_int64 (database->stmt_update_popularity, 5, now);
+      if (sqlite3_step (database->stmt_update_popularity) != SQLITE_DONE)
+        g_debug ("Failed to update tile popularity: %s", sqlite3_errmsg (database->db));
     }
 
-  g_object_notify (G_OBJECT (file_cache), "cache-dir");
+  sqlite3_exec (database->db, "COMMIT", NULL, NULL, NULL);
+
+  g_hash_table_remove_all (database->popularity_hits);
+  database->n_popularity_writes += n_tiles;
+
+  g_debug ("Wrote the popularity of %u tiles; %" G_GUINT64_FORMAT " popularity "
+           "writes for %" G_GUINT64_FORMAT " cache hits so far",
+           n_tiles, database->n_popularity_writes, database->n_hits);
+}
+
+static gpointer
+database_thread_func (gpointer user_data)
+{
+  CacheDatabase *database = user_data;
+  DatabaseJob *job;
+
+  database->popularity_hits = g_hash_table_new_full (tile_coords_hash, tile_coords_equal, NULL, g_free);
+  database->last_popularity_flush = g_get_monotonic_time ();
+
+  database_open (database);
+
+  for (;;)
+    {
+      if (g_hash_table_size (database->popularity_hits) > 0)
+        job = g_async_queue_timeout_pop (database->jobs, POPULARITY_IDLE_DELAY);
+      else
+        job = g_async_queue_pop (database->jobs);
+
+      if (job == NULL)
+        {
+          /* The queue has been idle for a while */
+          flush_popularity (database);
+          continue;
+        }
+
+      /* A job without a function means the cache was finalized */
+      if (job->func == NULL)
+        break;
+
+      job->func (job->task,
+                 g_task_get_source_object (job->task),
+                 database,
+                 g_task_get_task_data (job->task));
+
+      /* This may drop the last reference to the cache */
+      g_object_unref (job->task);
+      g_free (job);
+
+      if (g_get_monotonic_time () - database->last_popularity_flush > POPULARITY_FLUSH_INTERVAL)
+        flush_popularity (database);
+    }
+
+  g_free (job);
+
+  flush_popularity (database);
+  g_hash_table_unref (database->popularity_hits);
+  database_close (database);
+  g_async_queue_unref (database->jobs);
+  g_free (database->cache_dir);
+  g_free (database->cache_key);
+  g_free (database);
+
+  return NULL;
+}
+
+
+/* Queues func to run on the database thread. The task should be returned
+ * from there. */
+static void
+run_in_database_thread (ShumateFileCache *self,
+                        GTask            *task,
+                        DatabaseFunc      func)
+{
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
+  DatabaseJob *job = g_new0 (DatabaseJob, 1);
+
+  job->task = g_object_ref (task);
+  job->func = func;
+  g_async_queue_push (priv->database->jobs, job);
 }
 
 
@@ -285,7 +763,16 @@ shumate_file_cache_constructed (GObject *object)
             "shumate", NULL);
     }
 
-  init_cache (file_cache);
+  if (priv->cache_key == NULL)
+    g_critical ("A cache key is required.");
+
+  priv->database = g_new0 (CacheDatabase, 1);
+  priv->database->jobs = g_async_queue_new ();
+  priv->database->cache_dir = g_strdup (priv->cache_dir);
+  priv->database->cache_key = g_strdup (priv->cache_key);
+  priv->database_thread = g_thread_new ("shumate-file-cache", database_thread_func, priv->database);
+
+  g_object_notify (G_OBJECT (file_cache), "cache-dir");
 
   G_OBJECT_CLASS (shumate_file_cache_parent_class)->constructed (object);
 }
@@ -307,7 +794,10 @@ shumate_file_cache_class_init (ShumateFileCacheClass *klass)
    *
    * The cache size limit in bytes.
    *
-   * Note: this new value will not be applied until you call shumate_file_cache_purge()
+   * The limit is checked whenever a batch of stored tiles has been written
+   * to disk. If the cache has outgrown it, the least popular tiles are
+   * evicted until the cache is down to 90% of the limit. Calling
+   * shumate_file_cache_purge() is not necessary.
    */
   pspec = g_param_spec_uint ("size-limit",
         "Size Limit",
@@ -352,12 +842,12 @@ shumate_file_cache_init (ShumateFileCache *file_cache)
 
   priv->cache_dir = NULL;
   priv->size_limit = 100000000;
-  priv->size_estimate = 0;
-  priv->have_size_estimate = FALSE;
   priv->cache_dir = NULL;
-  priv->db = NULL;
-  priv->stmt_select = NULL;
-  priv->stmt_update = NULL;
+  priv->database = NULL;
+  priv->database_thread = NULL;
+
+  g_mutex_init (&priv->pending_lock);
+  priv->pending_stores = g_ptr_array_new_with_free_func (g_object_unref);
 }
 
 
@@ -468,69 +958,38 @@ shumate_file_cache_set_size_limit (ShumateFileCache *file_cache,
 }
 
 
-static char *
-get_filename (ShumateFileCache *file_cache,
-    ShumateTile *tile)
+static void
+return_database_error (GTask *task, sqlite3 *db, const char *message)
 {
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
-  const char *cache_key;
-
-  g_return_val_if_fail (SHUMATE_IS_FILE_CACHE (file_cache), NULL);
-  g_return_val_if_fail (SHUMATE_IS_TILE (tile), NULL);
-  g_return_val_if_fail (priv->cache_dir, NULL);
-
-  cache_key = shumate_file_cache_get_cache_key (file_cache);
-
-  char *filename = g_strdup_printf ("%s" G_DIR_SEPARATOR_S
-        "%s" G_DIR_SEPARATOR_S
-        "%d" G_DIR_SEPARATOR_S
-        "%d" G_DIR_SEPARATOR_S "%d.png",
-        priv->cache_dir,
-        cache_key,
-        shumate_tile_get_zoom_level (tile),
-        shumate_tile_get_x (tile),
-        shumate_tile_get_y (tile));
-  return filename;
+  g_task_return_new_error (task, SHUMATE_FILE_CACHE_ERROR, SHUMATE_FILE_CACHE_ERROR_FAILED,
+                           "%s: %s", message, db ? sqlite3_errmsg (db) : "the cache database is not open");
 }
 
 
-static char *
-db_get_etag (ShumateFileCache *self, ShumateTile *tile)
+static void
+mark_up_to_date (GTask            *task,
+                 ShumateFileCache *self,
+                 CacheDatabase    *database,
+                 gpointer          task_data)
 {
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
-  int sql_rc = SQLITE_OK;
-  g_autofree char *filename = get_filename (self, tile);
+  TileCoords *coords = task_data;
 
-  sqlite3_reset (priv->stmt_select);
-  sql_rc = sqlite3_bind_text (priv->stmt_select, 1, filename, -1, SQLITE_STATIC);
-  if (sql_rc == SQLITE_ERROR)
+  if (database->db == NULL)
     {
-      g_debug ("Failed to prepare the SQL query for finding the Etag of '%s', error: %s",
-          filename, sqlite3_errmsg (priv->db));
-      return NULL;
+      return_database_error (task, NULL, "Failed to mark tile as up to date");
+      return;
     }
 
-  sql_rc = sqlite3_step (priv->stmt_select);
-  if (sql_rc == SQLITE_ROW)
-    {
-      const char *etag = (const char *) sqlite3_column_text (priv->stmt_select, 0);
-      return g_strdup (etag);
-    }
-  else if (sql_rc == SQLITE_DONE)
-    {
-      g_debug ("'%s' doesn't have an etag",
-          filename);
-    }
-  else if (sql_rc == SQLITE_ERROR)
-    {
-      g_debug ("Failed to finding the Etag of '%s', %d error: %s",
-          filename, sql_rc, sqlite3_errmsg (priv->db));
-    }
+  sqlite3_reset (database->stmt_mark_up_to_date);
+  bind_tile_coords (database->stmt_mark_up_to_date, coords);
+  sqlite3_bind_int64 (database->stmt_mark_up_to_date, 4, g_get_real_time () / G_USEC_PER_SEC);
 
-  return NULL;
+  if (sqlite3_step (database->stmt_mark_up_to_date) != SQLITE_DONE)
+    return_database_error (task, database->db, "Failed to mark tile as up to date");
+  else
+    g_task_return_boolean (task, TRUE);
 }
 
-
 /**
  * shumate_file_cache_mark_up_to_date:
  * @self: a #ShumateFileCache
@@ -545,175 +1004,152 @@ void
 shumate_file_cache_mark_up_to_date (ShumateFileCache *self,
                                     ShumateTile *tile)
 {
-  g_autofree char *filename = NULL;
-  g_autoptr(GFile) file = NULL;
-  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GTask) task = NULL;
+  TileCoords *coords;
 
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
   g_return_if_fail (SHUMATE_IS_TILE (tile));
 
-  filename = get_filename (self, tile);
-  file = g_file_new_for_path (filename);
+  task = g_task_new (self, NULL, NULL, NULL);
+  g_task_set_source_tag (task, shumate_file_cache_mark_up_to_date);
 
-  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
-        G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  coords = g_new (TileCoords, 1);
+  tile_coords_init (coords, tile);
+  g_task_set_task_data (task, coords, g_free);
 
-  if (info)
-    {
-      g_autoptr(GDateTime) now = g_date_time_new_now_utc ();
-
-      g_file_info_set_modification_date_time (info, now);
-      g_file_set_attributes_from_info (file, info, G_FILE_QUERY_INFO_NONE, NULL, NULL);
-    }
+  run_in_database_thread (self, task, mark_up_to_date);
 }
 
 
-static void
-on_tile_filled (ShumateFileCache *self,
-    ShumateTile *tile)
+/* Returns the total size of the tile data, or -1 on error */
+static gint64
+get_cache_size (CacheDatabase *database)
 {
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
-  int sql_rc = SQLITE_OK;
-  g_autofree char *filename = NULL;
+  gint64 size = -1;
 
-  filename = get_filename (self, tile);
+  sqlite3_reset (database->stmt_get_size);
+  if (sqlite3_step (database->stmt_get_size) == SQLITE_ROW)
+    size = sqlite3_column_int64 (database->stmt_get_size, 0);
+  else
+    g_warning ("Can't get the cache size: %s", sqlite3_errmsg (database->db));
 
-  g_debug ("popularity of %s", filename);
-
-  sqlite3_reset (priv->stmt_update);
-  sql_rc = sqlite3_bind_text (priv->stmt_update, 1, filename, -1, SQLITE_STATIC);
-  if (sql_rc != SQLITE_OK)
-    {
-      g_debug ("Failed to set values to the popularity query of '%s', error: %s",
-          filename, sqlite3_errmsg (priv->db));
-      return;
-    }
-
-  sql_rc = sqlite3_step (priv->stmt_update);
-  if (sql_rc != SQLITE_DONE)
-    {
-      /* may not be present in this cache */
-      return;
-    }
+  sqlite3_reset (database->stmt_get_size);
+  return size;
 }
 
-
-static void
-delete_tile (ShumateFileCache *file_cache, const char *filename)
+/* Removes the least popular tiles, and the least recently used among
+ * equally popular ones, until the tile data takes at most @target_size
+ * bytes. The deletions, and the aging of the remaining tiles, happen in a
+ * single transaction.
+ *
+ * Removing a tile only frees its image once no other tile uses it, so the
+ * number of references left to each image is tracked along the way.
+ *
+ * Returns: the number of bytes removed, or -1 on error */
+static gint64
+evict_tiles (CacheDatabase *database, gint64 target_size)
 {
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
+  g_autoptr(GArray) rowids = NULL;
+  g_autoptr(GHashTable) refs = NULL;
+  gint64 original_size, current_size;
+  gint64 highest_popularity = 0;
+  int rc = SQLITE_OK;
 
-  g_return_if_fail (SHUMATE_IS_FILE_CACHE (file_cache));
-  g_autoptr(sqlite_str) query = NULL;
-  g_autoptr(sqlite_str) sql_error = NULL;
-  g_autoptr(GError) gerror = NULL;
-  g_autoptr(GFile) file = NULL;
+  /* Tiles are evicted by popularity, so it must be up to date */
+  flush_popularity (database);
 
-  file = g_file_new_for_path (filename);
-  if (!g_file_delete (file, NULL, &gerror))
+  original_size = current_size = get_cache_size (database);
+  if (current_size < 0)
+    return -1;
+
+  if (current_size <= target_size)
     {
-      g_debug ("Deleting tile from disk failed: %s", gerror->message);
+      g_debug ("Cache doesn't need to be purged at %" G_GINT64_FORMAT " bytes", current_size);
+      return 0;
     }
 
-  query = sqlite3_mprintf ("DELETE FROM tiles WHERE filename = %Q", filename);
-  sqlite3_exec (priv->db, query, NULL, NULL, &sql_error);
-  if (sql_error != NULL)
+  rowids = g_array_new (FALSE, FALSE, sizeof (sqlite3_int64));
+  refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  sqlite3_reset (database->stmt_select_eviction);
+  while (current_size > target_size
+         && sqlite3_step (database->stmt_select_eviction) == SQLITE_ROW)
     {
-      g_debug ("Deleting tile from db failed: %s", sql_error);
-    }
-}
+      sqlite3_stmt *stmt = database->stmt_select_eviction;
+      sqlite3_int64 rowid = sqlite3_column_int64 (stmt, 0);
+      const char *tile_id = (const char *) sqlite3_column_text (stmt, 2);
+      gpointer image_refs;
 
+      g_array_append_val (rowids, rowid);
+      highest_popularity = sqlite3_column_int64 (stmt, 1);
 
-static void
-purge_cache (GTask *task,
-             gpointer source_object,
-             gpointer _task_data,
-             GCancellable *cancellable)
-{
-  ShumateFileCache *self = (ShumateFileCache *) source_object;
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
+      if (!g_hash_table_lookup_extended (refs, tile_id, NULL, &image_refs))
+        image_refs = GINT_TO_POINTER (sqlite3_column_int (stmt, 4));
 
-  char *query;
-  g_autoptr(sqlite3_stmt) stmt = NULL;
-  int rc = 0;
-  guint original_size, current_size = 0;
-  guint highest_popularity = 0;
-  g_autoptr(sqlite_str) error = NULL;
+      image_refs = GINT_TO_POINTER (GPOINTER_TO_INT (image_refs) - 1);
+      g_hash_table_replace (refs, g_strdup (tile_id), image_refs);
 
-  query = "SELECT SUM (size) FROM tiles";
-  rc = sqlite3_prepare (priv->db, query, strlen (query), &stmt, NULL);
-  if (rc != SQLITE_OK)
-    {
-      g_warning ("Can't compute cache size %s", sqlite3_errmsg (priv->db));
-      g_task_return_boolean (task, FALSE);
-      return;
+      if (GPOINTER_TO_INT (image_refs) == 0)
+        current_size -= sqlite3_column_int (stmt, 3);
     }
+  sqlite3_reset (database->stmt_select_eviction);
+
+  sqlite3_exec (database->db, "BEGIN", NULL, NULL, NULL);
 
-  rc = sqlite3_step (stmt);
-  if (rc != SQLITE_ROW)
+  for (guint i = 0; rc == SQLITE_OK && i < rowids->len; i ++)
     {
-      g_warning ("Failed to count the total cache consumption %s",
-          sqlite3_errmsg (priv->db));
-      g_task_return_boolean (task, FALSE);
-      return;
+      sqlite3_reset (database->stmt_delete);
+      sqlite3_bind_int64 (database->stmt_delete, 1, g_array_index (rowids, sqlite3_int64, i));
+      if (sqlite3_step (database->stmt_delete) != SQLITE_DONE)
+        rc = SQLITE_ERROR;
     }
 
-  current_size = sqlite3_column_int (stmt, 0);
-  original_size = current_size;
-  if (current_size < priv->size_limit)
+  /* The tiles left are aged by the popularity of the last one evicted, so
+   * that tiles that were popular long ago don't stay forever */
+  if (rc == SQLITE_OK && highest_popularity > database->popularity_base)
     {
-      g_debug ("Cache doesn't need to be purged at %d bytes", current_size);
-      priv->size_estimate = current_size;
-      g_task_return_boolean (task, FALSE);
-      return;
+      sqlite3_reset (database->stmt_age);
+      sqlite3_bind_int64 (database->stmt_age, 1, highest_popularity);
+      if (sqlite3_step (database->stmt_age) != SQLITE_DONE)
+        rc = SQLITE_ERROR;
     }
 
-  sqlite3_finalize (stmt);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec (database->db, "COMMIT", NULL, NULL, NULL);
 
-  /* Ok, delete the less popular tiles until size_limit reached */
-  query = "SELECT filename, size, popularity FROM tiles ORDER BY popularity";
-  rc = sqlite3_prepare (priv->db, query, strlen (query), &stmt, NULL);
   if (rc != SQLITE_OK)
     {
-      g_warning ("Can't fetch tiles to delete: %s", sqlite3_errmsg (priv->db));
+      g_warning ("Purging the cache failed: %s", sqlite3_errmsg (database->db));
+      sqlite3_exec (database->db, "ROLLBACK", NULL, NULL, NULL);
+      return -1;
     }
 
-  rc = sqlite3_step (stmt);
-  while (rc == SQLITE_ROW && current_size > priv->size_limit)
-    {
-      const char *filename;
-      guint size;
-
-      filename = (const char *) sqlite3_column_text (stmt, 0);
-      size = sqlite3_column_int (stmt, 1);
-      highest_popularity = sqlite3_column_int (stmt, 2);
-      g_debug ("Deleting %s of size %d", filename, size);
+  database->popularity_base = MAX (database->popularity_base, highest_popularity);
 
-      delete_tile (self, filename);
+  current_size = get_cache_size (database);
+  g_debug ("Evicted %u tiles; cache size is now %" G_GINT64_FORMAT " bytes (reduced by %" G_GINT64_FORMAT " bytes)",
+           rowids->len, current_size, original_size - current_size);
 
-      current_size -= size;
+  sqlite3_exec (database->db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL);
 
-      rc = sqlite3_step (stmt);
-    }
+  return original_size - current_size;
+}
 
-  g_debug ("Cache size is now %d bytes (reduced by %d bytes)", current_size, original_size - current_size);
-  priv->size_estimate = current_size;
-  priv->have_size_estimate = TRUE;
+static void
+purge_cache (GTask            *task,
+             ShumateFileCache *self,
+             CacheDatabase    *database,
+             gpointer          task_data)
+{
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
 
-  query = sqlite3_mprintf ("UPDATE tiles SET popularity = popularity - %d",
-        highest_popularity);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
+  if (database->db == NULL)
     {
-      g_warning ("Updating popularity failed: %s", error);
-      sqlite3_free (error);
+      g_task_return_boolean (task, FALSE);
+      return;
     }
-  sqlite3_free (query);
-
-  sqlite3_exec (priv->db, "PRAGMA incremental_vacuum;", NULL, NULL, &error);
 
-  priv->purge_in_progress = FALSE;
-  g_task_return_boolean (task, TRUE);
+  g_task_return_boolean (task, evict_tiles (database, priv->size_limit) > 0);
 }
 
 /**
@@ -733,7 +1169,6 @@ shumate_file_cache_purge_cache_async (ShumateFileCache *self,
                                       gpointer user_data)
 {
   g_autoptr(GTask) task = NULL;
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
 
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
   g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
@@ -741,14 +1176,7 @@ shumate_file_cache_purge_cache_async (ShumateFileCache *self,
   task = g_task_new (self, cancellable, callback, user_data);
   g_task_set_source_tag (task, shumate_file_cache_purge_cache_async);
 
-  if (priv->purge_in_progress)
-    {
-      g_task_return_boolean (task, FALSE);
-      return;
-    }
-
-  priv->purge_in_progress = TRUE;
-  g_task_run_in_thread (task, purge_cache);
+  run_in_database_thread (self, task, purge_cache);
 }
 
 /**
@@ -774,7 +1202,187 @@ shumate_file_cache_purge_cache_finish (ShumateFileCache *self,
 }
 
 
+static void
+get_download_checkpoint (GTask            *task,
+                         ShumateFileCache *self,
+                         CacheDatabase    *database,
+                         gpointer          task_data)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  const char *region = task_data;
+  guint64 *next_tile;
+
+  if (database->db == NULL)
+    {
+      return_database_error (task, NULL, "Failed to get download checkpoint");
+      return;
+    }
+
+  if (sqlite3_prepare_v2 (database->db,
+                          "SELECT next_tile FROM downloads WHERE region = ?1",
+                          -1, &stmt, NULL) != SQLITE_OK)
+    {
+      return_database_error (task, database->db, "Failed to get download checkpoint");
+      return;
+    }
+
+  sqlite3_bind_text (stmt, 1, region, -1, SQLITE_STATIC);
+
+  next_tile = g_new0 (guint64, 1);
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    *next_tile = sqlite3_column_int64 (stmt, 0);
+
+  g_task_return_pointer (task, next_tile, g_free);
+}
+
+/*
+ * shumate_file_cache_get_download_checkpoint_async:
+ * @self: a #ShumateFileCache
+ * @region: a string identifying the region download
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to execute upon completion
+ * @user_data: closure data for @callback
+ *
+ * Gets the index of the first tile that the download of @region hasn't
+ * finished, as last saved with shumate_file_cache_set_download_checkpoint().
+ */
+void
+shumate_file_cache_get_download_checkpoint_async (ShumateFileCache    *self,
+                                                  const char          *region,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
+  g_return_if_fail (region != NULL);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, shumate_file_cache_get_download_checkpoint_async);
+  g_task_set_task_data (task, g_strdup (region), g_free);
+
+  run_in_database_thread (self, task, get_download_checkpoint);
+}
+
+/*
+ * shumate_file_cache_get_download_checkpoint_finish:
+ *
+ * Returns: the index of the first tile to download, 0 if the download of the
+ *   region hasn't been started or has completed
+ */
+guint64
+shumate_file_cache_get_download_checkpoint_finish (ShumateFileCache  *self,
+                                                   GAsyncResult      *result,
+                                                   GError           **error)
+{
+  g_autofree guint64 *next_tile = NULL;
+
+  g_return_val_if_fail (SHUMATE_IS_FILE_CACHE (self), 0);
+  g_return_val_if_fail (g_task_is_valid (result, self), 0);
+
+  next_tile = g_task_propagate_pointer (G_TASK (result), error);
+  return next_tile ? *next_tile : 0;
+}
+
+
 typedef struct {
+  char *region;
+  guint64 next_tile;
+} DownloadCheckpoint;
+
+static void
+download_checkpoint_free (DownloadCheckpoint *checkpoint)
+{
+  g_clear_pointer (&checkpoint->region, g_free);
+  g_free (checkpoint);
+}
+
+static void
+set_download_checkpoint (GTask            *task,
+                         ShumateFileCache *self,
+                         CacheDatabase    *database,
+                         gpointer          task_data)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  DownloadCheckpoint *checkpoint = task_data;
+  const char *query;
+
+  if (database->db == NULL)
+    {
+      return_database_error (task, NULL, "Failed to save download checkpoint");
+      return;
+    }
+
+  if (checkpoint->next_tile == 0)
+    query = "DELETE FROM downloads WHERE region = ?1";
+  else
+    query = "INSERT OR REPLACE INTO downloads (region, next_tile) VALUES (?1, ?2)";
+
+  if (sqlite3_prepare_v2 (database->db, query, -1, &stmt, NULL) != SQLITE_OK)
+    {
+      return_database_error (task, database->db, "Failed to save download checkpoint");
+      return;
+    }
+
+  sqlite3_bind_text (stmt, 1, checkpoint->region, -1, SQLITE_STATIC);
+  if (checkpoint->next_tile != 0)
+    sqlite3_bind_int64 (stmt, 2, checkpoint->next_tile);
+
+  if (sqlite3_step (stmt) != SQLITE_DONE)
+    return_database_error (task, database->db, "Failed to save download checkpoint");
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * shumate_file_cache_set_download_checkpoint:
+ * @self: a #ShumateFileCache
+ * @region: a string identifying the region download
+ * @next_tile: the index of the first tile that hasn't been downloaded
+ *
+ * Saves the progress of a region download.
+ */
+void
+shumate_file_cache_set_download_checkpoint (ShumateFileCache *self,
+                                            const char       *region,
+                                            guint64           next_tile)
+{
+  g_autoptr(GTask) task = NULL;
+  DownloadCheckpoint *checkpoint;
+
+  g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
+  g_return_if_fail (region != NULL);
+
+  task = g_task_new (self, NULL, NULL, NULL);
+  g_task_set_source_tag (task, shumate_file_cache_set_download_checkpoint);
+
+  checkpoint = g_new0 (DownloadCheckpoint, 1);
+  checkpoint->region = g_strdup (region);
+  checkpoint->next_tile = next_tile;
+  g_task_set_task_data (task, checkpoint, (GDestroyNotify) download_checkpoint_free);
+
+  run_in_database_thread (self, task, set_download_checkpoint);
+}
+
+/*
+ * shumate_file_cache_clear_download_checkpoint:
+ * @self: a #ShumateFileCache
+ * @region: a string identifying the region download
+ *
+ * Forgets the progress of a region download, once it has completed.
+ */
+void
+shumate_file_cache_clear_download_checkpoint (ShumateFileCache *self,
+                                              const char       *region)
+{
+  shumate_file_cache_set_download_checkpoint (self, region, 0);
+}
+
+
+typedef struct {
+  TileCoords coords;
   char *etag;
   GDateTime *modtime;
 } GetTileData;
@@ -787,7 +1395,81 @@ get_tile_data_free (GetTileData *data)
   g_free (data);
 }
 
-static void on_get_tile_file_loaded (GObject *source_object, GAsyncResult *res, gpointer user_data);
+static void
+get_tile (GTask            *task,
+          ShumateFileCache *self,
+          CacheDatabase    *database,
+          gpointer          task_data)
+{
+  GetTileData *data = task_data;
+  sqlite3_blob *blob = NULL;
+  GBytes *bytes;
+  gpointer contents;
+  int size;
+  int rc;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (database->db == NULL)
+    {
+      return_database_error (task, NULL, "Failed to get tile from cache");
+      return;
+    }
+
+  sqlite3_reset (database->stmt_select);
+  bind_tile_coords (database->stmt_select, &data->coords);
+
+  rc = sqlite3_step (database->stmt_select);
+  if (rc == SQLITE_DONE)
+    {
+      /* Return NULL but not an error if the tile isn't in the cache */
+      g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+  else if (rc != SQLITE_ROW)
+    {
+      return_database_error (task, database->db, "Failed to get tile from cache");
+      return;
+    }
+
+  /* Read the tile through a blob handle, straight from the (memory mapped)
+   * database pages into a buffer of the right size, which the GBytes then
+   * takes over. Selecting the column would assemble the blob in a buffer of
+   * SQLite's first, only for it to be copied again. */
+  rc = sqlite3_blob_open (database->db, "main", "images", "tile_data",
+                          sqlite3_column_int64 (database->stmt_select, 0), 0, &blob);
+  if (rc != SQLITE_OK)
+    {
+      return_database_error (task, database->db, "Failed to get tile from cache");
+      sqlite3_blob_close (blob);
+      sqlite3_reset (database->stmt_select);
+      return;
+    }
+
+  size = sqlite3_blob_bytes (blob);
+  contents = g_malloc (size);
+  rc = sqlite3_blob_read (blob, contents, size, 0);
+  sqlite3_blob_close (blob);
+
+  if (rc != SQLITE_OK)
+    {
+      return_database_error (task, database->db, "Failed to get tile from cache");
+      g_free (contents);
+      sqlite3_reset (database->stmt_select);
+      return;
+    }
+
+  bytes = g_bytes_new_take (contents, size);
+  data->etag = g_strdup ((const char *) sqlite3_column_text (database->stmt_select, 1));
+  data->modtime = g_date_time_new_from_unix_utc (sqlite3_column_int64 (database->stmt_select, 2));
+  sqlite3_reset (database->stmt_select);
+
+  /* update tile popularity */
+  count_hit (database, &data->coords);
+
+  g_task_return_pointer (task, bytes, (GDestroyNotify) g_bytes_unref);
+}
 
 
 /**
@@ -808,10 +1490,6 @@ shumate_file_cache_get_tile_async (ShumateFileCache *self,
                                    gpointer user_data)
 {
   g_autoptr(GTask) task = NULL;
-  g_autoptr(GFile) file = NULL;
-  g_autofree char *filename = NULL;
-  g_autoptr(GFileInfo) info = NULL;
-  g_autoptr(GError) error = NULL;
   GetTileData *task_data = NULL;
 
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
@@ -822,57 +1500,10 @@ shumate_file_cache_get_tile_async (ShumateFileCache *self,
   g_task_set_source_tag (task, shumate_file_cache_get_tile_async);
 
   task_data = g_new0 (GetTileData, 1);
+  tile_coords_init (&task_data->coords, tile);
   g_task_set_task_data (task, task_data, (GDestroyNotify) get_tile_data_free);
 
-  filename = get_filename (self, tile);
-  file = g_file_new_for_path (filename);
-
-  /* Retrieve modification time */
-  info = g_file_query_info (file,
-                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
-                            G_FILE_QUERY_INFO_NONE, cancellable, &error);
-  if (error)
-    {
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        g_task_return_pointer (task, NULL, NULL);
-      else
-        g_task_return_error (task, g_error_copy (error));
-
-      return;
-    }
-
-  task_data->modtime = g_file_info_get_modification_date_time (info);
-  task_data->etag = db_get_etag (self, tile);
-
-  /* update tile popularity */
-  on_tile_filled (self, tile);
-
-  g_file_load_bytes_async (file, cancellable, on_get_tile_file_loaded, g_object_ref (task));
-}
-
-
-static void
-on_get_tile_file_loaded (GObject *source_object, GAsyncResult *res, gpointer user_data)
-{
-  g_autoptr(GTask) task = user_data;
-  GFile *file = G_FILE (source_object);
-  g_autoptr(GError) error = NULL;
-  GBytes *bytes;
-
-  bytes = g_file_load_bytes_finish (file, res, NULL, &error);
-
-  if (error != NULL)
-    {
-      /* Return NULL but not an error if the file doesn't exist */
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        g_task_return_pointer (task, NULL, NULL);
-      else
-        g_task_return_error (task, g_error_copy (error));
-
-      return;
-    }
-
-  g_task_return_pointer (task, bytes, (GDestroyNotify) g_bytes_unref);
+  run_in_database_thread (self, task, get_tile);
 }
 
 
@@ -917,25 +1548,132 @@ shumate_file_cache_get_tile_finish (ShumateFileCache *self,
 
 
 typedef struct {
-  ShumateFileCache *self;
+  TileCoords coords;
   char *etag;
   GBytes *bytes;
-  char *filename;
 } StoreTileData;
 
 static void
 store_tile_data_free (StoreTileData *data)
 {
-  g_clear_object (&data->self);
   g_clear_pointer (&data->etag, g_free);
   g_clear_pointer (&data->bytes, g_bytes_unref);
-  g_clear_pointer (&data->filename, g_free);
   g_free (data);
 }
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (StoreTileData, store_tile_data_free);
 
-static void on_file_created (GObject *object, GAsyncResult *result, gpointer user_data);
-static void on_file_written (GObject *object, GAsyncResult *result, gpointer user_data);
+static int
+store_tile (CacheDatabase *database, StoreTileData *data, gint64 modtime)
+{
+  g_autofree char *tile_id = NULL;
+  gconstpointer contents;
+  gsize size;
+  int rc;
+
+  contents = g_bytes_get_data (data->bytes, &size);
+
+  /* Tiles with the same contents share one image */
+  tile_id = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, data->bytes);
+
+  sqlite3_reset (database->stmt_store_image);
+  sqlite3_bind_text (database->stmt_store_image, 1, tile_id, -1, SQLITE_STATIC);
+  /* An empty GBytes may have NULL data, which would be bound as NULL */
+  sqlite3_bind_blob64 (database->stmt_store_image, 2, contents ? contents : "", size, SQLITE_STATIC);
+  rc = sqlite3_step (database->stmt_store_image);
+  if (rc != SQLITE_DONE)
+    return rc;
+
+  if (sqlite3_changes (database->db) == 0)
+    database->n_shared_stores ++;
+
+  sqlite3_reset (database->stmt_store);
+  bind_tile_coords (database->stmt_store, &data->coords);
+  sqlite3_bind_text (database->stmt_store, 4, tile_id, -1, SQLITE_STATIC);
+  sqlite3_bind_text (database->stmt_store, 5, data->etag, -1, SQLITE_STATIC);
+  sqlite3_bind_int64 (database->stmt_store, 6, modtime);
+  sqlite3_bind_int64 (database->stmt_store, 7, database->popularity_base + 1);
+
+  /* Replacing the tile resets its popularity, including the hits that
+   * haven't been written yet */
+  g_hash_table_remove (database->popularity_hits, &data->coords);
+
+  return sqlite3_step (database->stmt_store);
+}
+
+/* Writes all the pending stores in one transaction, which is much cheaper
+ * than committing each tile on its own */
+static void
+flush_stores (GTask            *task,
+              ShumateFileCache *self,
+              CacheDatabase    *database,
+              gpointer          task_data)
+{
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
+  g_autoptr(GPtrArray) stores = NULL;
+  g_autoptr(GPtrArray) stored = g_ptr_array_new ();
+  gint64 modtime = g_get_real_time () / G_USEC_PER_SEC;
+  gint64 size;
+
+  /* Stores queued while the previous batch was being written join this
+   * one */
+  g_mutex_lock (&priv->pending_lock);
+  stores = g_steal_pointer (&priv->pending_stores);
+  priv->pending_stores = g_ptr_array_new_with_free_func (g_object_unref);
+  priv->flush_scheduled = FALSE;
+  g_mutex_unlock (&priv->pending_lock);
+
+  if (database->db == NULL)
+    {
+      for (guint i = 0; i < stores->len; i ++)
+        return_database_error (stores->pdata[i], NULL, "Failed to store tile");
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+
+  sqlite3_exec (database->db, "BEGIN", NULL, NULL, NULL);
+
+  for (guint i = 0; i < stores->len; i ++)
+    {
+      GTask *store_task = stores->pdata[i];
+      StoreTileData *data = g_task_get_task_data (store_task);
+
+      if (g_task_return_error_if_cancelled (store_task))
+        continue;
+
+      if (store_tile (database, data, modtime) != SQLITE_DONE)
+        {
+          return_database_error (store_task, database->db, "Failed to insert tile into SQLite database");
+          continue;
+        }
+
+      g_ptr_array_add (stored, store_task);
+    }
+
+  if (sqlite3_exec (database->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      for (guint i = 0; i < stored->len; i ++)
+        return_database_error (stored->pdata[i], database->db, "Failed to commit tiles to SQLite database");
+
+      sqlite3_exec (database->db, "ROLLBACK", NULL, NULL, NULL);
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+
+  for (guint i = 0; i < stored->len; i ++)
+    g_task_return_boolean (stored->pdata[i], TRUE);
+
+  g_debug ("Stored %u tiles; %" G_GUINT64_FORMAT " stored tiles shared their "
+           "contents with another tile so far",
+           stored->len, database->n_shared_stores);
+
+  /* Evict tiles in the background once the cache outgrows its limit. The
+   * size comes from the counter in the metadata table, so checking it is
+   * cheap. */
+  size = get_cache_size (database);
+  if (size > priv->size_limit)
+    evict_tiles (database, EVICTION_LOW_WATERMARK (priv->size_limit));
+
+  g_task_return_boolean (task, TRUE);
+}
 
 /**
  * shumate_file_cache_store_tile_async:
@@ -958,11 +1696,10 @@ shumate_file_cache_store_tile_async (ShumateFileCache *self,
                                      GAsyncReadyCallback callback,
                                      gpointer user_data)
 {
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
   g_autoptr(GTask) task = NULL;
-  g_autofree char *filename = NULL;
-  g_autoptr(GFile) file = NULL;
-  g_autofree char *path = NULL;
   StoreTileData *data;
+  gboolean schedule_flush;
 
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
   g_return_if_fail (SHUMATE_IS_TILE (tile));
@@ -972,99 +1709,26 @@ shumate_file_cache_store_tile_async (ShumateFileCache *self,
   task = g_task_new (self, cancellable, callback, user_data);
   g_task_set_source_tag (task, shumate_file_cache_store_tile_async);
 
-  filename = get_filename (self, tile);
-  file = g_file_new_for_path (filename);
-
   g_debug ("Update of %p", tile);
 
-  /* If needed, create the cache's dirs */
-  path = g_path_get_dirname (filename);
-  if (g_mkdir_with_parents (path, 0700) == -1)
-    {
-      if (errno != EEXIST)
-        {
-          const char *error_string = g_strerror (errno);
-          g_task_return_new_error (task, SHUMATE_FILE_CACHE_ERROR,
-                                   SHUMATE_FILE_CACHE_ERROR_FAILED,
-                                   "Failed to create cache directory %s: %s", path, error_string);
-          return;
-        }
-    }
-
   data = g_new0 (StoreTileData, 1);
-  data->self = g_object_ref (self);
+  tile_coords_init (&data->coords, tile);
   data->etag = g_strdup (etag);
   data->bytes = g_bytes_ref (bytes);
-  data->filename = g_steal_pointer (&filename);
   g_task_set_task_data (task, data, (GDestroyNotify) store_tile_data_free);
 
-  g_file_replace_async (file, NULL, FALSE, G_FILE_CREATE_PRIVATE, G_PRIORITY_DEFAULT, cancellable, on_file_created, g_object_ref (task));
-}
+  g_mutex_lock (&priv->pending_lock);
+  g_ptr_array_add (priv->pending_stores, g_object_ref (task));
+  schedule_flush = !priv->flush_scheduled;
+  priv->flush_scheduled = TRUE;
+  g_mutex_unlock (&priv->pending_lock);
 
-static void
-on_file_created (GObject *object, GAsyncResult *res, gpointer user_data)
-{
-  g_autoptr(GTask) task = user_data;
-  StoreTileData *data = g_task_get_task_data (task);
-  GCancellable *cancellable = g_task_get_cancellable (task);
-  GError *error = NULL;
-  g_autoptr(GFileOutputStream) ostream = NULL;
-  gconstpointer contents;
-  gsize size;
-
-  ostream = g_file_create_finish (G_FILE (object), res, &error);
-  if (error != NULL)
+  if (schedule_flush)
     {
-      g_task_return_error (task, error);
-      return;
+      g_autoptr(GTask) flush_task = g_task_new (self, NULL, NULL, NULL);
+      g_task_set_source_tag (flush_task, flush_stores);
+      run_in_database_thread (self, flush_task, flush_stores);
     }
-
-  contents = g_bytes_get_data (data->bytes, &size);
-
-  g_output_stream_write_all_async (G_OUTPUT_STREAM (ostream),
-                                   contents, size, G_PRIORITY_DEFAULT,
-                                   cancellable, on_file_written, g_object_ref (task));
-}
-
-static void
-on_file_written (GObject *object, GAsyncResult *res, gpointer user_data)
-{
-  g_autoptr(GTask) task = user_data;
-  StoreTileData *data = g_task_get_task_data (task);
-  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (data->self);
-  g_autoptr(sqlite_str) query = NULL;
-  g_autoptr(sqlite_str) sql_error = NULL;
-  GError *error = NULL;
-  guint tile_size = g_bytes_get_size (data->bytes);
-
-  g_output_stream_write_all_finish (G_OUTPUT_STREAM (object), res, NULL, &error);
-  if (error != NULL)
-    {
-      g_task_return_error (task, error);
-      return;
-    }
-
-  query = sqlite3_mprintf ("REPLACE INTO tiles (filename, etag, size) VALUES (%Q, %Q, %d)",
-                           data->filename, data->etag, tile_size);
-  sqlite3_exec (priv->db, query, NULL, NULL, &sql_error);
-  if (sql_error != NULL)
-    {
-      g_task_return_new_error (task, SHUMATE_FILE_CACHE_ERROR, SHUMATE_FILE_CACHE_ERROR_FAILED,
-                               "Failed to insert tile into SQLite database: %s", sql_error);
-      return;
-    }
-
-  priv->size_estimate += tile_size;
-  if (!priv->have_size_estimate || priv->size_estimate > priv->size_limit + 5000000)
-    {
-      /* automatically purge the cache if the size estimate is 5MB over
-       * the limit, or if there is no estimate of the cache size yet */
-
-      shumate_file_cache_purge_cache_async (data->self, NULL, NULL, NULL);
-    }
-
-
-  g_task_return_boolean (task, TRUE);
 }
 
 
@@ -33,4 +33,6 @@ gboolean shumate_kinetic_scrolling_tick (ShumateKineticScrolling *data,
                                          double                   time_delta_us,
                                          double                  *position);
 
+double shumate_kinetic_scrolling_get_end_position (ShumateKineticScrolling *data);
+
 G_END_DECLS
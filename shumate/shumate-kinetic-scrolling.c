@@ -144,3 +144,11 @@ shumate_kinetic_scrolling_tick (ShumateKineticScrolling *data,
 
   return data->phase != SHUMATE_KINETIC_SCROLLING_PHASE_FINISHED;
 }
+
+/* Returns the position at which the deceleration will come to rest, which is
+ * determined by the initial velocity and the friction. */
+double
+shumate_kinetic_scrolling_get_end_position (ShumateKineticScrolling *data)
+{
+  return data->c1;
+}
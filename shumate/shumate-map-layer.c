@@ -17,8 +17,9 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#include "shumate-map-layer.h"
-#include "shumate-memory-cache.h"
+#include "shumate-map-layer-private.h"
+#include "shumate-memory-cache-private.h"
+#include "shumate-tile-index-private.h"
 
 /**
  * ShumateMapLayer:
@@ -31,12 +32,26 @@ struct _ShumateMapLayer
 
   ShumateMapSource *map_source;
 
-  GHashTable *tile_children;
+  /* The tiles being drawn, and the frame time at which the ones that are
+   * fading in got their texture */
+  ShumateTileIndex *tile_children;
+  GHashTable *fading_tiles;
+  guint fade_tick_id;
+  /* The grid of visible tiles, as of the last recompute_grid(), and how many
+   * of its tiles are not filled yet */
   int tile_initial_row;
   int tile_initial_column;
   int required_tiles_rows;
   int required_tiles_columns;
+  int grid_zoom_level;
+  guint n_unfilled_tiles;
   GHashTable *tile_fill;
+  GPtrArray *fill_queue;
+
+  ShumateTileIndex *prefetch_tiles;
+  guint prefetch_budget;
+  double prefetch_direction_x;
+  double prefetch_direction_y;
 
   guint recompute_grid_idle_id;
 
@@ -45,16 +60,39 @@ struct _ShumateMapLayer
 
 G_DEFINE_TYPE (ShumateMapLayer, shumate_map_layer, SHUMATE_TYPE_LAYER)
 
+/* The maximum number of tiles being filled at once. Further tiles wait in
+ * fill_queue, so that the most important ones can be started first when a
+ * slot frees up. */
+#define MAX_FILLS_IN_FLIGHT 8
+
+/* Added to the priority of tiles that are not on the current zoom level, per
+ * level of difference, so they are only filled once the visible tiles are. */
+#define ZOOM_LEVEL_PRIORITY_PENALTY 1000.0
+
+/* Added to the priority of prefetched tiles, so they only use slots that
+ * visible tiles don't need. */
+#define PREFETCH_PRIORITY_PENALTY 100000.0
+
+#define PREFETCH_BUDGET_DEFAULT 32
+
+/* How many zoom levels up to look for a cached tile to stand in for one that
+ * is still loading */
+#define MAX_FALLBACK_ZOOM_LEVELS 6
+
+#define FADE_IN_DURATION (200 * G_TIME_SPAN_MILLISECOND)
+
 enum
 {
   PROP_MAP_SOURCE = 1,
+  PROP_PREFETCH_BUDGET,
+  PROP_MEMORY_CACHE,
   N_PROPERTIES
 };
 
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
 
-/* This struct represents the location of a tile on the screen. It is the key
- * for the hash table tile_children which stores all visible tiles.
+/* This struct represents the location of a tile on the screen. Positions are
+ * the keys of tile_children, the index which stores all visible tiles.
  *
  * Note that, unlike the values given to ShumateTile, the x and y coordinates
  * here are *not* wrapped. For example, a ShumateTile at level 3 might have
@@ -78,42 +116,39 @@ tile_grid_position_init (TileGridPosition *self,
   self->zoom = zoom;
 }
 
-static TileGridPosition *
-tile_grid_position_new (int x,
-                        int y,
-                        int zoom)
-{
-  TileGridPosition *self = g_new0 (TileGridPosition, 1);
-  tile_grid_position_init (self, x, y, zoom);
-  return self;
-}
 
-static guint
-tile_grid_position_hash (gconstpointer pointer)
-{
-  const TileGridPosition *self = pointer;
-  return self->x ^ self->y ^ self->zoom;
-}
-
-static gboolean
-tile_grid_position_equal (gconstpointer a, gconstpointer b)
+/* A tile that is waiting in the fill queue. Lower priority values are more
+ * important. */
+typedef struct
 {
-  const TileGridPosition *pos_a = a;
-  const TileGridPosition *pos_b = b;
-  return pos_a->x == pos_b->x && pos_a->y == pos_b->y && pos_a->zoom == pos_b->zoom;
-}
+  TileGridPosition pos;
+  ShumateTile *tile;
+  gboolean prefetch;
+  double priority;
+} PendingFill;
 
 static void
-tile_grid_position_free (gpointer pointer)
+pending_fill_free (PendingFill *self)
 {
-  TileGridPosition *self = pointer;
-  if (!self)
-    return;
-
+  g_clear_object (&self->tile);
   g_free (self);
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (TileGridPosition, tile_grid_position_free);
+static int
+pending_fill_compare (gconstpointer a, gconstpointer b)
+{
+  const PendingFill *fill_a = *(PendingFill **) a;
+  const PendingFill *fill_b = *(PendingFill **) b;
+
+  /* Sort the most important tiles to the end of the queue, so they can be
+   * popped off cheaply */
+  if (fill_a->priority < fill_b->priority)
+    return 1;
+  else if (fill_a->priority > fill_b->priority)
+    return -1;
+  else
+    return 0;
+}
 
 static int
 positive_mod (int i, int n)
@@ -124,6 +159,8 @@ positive_mod (int i, int n)
 typedef struct {
   ShumateMapLayer *self;
   ShumateTile *tile;
+  TileGridPosition pos;
+  gboolean prefetch;
   char *source_id;
 } TileFilledData;
 
@@ -137,6 +174,63 @@ tile_filled_data_free (TileFilledData *data)
 }
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (TileFilledData, tile_filled_data_free);
 
+static void dispatch_fills (ShumateMapLayer *self);
+static void queue_recompute_grid_in_idle (ShumateMapLayer *self);
+
+static gint64
+get_frame_time (ShumateMapLayer *self)
+{
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (self));
+
+  if (frame_clock == NULL)
+    return g_get_monotonic_time ();
+
+  return gdk_frame_clock_get_frame_time (frame_clock);
+}
+
+static gboolean
+fade_tick_cb (GtkWidget     *widget,
+              GdkFrameClock *frame_clock,
+              gpointer       user_data)
+{
+  ShumateMapLayer *self = SHUMATE_MAP_LAYER (widget);
+  gint64 frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, self->fading_tiles);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      if (frame_time - *(gint64 *) value >= FADE_IN_DURATION)
+        g_hash_table_iter_remove (&iter);
+    }
+
+  gtk_widget_queue_draw (widget);
+
+  if (g_hash_table_size (self->fading_tiles) > 0)
+    return G_SOURCE_CONTINUE;
+
+  self->fade_tick_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+start_fade_in (ShumateMapLayer *self,
+               ShumateTile     *tile)
+{
+  gint64 *start;
+
+  if (!gtk_widget_get_mapped (GTK_WIDGET (self)))
+    return;
+
+  start = g_new (gint64, 1);
+  *start = get_frame_time (self);
+  g_hash_table_insert (self->fading_tiles, g_object_ref (tile), start);
+
+  if (self->fade_tick_id == 0)
+    self->fade_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (self), fade_tick_cb, NULL, NULL);
+}
+
 static void
 on_tile_filled (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
@@ -146,10 +240,37 @@ on_tile_filled (GObject *source_object, GAsyncResult *res, gpointer user_data)
 
   success = shumate_map_source_fill_tile_finish (SHUMATE_MAP_SOURCE (source_object), res, &error);
 
+  /* The layer was disposed while the tile was loading */
+  if (data->self->tile_fill == NULL)
+    return;
+
+  g_hash_table_remove (data->self->tile_fill, data->tile);
+  if (data->prefetch && shumate_tile_index_lookup (data->self->prefetch_tiles, data->pos.x, data->pos.y, data->pos.zoom) == data->tile)
+    shumate_tile_index_remove (data->self->prefetch_tiles, data->pos.x, data->pos.y, data->pos.zoom);
+
+  dispatch_fills (data->self);
+
+  if (data->pos.zoom == data->self->grid_zoom_level
+      && shumate_tile_get_state (data->tile) == SHUMATE_STATE_DONE
+      && shumate_tile_index_lookup (data->self->tile_children, data->pos.x, data->pos.y, data->pos.zoom) == data->tile)
+    {
+      /* Once the whole grid is filled, the tiles left over from other zoom
+       * levels can be dropped */
+      data->self->n_unfilled_tiles --;
+      if (data->self->n_unfilled_tiles == 0)
+        queue_recompute_grid_in_idle (data->self);
+    }
+
   // TODO: Report the error
-  if (!success)
+  if (!success || shumate_tile_get_texture (data->tile) == NULL)
     return;
 
+  if (shumate_tile_index_lookup (data->self->tile_children, data->pos.x, data->pos.y, data->pos.zoom) == data->tile)
+    {
+      if (shumate_tile_get_fade_in (data->tile))
+        start_fade_in (data->self, data->tile);
+    }
+
   shumate_memory_cache_store_texture (data->self->memcache,
                                       data->tile,
                                       shumate_tile_get_texture (data->tile),
@@ -157,29 +278,99 @@ on_tile_filled (GObject *source_object, GAsyncResult *res, gpointer user_data)
 }
 
 static void
-add_tile (ShumateMapLayer *self,
-          ShumateTile     *tile)
+start_fill (ShumateMapLayer   *self,
+            const PendingFill *fill)
+{
+  GCancellable *cancellable = g_cancellable_new ();
+  TileFilledData *data = g_new0 (TileFilledData, 1);
+  data->self = g_object_ref (self);
+  data->tile = g_object_ref (fill->tile);
+  data->pos = fill->pos;
+  data->prefetch = fill->prefetch;
+  data->source_id = g_strdup (shumate_map_source_get_id (self->map_source));
+
+  g_hash_table_insert (self->tile_fill, g_object_ref (fill->tile), cancellable);
+  shumate_map_source_fill_tile_async (self->map_source, fill->tile, cancellable, on_tile_filled, data);
+}
+
+/* Starts filling the most important queued tiles, as long as there are free
+ * slots. */
+static void
+dispatch_fills (ShumateMapLayer *self)
+{
+  while (self->fill_queue->len > 0
+         && g_hash_table_size (self->tile_fill) < MAX_FILLS_IN_FLIGHT)
+    {
+      PendingFill *fill = g_ptr_array_steal_index (self->fill_queue, self->fill_queue->len - 1);
+
+      start_fill (self, fill);
+      pending_fill_free (fill);
+    }
+}
+
+/* Recomputes the priority of every queued tile from its distance to the
+ * center of the viewport, measured in tiles of its own zoom level, and
+ * re-sorts the queue. */
+static void
+update_fill_priorities (ShumateMapLayer *self,
+                        int              zoom_level,
+                        int              longitude_x,
+                        int              latitude_y,
+                        int              tile_size)
+{
+  for (guint i = 0; i < self->fill_queue->len; i ++)
+    {
+      PendingFill *fill = g_ptr_array_index (self->fill_queue, i);
+      double scale = pow (2, zoom_level - fill->pos.zoom) * tile_size;
+      double center_x = longitude_x / scale;
+      double center_y = latitude_y / scale;
+
+      fill->priority = hypot (fill->pos.x + 0.5 - center_x, fill->pos.y + 0.5 - center_y)
+                       + ZOOM_LEVEL_PRIORITY_PENALTY * abs (zoom_level - fill->pos.zoom);
+
+      if (fill->prefetch)
+        fill->priority += PREFETCH_PRIORITY_PENALTY;
+    }
+
+  g_ptr_array_sort (self->fill_queue, pending_fill_compare);
+}
+
+/* A tile's texture can change before its fill is done, for example when
+ * an expired tile from the cache is shown while it is downloaded again, so
+ * the layer redraws whenever that happens */
+static void
+on_tile_texture_changed (ShumateMapLayer *self)
+{
+  gtk_widget_queue_draw (GTK_WIDGET (self));
+}
+
+static void
+add_tile (ShumateMapLayer        *self,
+          const TileGridPosition *pos,
+          ShumateTile            *tile)
 {
   const char *source_id = shumate_map_source_get_id (self->map_source);
 
+  g_signal_connect_swapped (tile, "notify::texture", G_CALLBACK (on_tile_texture_changed), self);
+
   if (!shumate_memory_cache_try_fill_tile (self->memcache, tile, source_id))
     {
-      GCancellable *cancellable = g_cancellable_new ();
-      TileFilledData *data = g_new0 (TileFilledData, 1);
-      data->self = g_object_ref (self);
-      data->tile = g_object_ref (tile);
-      data->source_id = g_strdup (source_id);
+      PendingFill *fill = g_new0 (PendingFill, 1);
+      fill->pos = *pos;
+      fill->tile = g_object_ref (tile);
 
       shumate_tile_set_texture (tile, NULL);
-      shumate_map_source_fill_tile_async (self->map_source, tile, cancellable, on_tile_filled, data);
-      g_hash_table_insert (self->tile_fill, g_object_ref (tile), cancellable);
-    }
 
-  gtk_widget_insert_before (GTK_WIDGET (tile), GTK_WIDGET (self), NULL);
+      /* The priority is computed at the end of recompute_grid(), together
+       * with the rest of the queue */
+      g_ptr_array_add (self->fill_queue, fill);
+    }
 }
 
+/* Cancels the tile's fill, or drops it from the queue if it hasn't started
+ * yet */
 static void
-remove_tile (ShumateMapLayer *self,
+cancel_fill (ShumateMapLayer *self,
              ShumateTile     *tile)
 {
   GCancellable *cancellable = g_hash_table_lookup (self->tile_fill, tile);
@@ -188,19 +379,132 @@ remove_tile (ShumateMapLayer *self,
       g_cancellable_cancel (cancellable);
       g_hash_table_remove (self->tile_fill, tile);
     }
+  else
+    {
+      for (guint i = 0; i < self->fill_queue->len; i ++)
+        {
+          PendingFill *fill = g_ptr_array_index (self->fill_queue, i);
+          if (fill->tile == tile)
+            {
+              g_ptr_array_remove_index (self->fill_queue, i);
+              break;
+            }
+        }
+    }
+}
+
+static void
+remove_tile (ShumateMapLayer *self,
+             ShumateTile     *tile)
+{
+  cancel_fill (self, tile);
+  g_hash_table_remove (self->fading_tiles, tile);
+  g_signal_handlers_disconnect_by_func (tile, on_tile_texture_changed, self);
+}
+
+static void
+cancel_prefetch (ShumateMapLayer *self)
+{
+  ShumateTileIndexIter iter;
+  gpointer value;
+
+  shumate_tile_index_iter_init (&iter, self->prefetch_tiles);
+  while (shumate_tile_index_iter_next (&iter, NULL, NULL, NULL, &value))
+    cancel_fill (self, value);
 
-  gtk_widget_unparent (GTK_WIDGET (tile));
+  shumate_tile_index_remove_all (self->prefetch_tiles);
+}
+
+typedef void (*GridCellFunc) (ShumateMapLayer *self,
+                              int              x,
+                              int              y,
+                              int              zoom);
+
+/* Calls func on every cell of the first rectangle that is not in the second
+ * one, without visiting the cells they share */
+static void
+foreach_cell_in_difference (ShumateMapLayer *self,
+                            int              column,
+                            int              row,
+                            int              columns,
+                            int              rows,
+                            int              other_column,
+                            int              other_row,
+                            int              other_columns,
+                            int              other_rows,
+                            int              zoom,
+                            GridCellFunc     func)
+{
+  for (int x = column; x < column + columns; x ++)
+    {
+      if (x < other_column || x >= other_column + other_columns)
+        {
+          for (int y = row; y < row + rows; y ++)
+            func (self, x, y, zoom);
+        }
+      else
+        {
+          for (int y = row; y < MIN (row + rows, other_row); y ++)
+            func (self, x, y, zoom);
+          for (int y = MAX (row, other_row + other_rows); y < row + rows; y ++)
+            func (self, x, y, zoom);
+        }
+    }
+}
+
+static void
+remove_grid_tile (ShumateMapLayer *self,
+                  int              x,
+                  int              y,
+                  int              zoom)
+{
+  ShumateTile *tile = shumate_tile_index_lookup (self->tile_children, x, y, zoom);
+
+  if (tile == NULL)
+    return;
+
+  if (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
+    self->n_unfilled_tiles --;
+
+  remove_tile (self, tile);
+  shumate_tile_index_remove (self->tile_children, x, y, zoom);
+}
+
+static void
+ensure_grid_tile (ShumateMapLayer *self,
+                  int              x,
+                  int              y,
+                  int              zoom)
+{
+  ShumateTile *tile = shumate_tile_index_lookup (self->tile_children, x, y, zoom);
+
+  if (!tile)
+    {
+      int source_rows = shumate_map_source_get_row_count (self->map_source, zoom);
+      int source_columns = shumate_map_source_get_column_count (self->map_source, zoom);
+      int tile_size = shumate_map_source_get_tile_size (self->map_source);
+      TileGridPosition pos;
+
+      tile_grid_position_init (&pos, x, y, zoom);
+      tile = g_object_ref_sink (shumate_tile_new_full (positive_mod (x, source_columns), positive_mod (y, source_rows), tile_size, zoom));
+      add_tile (self, &pos, tile);
+      shumate_tile_index_insert (self->tile_children, x, y, zoom, tile);
+    }
+
+  if (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
+    self->n_unfilled_tiles ++;
 }
 
 static void
 recompute_grid (ShumateMapLayer *self)
 {
   /* Computes which tile positions are visible, ensures that all the right
-   * tiles are added to the ShumateMapLayer widget, and removes tiles which are
-   * no longer visible. */
+   * tiles are in tile_children, and removes tiles which are no longer
+   * visible. */
 
-  GHashTableIter iter;
-  gpointer key, value;
+  ShumateTileIndexIter iter;
+  TileGridPosition pos;
+  gpointer value;
 
   int width = gtk_widget_get_width (GTK_WIDGET (self));
   int height = gtk_widget_get_height (GTK_WIDGET (self));
@@ -211,8 +515,6 @@ recompute_grid (ShumateMapLayer *self)
   double longitude = shumate_location_get_longitude (SHUMATE_LOCATION (viewport));
   int latitude_y = shumate_map_source_get_y (self->map_source, zoom_level, latitude);
   int longitude_x = shumate_map_source_get_x (self->map_source, zoom_level, longitude);
-  int source_rows = shumate_map_source_get_row_count (self->map_source, zoom_level);
-  int source_columns = shumate_map_source_get_column_count (self->map_source, zoom_level);
 
   double rotation = shumate_viewport_get_rotation (viewport);
 
@@ -232,71 +534,80 @@ recompute_grid (ShumateMapLayer *self)
   int required_columns = (size_x * 2 / tile_size) + 2;
   int required_rows = (size_y * 2 / tile_size) + 2;
 
-  gboolean all_filled = TRUE;
-
-  /* First, remove all the tiles that aren't in bounds. For now, ignore tiles
-   * that aren't on the current zoom level--those are only removed once the
-   * current level is fully loaded */
-  g_hash_table_iter_init (&iter, self->tile_children);
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  if (zoom_level == self->grid_zoom_level)
     {
-      TileGridPosition *pos = key;
-      ShumateTile *tile = value;
-
-      if ((pos->x < tile_initial_column
-          || pos->x >= tile_initial_column + required_columns
-          || pos->y < tile_initial_row
-          || pos->y >= tile_initial_row + required_rows)
-          && pos->zoom == zoom_level)
-        {
-          remove_tile (self, tile);
-          g_hash_table_iter_remove (&iter);
-        }
+      /* A pan usually moves the grid by less than a tile, so only the rows
+       * and columns that left or entered it need to be touched */
+      foreach_cell_in_difference (self,
+                                  self->tile_initial_column, self->tile_initial_row,
+                                  self->required_tiles_columns, self->required_tiles_rows,
+                                  tile_initial_column, tile_initial_row,
+                                  required_columns, required_rows,
+                                  zoom_level, remove_grid_tile);
+      foreach_cell_in_difference (self,
+                                  tile_initial_column, tile_initial_row,
+                                  required_columns, required_rows,
+                                  self->tile_initial_column, self->tile_initial_row,
+                                  self->required_tiles_columns, self->required_tiles_rows,
+                                  zoom_level, ensure_grid_tile);
     }
-
-  /* Next, make sure every visible tile position has a matching ShumateTile
-   * widget. */
-  for (int x = tile_initial_column; x < tile_initial_column + required_columns; x ++)
+  else
     {
-      for (int y = tile_initial_row; y < tile_initial_row + required_rows; y ++)
+      /* First, remove all the tiles that aren't in bounds. For now, ignore
+       * tiles that aren't on the current zoom level--those are only removed
+       * once the current level is fully loaded */
+      shumate_tile_index_iter_init (&iter, self->tile_children);
+      while (shumate_tile_index_iter_next (&iter, &pos.x, &pos.y, &pos.zoom, &value))
         {
-          g_autoptr(TileGridPosition) pos = tile_grid_position_new (x, y, zoom_level);
-          ShumateTile *tile = g_hash_table_lookup (self->tile_children, pos);
+          ShumateTile *tile = value;
 
-          if (!tile)
+          if ((pos.x < tile_initial_column
+              || pos.x >= tile_initial_column + required_columns
+              || pos.y < tile_initial_row
+              || pos.y >= tile_initial_row + required_rows)
+              && pos.zoom == zoom_level)
             {
-              tile = shumate_tile_new_full (positive_mod (x, source_columns), positive_mod (y, source_rows), tile_size, zoom_level);
-              g_hash_table_insert (self->tile_children, g_steal_pointer (&pos), g_object_ref (tile));
-              add_tile (self, tile);
+              remove_tile (self, tile);
+              shumate_tile_index_iter_remove (&iter);
             }
-
-          if (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
-            all_filled = FALSE;
         }
+
+      /* Next, make sure every visible tile position has a matching
+       * ShumateTile. */
+      self->n_unfilled_tiles = 0;
+      for (int x = tile_initial_column; x < tile_initial_column + required_columns; x ++)
+        for (int y = tile_initial_row; y < tile_initial_row + required_rows; y ++)
+          ensure_grid_tile (self, x, y, zoom_level);
     }
 
+  self->tile_initial_column = tile_initial_column;
+  self->tile_initial_row = tile_initial_row;
+  self->required_tiles_columns = required_columns;
+  self->required_tiles_rows = required_rows;
+  self->grid_zoom_level = zoom_level;
+
   /* If all the tiles on the current zoom level are filled, delete tiles on all
-   * other zoom levels */
-  if (all_filled)
+   * other zoom levels. The grid is exactly the tiles on the current level, so
+   * there are others only if the index holds more than that. */
+  if (self->n_unfilled_tiles == 0
+      && shumate_tile_index_get_size (self->tile_children) > (guint) (required_columns * required_rows))
     {
-      g_hash_table_iter_init (&iter, self->tile_children);
-      while (g_hash_table_iter_next (&iter, &key, &value))
+      shumate_tile_index_iter_init (&iter, self->tile_children);
+      while (shumate_tile_index_iter_next (&iter, &pos.x, &pos.y, &pos.zoom, &value))
         {
-          TileGridPosition *pos = key;
           ShumateTile *tile = value;
 
-          if (pos->zoom != zoom_level)
+          if (pos.zoom != zoom_level)
             {
               remove_tile (self, tile);
-              g_hash_table_iter_remove (&iter);
+              shumate_tile_index_iter_remove (&iter);
             }
         }
     }
 
-  self->tile_initial_column = tile_initial_column;
-  self->tile_initial_row = tile_initial_row;
-  self->required_tiles_columns = required_columns;
-  self->required_tiles_rows = required_rows;
+  /* The viewport moved, so the tiles closest to its center may have changed */
+  update_fill_priorities (self, zoom_level, longitude_x, latitude_y, tile_size);
+  dispatch_fills (self);
 }
 
 static gboolean
@@ -320,7 +631,11 @@ queue_recompute_grid_in_idle (ShumateMapLayer *self)
   if (self->recompute_grid_idle_id > 0)
     return;
 
-  self->recompute_grid_idle_id = g_idle_add (recompute_grid_in_idle_cb, self);
+  /* Run before the next frame is drawn, which happens at a lower priority */
+  self->recompute_grid_idle_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+                                                  recompute_grid_in_idle_cb,
+                                                  self,
+                                                  NULL);
   g_source_set_name_by_id (self->recompute_grid_idle_id,
                            "[shumate] recompute_grid_in_idle_cb");
 }
@@ -332,8 +647,8 @@ on_view_longitude_changed (ShumateMapLayer *self,
 {
   g_assert (SHUMATE_IS_MAP_LAYER (self));
 
-  recompute_grid (self);
-  gtk_widget_queue_allocate (GTK_WIDGET (self));
+  queue_recompute_grid_in_idle (self);
+  gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
 static void
@@ -343,8 +658,8 @@ on_view_latitude_changed (ShumateMapLayer *self,
 {
   g_assert (SHUMATE_IS_MAP_LAYER (self));
 
-  recompute_grid (self);
-  gtk_widget_queue_allocate (GTK_WIDGET (self));
+  queue_recompute_grid_in_idle (self);
+  gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
 static void
@@ -354,8 +669,8 @@ on_view_zoom_level_changed (ShumateMapLayer *self,
 {
   g_assert (SHUMATE_IS_MAP_LAYER (self));
 
-  recompute_grid (self);
-  gtk_widget_queue_allocate (GTK_WIDGET (self));
+  queue_recompute_grid_in_idle (self);
+  gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
 static void
@@ -365,7 +680,9 @@ on_view_rotation_changed (ShumateMapLayer *self,
 {
   g_assert (SHUMATE_IS_MAP_LAYER (self));
 
-  gtk_widget_queue_allocate (GTK_WIDGET (self));
+  /* The rotation changes how many tiles are needed to cover the view */
+  queue_recompute_grid_in_idle (self);
+  gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
 static void
@@ -382,6 +699,14 @@ shumate_map_layer_set_property (GObject      *object,
       g_set_object (&self->map_source, g_value_get_object (value));
       break;
 
+    case PROP_PREFETCH_BUDGET:
+      shumate_map_layer_set_prefetch_budget (self, g_value_get_uint (value));
+      break;
+
+    case PROP_MEMORY_CACHE:
+      shumate_map_layer_set_memory_cache (self, g_value_get_object (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -402,6 +727,14 @@ shumate_map_layer_get_property (GObject    *object,
       g_value_set_object (value, self->map_source);
       break;
 
+    case PROP_PREFETCH_BUDGET:
+      g_value_set_uint (value, self->prefetch_budget);
+      break;
+
+    case PROP_MEMORY_CACHE:
+      g_value_set_object (value, self->memcache);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -413,15 +746,32 @@ shumate_map_layer_dispose (GObject *object)
 {
   ShumateMapLayer *self = SHUMATE_MAP_LAYER (object);
   ShumateViewport *viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
-  GtkWidget *child;
 
   g_signal_handlers_disconnect_by_data (viewport, self);
-  while ((child = gtk_widget_get_first_child (GTK_WIDGET (object))))
-    gtk_widget_unparent (child);
+
+  if (self->fade_tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (GTK_WIDGET (self), self->fade_tick_id);
+      self->fade_tick_id = 0;
+    }
 
   g_clear_handle_id (&self->recompute_grid_idle_id, g_source_remove);
+  g_clear_pointer (&self->prefetch_tiles, shumate_tile_index_free);
+  g_clear_pointer (&self->fill_queue, g_ptr_array_unref);
   g_clear_pointer (&self->tile_fill, g_hash_table_unref);
-  g_clear_pointer (&self->tile_children, g_hash_table_unref);
+  g_clear_pointer (&self->fading_tiles, g_hash_table_unref);
+
+  /* Tiles that are still being filled outlive the layer */
+  if (self->tile_children != NULL)
+    {
+      ShumateTileIndexIter iter;
+      gpointer value;
+
+      shumate_tile_index_iter_init (&iter, self->tile_children);
+      while (shumate_tile_index_iter_next (&iter, NULL, NULL, NULL, &value))
+        g_signal_handlers_disconnect_by_func (value, on_tile_texture_changed, self);
+    }
+  g_clear_pointer (&self->tile_children, shumate_tile_index_free);
   g_clear_object (&self->map_source);
   g_clear_object (&self->memcache);
 
@@ -451,36 +801,6 @@ shumate_map_layer_size_allocate (GtkWidget *widget,
                                  int        baseline)
 {
   ShumateMapLayer *self = SHUMATE_MAP_LAYER (widget);
-  ShumateViewport *viewport;
-  GtkAllocation child_allocation;
-  int tile_size;
-  int zoom_level;
-  double latitude, longitude;
-  int longitude_x, latitude_y;
-
-  GHashTableIter iter;
-  gpointer key, value;
-
-  viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
-  tile_size = shumate_map_source_get_tile_size (self->map_source);
-  zoom_level = (guint) shumate_viewport_get_zoom_level (viewport);
-  latitude = shumate_location_get_latitude (SHUMATE_LOCATION (viewport));
-  longitude = shumate_location_get_longitude (SHUMATE_LOCATION (viewport));
-  latitude_y = (guint) shumate_map_source_get_y (self->map_source, zoom_level, latitude);
-  longitude_x = (guint) shumate_map_source_get_x (self->map_source, zoom_level, longitude);
-
-  g_hash_table_iter_init (&iter, self->tile_children);
-  while (g_hash_table_iter_next (&iter, &key, &value))
-    {
-      TileGridPosition *pos = key;
-      ShumateTile *tile = value;
-
-      child_allocation.width = tile_size * pow (2, zoom_level - pos->zoom);
-      child_allocation.height = child_allocation.width;
-      child_allocation.x = -(longitude_x - width/2) + child_allocation.width * pos->x;
-      child_allocation.y = -(latitude_y - height/2) + child_allocation.height * pos->y;
-      gtk_widget_size_allocate (GTK_WIDGET (tile), &child_allocation, baseline);
-    }
 
   /* We can't recompute while allocating, so queue an idle callback to run
    * the recomputation outside the allocation cycle.
@@ -521,6 +841,70 @@ shumate_map_layer_measure (GtkWidget      *widget,
     }
 }
 
+/* Draws a placeholder for a tile that is still loading: the matching part of
+ * its nearest cached ancestor, scaled up, with any of its cached children on
+ * top. */
+static void
+snapshot_tile_fallback (ShumateMapLayer       *self,
+                        GtkSnapshot           *snapshot,
+                        ShumateTile           *tile,
+                        const graphene_rect_t *bounds)
+{
+  const char *source_id = shumate_map_source_get_id (self->map_source);
+  guint min_zoom = shumate_map_source_get_min_zoom_level (self->map_source);
+  guint max_zoom = shumate_map_source_get_max_zoom_level (self->map_source);
+  guint x = shumate_tile_get_x (tile);
+  guint y = shumate_tile_get_y (tile);
+  guint zoom_level = shumate_tile_get_zoom_level (tile);
+
+  gtk_snapshot_push_clip (snapshot, bounds);
+
+  for (guint levels = 1; levels <= MAX_FALLBACK_ZOOM_LEVELS && zoom_level >= min_zoom + levels; levels ++)
+    {
+      GdkTexture *texture = shumate_memory_cache_lookup_texture (self->memcache,
+                                                                 x >> levels,
+                                                                 y >> levels,
+                                                                 zoom_level - levels,
+                                                                 source_id);
+      if (texture != NULL)
+        {
+          /* The ancestor covers n * n tiles on this level */
+          guint n = 1 << levels;
+
+          gtk_snapshot_append_texture (snapshot,
+                                       texture,
+                                       &GRAPHENE_RECT_INIT (bounds->origin.x - (x % n) * bounds->size.width,
+                                                            bounds->origin.y - (y % n) * bounds->size.height,
+                                                            bounds->size.width * n,
+                                                            bounds->size.height * n));
+          break;
+        }
+    }
+
+  if (zoom_level < max_zoom)
+    {
+      for (guint i = 0; i < 4; i ++)
+        {
+          guint child_x = i % 2;
+          guint child_y = i / 2;
+          GdkTexture *texture = shumate_memory_cache_lookup_texture (self->memcache,
+                                                                     x * 2 + child_x,
+                                                                     y * 2 + child_y,
+                                                                     zoom_level + 1,
+                                                                     source_id);
+          if (texture != NULL)
+            gtk_snapshot_append_texture (snapshot,
+                                         texture,
+                                         &GRAPHENE_RECT_INIT (bounds->origin.x + child_x * bounds->size.width / 2,
+                                                              bounds->origin.y + child_y * bounds->size.height / 2,
+                                                              bounds->size.width / 2,
+                                                              bounds->size.height / 2));
+        }
+    }
+
+  gtk_snapshot_pop (snapshot);
+}
+
 static void
 shumate_map_layer_snapshot (GtkWidget *widget, GtkSnapshot *snapshot)
 {
@@ -531,6 +915,14 @@ shumate_map_layer_snapshot (GtkWidget *widget, GtkSnapshot *snapshot)
   int width = gtk_widget_get_width (GTK_WIDGET (self));
   int height = gtk_widget_get_height (GTK_WIDGET (self));
   double rotation = shumate_viewport_get_rotation (viewport);
+  ShumateTileIndexIter iter;
+  TileGridPosition pos;
+  gpointer value;
+  int tile_size;
+  int zoom;
+  double latitude, longitude;
+  int latitude_y, longitude_x;
+  gint64 frame_time;
 
   /* Scale and rotate around the center of the view */
   gtk_snapshot_translate (snapshot, &GRAPHENE_POINT_INIT (width / 2.0, height / 2.0));
@@ -538,7 +930,63 @@ shumate_map_layer_snapshot (GtkWidget *widget, GtkSnapshot *snapshot)
   gtk_snapshot_rotate (snapshot, rotation * 180 / G_PI);
   gtk_snapshot_translate (snapshot, &GRAPHENE_POINT_INIT (-width / 2.0, -height / 2.0));
 
-  GTK_WIDGET_CLASS (shumate_map_layer_parent_class)->snapshot (widget, snapshot);
+  if (self->map_source == NULL)
+    return;
+
+  tile_size = shumate_map_source_get_tile_size (self->map_source);
+  zoom = (int) zoom_level;
+  latitude = shumate_location_get_latitude (SHUMATE_LOCATION (viewport));
+  longitude = shumate_location_get_longitude (SHUMATE_LOCATION (viewport));
+  latitude_y = (guint) shumate_map_source_get_y (self->map_source, zoom, latitude);
+  longitude_x = (guint) shumate_map_source_get_x (self->map_source, zoom, longitude);
+  frame_time = get_frame_time (self);
+
+  /* Tiles are drawn straight from their textures rather than as child
+   * widgets, so panning doesn't have to measure and allocate each of them.
+   * Tiles left over from other zoom levels go first, so the current level
+   * is drawn on top. */
+  for (int pass = 0; pass < 2; pass ++)
+    {
+      shumate_tile_index_iter_init (&iter, self->tile_children);
+      while (shumate_tile_index_iter_next (&iter, &pos.x, &pos.y, &pos.zoom, &value))
+        {
+          ShumateTile *tile = value;
+          GdkTexture *texture = shumate_tile_get_texture (tile);
+          gint64 *fade_start;
+          double size;
+          graphene_rect_t bounds;
+
+          if ((pos.zoom == zoom) != (pass == 1))
+            continue;
+
+          size = tile_size * pow (2, zoom - pos.zoom);
+          bounds = GRAPHENE_RECT_INIT (-(longitude_x - width/2) + size * pos.x,
+                                       -(latitude_y - height/2) + size * pos.y,
+                                       size,
+                                       size);
+
+          fade_start = g_hash_table_lookup (self->fading_tiles, tile);
+
+          /* Draw placeholders behind the tiles of the current zoom level that
+           * are still loading or fading in */
+          if (pass == 1 && (texture == NULL || fade_start != NULL))
+            snapshot_tile_fallback (self, snapshot, tile, &bounds);
+
+          if (texture == NULL)
+            continue;
+
+          if (fade_start != NULL)
+            {
+              double progress = (double) (frame_time - *fade_start) / FADE_IN_DURATION;
+
+              gtk_snapshot_push_opacity (snapshot, CLAMP (progress, 0.0, 1.0));
+              gtk_snapshot_append_texture (snapshot, texture, &bounds);
+              gtk_snapshot_pop (snapshot);
+            }
+          else
+            gtk_snapshot_append_texture (snapshot, texture, &bounds);
+        }
+    }
 }
 
 static const char *
@@ -589,6 +1037,36 @@ shumate_map_layer_class_init (ShumateMapLayerClass *klass)
                          SHUMATE_TYPE_MAP_SOURCE,
                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * ShumateMapLayer:prefetch-budget:
+   *
+   * The maximum number of tiles that may be loaded ahead of the viewport
+   * while the map is moving, for example during a kinetic scroll or a
+   * [method@Map.go_to] animation. Set to 0 to disable prefetching.
+   */
+  obj_properties[PROP_PREFETCH_BUDGET] =
+    g_param_spec_uint ("prefetch-budget",
+                       "Prefetch budget",
+                       "The maximum number of tiles to load ahead of the viewport",
+                       0,
+                       G_MAXUINT,
+                       PREFETCH_BUDGET_DEFAULT,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+
+  /**
+   * ShumateMapLayer:memory-cache:
+   *
+   * The cache holding the textures of recently loaded tiles. Each layer has a
+   * cache of its own by default; layers can share one by setting the same
+   * cache on all of them, for example [func@MemoryCache.dup_shared].
+   */
+  obj_properties[PROP_MEMORY_CACHE] =
+    g_param_spec_object ("memory-cache",
+                         "Memory cache",
+                         "The cache for loaded tile textures",
+                         SHUMATE_TYPE_MEMORY_CACHE,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+
   g_object_class_install_properties (object_class,
                                      N_PROPERTIES,
                                      obj_properties);
@@ -597,9 +1075,13 @@ shumate_map_layer_class_init (ShumateMapLayerClass *klass)
 static void
 shumate_map_layer_init (ShumateMapLayer *self)
 {
-  self->tile_children = g_hash_table_new_full (tile_grid_position_hash, tile_grid_position_equal, tile_grid_position_free, g_object_unref);
+  self->tile_children = shumate_tile_index_new (g_object_unref);
+  self->fading_tiles = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, g_free);
   self->tile_fill = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, g_object_unref);
-  self->memcache = shumate_memory_cache_new_full (100);
+  self->fill_queue = g_ptr_array_new_with_free_func ((GDestroyNotify) pending_fill_free);
+  self->prefetch_tiles = shumate_tile_index_new (g_object_unref);
+  self->prefetch_budget = PREFETCH_BUDGET_DEFAULT;
+  self->grid_zoom_level = -1;
 }
 
 ShumateMapLayer *
@@ -611,3 +1093,211 @@ shumate_map_layer_new (ShumateMapSource *map_source,
                        "viewport", viewport,
                        NULL);
 }
+
+/**
+ * shumate_map_layer_get_memory_cache:
+ * @self: a [class@MapLayer]
+ *
+ * Gets the cache holding the textures of recently loaded tiles.
+ *
+ * Returns: (transfer none): the layer's [class@MemoryCache]
+ */
+ShumateMemoryCache *
+shumate_map_layer_get_memory_cache (ShumateMapLayer *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_LAYER (self), NULL);
+
+  return self->memcache;
+}
+
+/**
+ * shumate_map_layer_set_memory_cache:
+ * @self: a [class@MapLayer]
+ * @memory_cache: (nullable): a [class@MemoryCache], or %NULL to give the
+ *   layer a cache of its own
+ *
+ * Sets the cache holding the textures of recently loaded tiles. Setting the
+ * same cache on several layers, such as the one returned by
+ * [func@MemoryCache.dup_shared], lets them share the textures of tiles from
+ * the same source instead of decoding and storing them once per layer.
+ */
+void
+shumate_map_layer_set_memory_cache (ShumateMapLayer    *self,
+                                    ShumateMemoryCache *memory_cache)
+{
+  g_autoptr(ShumateMemoryCache) cache = NULL;
+
+  g_return_if_fail (SHUMATE_IS_MAP_LAYER (self));
+  g_return_if_fail (memory_cache == NULL || SHUMATE_IS_MEMORY_CACHE (memory_cache));
+
+  if (memory_cache != NULL)
+    cache = g_object_ref (memory_cache);
+  else
+    /* The cache is bounded by the size of the textures rather than by their
+     * number, since a high-DPI tile costs several times as much memory */
+    cache = g_object_new (SHUMATE_TYPE_MEMORY_CACHE,
+                          "size-limit", G_MAXINT,
+                          NULL);
+
+  if (g_set_object (&self->memcache, cache))
+    g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_MEMORY_CACHE]);
+}
+
+/**
+ * shumate_map_layer_get_prefetch_budget:
+ * @self: a [class@MapLayer]
+ *
+ * Gets the maximum number of tiles that are loaded ahead of the viewport
+ * while the map is moving.
+ *
+ * Returns: the prefetch budget
+ */
+guint
+shumate_map_layer_get_prefetch_budget (ShumateMapLayer *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_LAYER (self), 0);
+
+  return self->prefetch_budget;
+}
+
+/**
+ * shumate_map_layer_set_prefetch_budget:
+ * @self: a [class@MapLayer]
+ * @budget: the maximum number of tiles to prefetch, or 0 to disable
+ *   prefetching
+ *
+ * Sets the maximum number of tiles that are loaded ahead of the viewport
+ * while the map is moving.
+ */
+void
+shumate_map_layer_set_prefetch_budget (ShumateMapLayer *self,
+                                       guint            budget)
+{
+  g_return_if_fail (SHUMATE_IS_MAP_LAYER (self));
+
+  if (self->prefetch_budget == budget)
+    return;
+
+  self->prefetch_budget = budget;
+  if (budget == 0)
+    cancel_prefetch (self);
+
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_PREFETCH_BUDGET]);
+}
+
+/* Queues the tiles that will come into view while the viewport moves towards
+ * the given location, up to the prefetch budget. The filled tiles are kept in
+ * the memory cache (and the source's own caches), so they show up instantly
+ * once they are needed. */
+void
+shumate_map_layer_prefetch (ShumateMapLayer *self,
+                            double           latitude,
+                            double           longitude)
+{
+  ShumateViewport *viewport;
+  const char *source_id;
+  int tile_size;
+  int zoom_level;
+  int source_rows, source_columns;
+  double center_x, center_y;
+  double direction_x, direction_y;
+  double distance, map_width;
+  double size_x, size_y;
+  guint queued;
+
+  g_return_if_fail (SHUMATE_IS_MAP_LAYER (self));
+
+  if (self->prefetch_budget == 0 || self->map_source == NULL)
+    return;
+
+  viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
+  source_id = shumate_map_source_get_id (self->map_source);
+  tile_size = shumate_map_source_get_tile_size (self->map_source);
+  zoom_level = shumate_viewport_get_zoom_level (viewport);
+  source_rows = shumate_map_source_get_row_count (self->map_source, zoom_level);
+  source_columns = shumate_map_source_get_column_count (self->map_source, zoom_level);
+
+  center_x = shumate_map_source_get_x (self->map_source, zoom_level, shumate_location_get_longitude (SHUMATE_LOCATION (viewport)));
+  center_y = shumate_map_source_get_y (self->map_source, zoom_level, shumate_location_get_latitude (SHUMATE_LOCATION (viewport)));
+  direction_x = shumate_map_source_get_x (self->map_source, zoom_level, longitude) - center_x;
+  direction_y = shumate_map_source_get_y (self->map_source, zoom_level, latitude) - center_y;
+
+  /* Take the short way around the antimeridian */
+  map_width = (double) source_columns * tile_size;
+  if (direction_x > map_width / 2)
+    direction_x -= map_width;
+  else if (direction_x < -map_width / 2)
+    direction_x += map_width;
+
+  distance = hypot (direction_x, direction_y);
+  if (distance < 1.0)
+    return;
+
+  direction_x /= distance;
+  direction_y /= distance;
+
+  /* Tiles prefetched for the previous motion are useless once it changes
+   * direction */
+  if (direction_x * self->prefetch_direction_x + direction_y * self->prefetch_direction_y < 0)
+    cancel_prefetch (self);
+
+  self->prefetch_direction_x = direction_x;
+  self->prefetch_direction_y = direction_y;
+
+  /* Half the size of the visible grid, as computed by recompute_grid() */
+  size_x = MAX (0, self->required_tiles_columns - 2) * tile_size / 2.0;
+  size_y = MAX (0, self->required_tiles_rows - 2) * tile_size / 2.0;
+
+  /* Walk along the motion one tile at a time, queueing the tiles the viewport
+   * will cover, starting with the ring just past the leading edge */
+  queued = shumate_tile_index_get_size (self->prefetch_tiles);
+  for (double step = tile_size; queued < self->prefetch_budget; step += tile_size)
+    {
+      double t = MIN (step, distance);
+      double x = center_x + direction_x * t;
+      double y = center_y + direction_y * t;
+      int first_column = floor ((x - size_x) / tile_size);
+      int first_row = floor ((y - size_y) / tile_size);
+      int last_column = floor ((x + size_x) / tile_size);
+      int last_row = floor ((y + size_y) / tile_size);
+
+      for (int column = first_column; column <= last_column && queued < self->prefetch_budget; column ++)
+        {
+          for (int row = first_row; row <= last_row && queued < self->prefetch_budget; row ++)
+            {
+              TileGridPosition pos;
+              g_autoptr(ShumateTile) tile = NULL;
+              PendingFill *fill;
+
+              tile_grid_position_init (&pos, column, row, zoom_level);
+
+              if (shumate_tile_index_contains (self->tile_children, column, row, zoom_level)
+                  || shumate_tile_index_contains (self->prefetch_tiles, column, row, zoom_level))
+                continue;
+
+              tile = g_object_ref_sink (shumate_tile_new_full (positive_mod (column, source_columns),
+                                                               positive_mod (row, source_rows),
+                                                               tile_size,
+                                                               zoom_level));
+
+              if (shumate_memory_cache_try_fill_tile (self->memcache, tile, source_id))
+                continue;
+
+              fill = g_new0 (PendingFill, 1);
+              fill->pos = pos;
+              fill->tile = g_object_ref (tile);
+              fill->prefetch = TRUE;
+              g_ptr_array_add (self->fill_queue, fill);
+
+              shumate_tile_index_insert (self->prefetch_tiles, column, row, zoom_level, g_object_ref (tile));
+              queued ++;
+            }
+        }
+
+      if (t >= distance)
+        break;
+    }
+
+  update_fill_priorities (self, zoom_level, center_x, center_y, tile_size);
+  dispatch_fills (self);
+}
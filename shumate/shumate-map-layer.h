@@ -26,6 +26,7 @@
 
 #include <shumate/shumate-layer.h>
 #include <shumate/shumate-map-source.h>
+#include <shumate/shumate-memory-cache.h>
 
 G_BEGIN_DECLS
 
@@ -35,6 +36,14 @@ G_DECLARE_FINAL_TYPE (ShumateMapLayer, shumate_map_layer, SHUMATE, MAP_LAYER, Sh
 ShumateMapLayer *shumate_map_layer_new (ShumateMapSource *map_source,
                                         ShumateViewport  *viewport);
 
+ShumateMemoryCache *shumate_map_layer_get_memory_cache (ShumateMapLayer    *self);
+void                shumate_map_layer_set_memory_cache (ShumateMapLayer    *self,
+                                                        ShumateMemoryCache *memory_cache);
+
+guint shumate_map_layer_get_prefetch_budget (ShumateMapLayer *self);
+void  shumate_map_layer_set_prefetch_budget (ShumateMapLayer *self,
+                                             guint            budget);
+
 G_END_DECLS
 
 #endif /* __SHUMATE_MAP_LAYER_H__ */
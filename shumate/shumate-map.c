@@ -44,7 +44,7 @@
 #include "shumate-enum-types.h"
 #include "shumate-kinetic-scrolling-private.h"
 #include "shumate-marshal.h"
-#include "shumate-map-layer.h"
+#include "shumate-map-layer-private.h"
 #include "shumate-map-source.h"
 #include "shumate-map-source-registry.h"
 #include "shumate-tile.h"
@@ -241,6 +241,24 @@ move_viewport_from_pixel_offset (ShumateMap *self,
   shumate_location_set_location (SHUMATE_LOCATION (priv->viewport), lat, lon);
 }
 
+/* Asks the map layers to start loading the tiles between the current location
+ * and the one the viewport is moving towards */
+static void
+prefetch_location (ShumateMap *self,
+                   double      latitude,
+                   double      longitude)
+{
+  GtkWidget *child;
+
+  for (child = gtk_widget_get_first_child (GTK_WIDGET (self));
+       child != NULL;
+       child = gtk_widget_get_next_sibling (child))
+    {
+      if (SHUMATE_IS_MAP_LAYER (child))
+        shumate_map_layer_prefetch (SHUMATE_MAP_LAYER (child), latitude, longitude);
+    }
+}
+
 static void
 cancel_deceleration (ShumateMap *self)
 {
@@ -326,6 +344,8 @@ start_deceleration (ShumateMap *self,
   GdkFrameClock *frame_clock;
   KineticScrollData *data;
   graphene_vec2_t velocity;
+  double end_position;
+  double end_lat, end_lon;
 
   g_assert (priv->deceleration_tick_id == 0);
 
@@ -343,6 +363,17 @@ start_deceleration (ShumateMap *self,
     shumate_kinetic_scrolling_new (DECELERATION_FRICTION,
                                    graphene_vec2_length (&velocity));
 
+  /* The deceleration will come to rest this far away, so start loading the
+   * tiles on the way there */
+  end_position = shumate_kinetic_scrolling_get_end_position (data->kinetic_scrolling);
+  shumate_viewport_widget_coords_to_location (priv->viewport, GTK_WIDGET (self),
+                                              gtk_widget_get_width (GTK_WIDGET (self)) / 2.0
+                                                - graphene_vec2_get_x (&data->direction) * end_position,
+                                              gtk_widget_get_height (GTK_WIDGET (self)) / 2.0
+                                                - graphene_vec2_get_y (&data->direction) * end_position,
+                                              &end_lat, &end_lon);
+  prefetch_location (self, end_lat, end_lon);
+
   priv->deceleration_tick_id =
     gtk_widget_add_tick_callback (GTK_WIDGET (self),
                                   view_deceleration_tick_cb,
@@ -628,6 +659,8 @@ shumate_map_go_to_with_duration (ShumateMap *self,
   /* We keep a reference for stop */
   priv->goto_context = ctx;
 
+  prefetch_location (self, latitude, longitude);
+
   ctx->tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (self), go_to_tick_cb, ctx, NULL);
 }
 
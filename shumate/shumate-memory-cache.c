@@ -25,7 +25,7 @@
  * a quick access temporary cache to the most recently used tiles.
  */
 
-#include "shumate-memory-cache.h"
+#include "shumate-memory-cache-private.h"
 
 #include <glib.h>
 #include <string.h>
@@ -33,22 +33,49 @@
 enum
 {
   PROP_0,
-  PROP_SIZE_LIMIT
+  PROP_SIZE_LIMIT,
+  PROP_SIZE_LIMIT_BYTES,
 };
 
 typedef struct
 {
   guint size_limit;
+  guint64 size_limit_bytes;
+  guint64 size_bytes;
   GQueue *queue;
   GHashTable *hash_table;
+  /* Tiles too deep to fit in an integer key, keyed by "source/zoom/x/y" */
+  GHashTable *deep_hash_table;
+
+  /* Source IDs are interned to small integers, so they fit in the tile keys */
+  GHashTable *source_ids;
+  guint n_source_ids;
+
+  guint64 hits;
+  guint64 misses;
+  guint64 evictions;
 } ShumateMemoryCachePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShumateMemoryCache, shumate_memory_cache, G_TYPE_OBJECT);
 
+/* Tiles are keyed by a single integer with the layout
+ * [ source: 16 | zoom: 6 | x: 21 | y: 21 ], which is enough for every zoom
+ * level up to 21. Deeper tiles (e.g. over-zoomed ones) use string keys in a
+ * separate table instead. */
+#define KEY_COORD_BITS 21
+#define KEY_ZOOM_BITS 6
+#define KEY_SOURCE_BITS 16
+#define KEY_MAX_ZOOM_LEVEL KEY_COORD_BITS
+#define KEY_MAX_SOURCE_ID ((1 << KEY_SOURCE_BITS) - 1)
+
+#define SIZE_LIMIT_BYTES_DEFAULT (64 * 1024 * 1024)
+
 typedef struct
 {
-  char *key;
+  guint64 key;
+  char *deep_key;
   GdkTexture *texture;
+  gsize size;
 } QueueMember;
 
 
@@ -66,6 +93,10 @@ shumate_memory_cache_get_property (GObject *object,
       g_value_set_uint (value, shumate_memory_cache_get_size_limit (memory_cache));
       break;
 
+    case PROP_SIZE_LIMIT_BYTES:
+      g_value_set_uint64 (value, shumate_memory_cache_get_size_limit_bytes (memory_cache));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -86,6 +117,10 @@ shumate_memory_cache_set_property (GObject *object,
       shumate_memory_cache_set_size_limit (memory_cache, g_value_get_uint (value));
       break;
 
+    case PROP_SIZE_LIMIT_BYTES:
+      shumate_memory_cache_set_size_limit_bytes (memory_cache, g_value_get_uint64 (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -100,6 +135,8 @@ shumate_memory_cache_finalize (GObject *object)
   shumate_memory_cache_clean (memory_cache);
   g_clear_pointer (&priv->queue, g_queue_free);
   g_clear_pointer (&priv->hash_table, g_hash_table_unref);
+  g_clear_pointer (&priv->deep_hash_table, g_hash_table_unref);
+  g_clear_pointer (&priv->source_ids, g_hash_table_unref);
 
   G_OBJECT_CLASS (shumate_memory_cache_parent_class)->finalize (object);
 }
@@ -128,6 +165,22 @@ shumate_memory_cache_class_init (ShumateMemoryCacheClass *klass)
         100,
         G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_SIZE_LIMIT, pspec);
+
+  /**
+   * ShumateMemoryCache:size-limit-bytes:
+   *
+   * The maximum amount of texture memory, in bytes, used by the tiles stored
+   * in the cache. Tiles are evicted when either this or
+   * [property@MemoryCache:size-limit] is exceeded.
+   */
+  pspec = g_param_spec_uint64 ("size-limit-bytes",
+        "Size Limit in Bytes",
+        "Maximal texture memory used by stored tiles",
+        1,
+        G_MAXUINT64,
+        SIZE_LIMIT_BYTES_DEFAULT,
+        G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_SIZE_LIMIT_BYTES, pspec);
 }
 
 
@@ -152,13 +205,68 @@ shumate_memory_cache_new_full (guint size_limit)
 }
 
 
+/**
+ * shumate_memory_cache_dup_shared:
+ *
+ * Gets the memory cache that is shared by the whole process. Tiles are keyed
+ * by their source ID, so map layers showing the same source can share one
+ * cache (see [method@MapLayer.set_memory_cache]), and each tile is decoded
+ * and kept in memory only once.
+ *
+ * The shared cache is created on first use and freed once the last reference
+ * to it is dropped. It is only bounded by
+ * [property@MemoryCache:size-limit-bytes].
+ *
+ * Returns: (transfer full): the shared #ShumateMemoryCache
+ */
+ShumateMemoryCache *
+shumate_memory_cache_dup_shared (void)
+{
+  static GWeakRef shared_cache;
+  static GMutex shared_cache_lock;
+  ShumateMemoryCache *cache;
+
+  g_mutex_lock (&shared_cache_lock);
+
+  cache = g_weak_ref_get (&shared_cache);
+  if (cache == NULL)
+    {
+      cache = g_object_new (SHUMATE_TYPE_MEMORY_CACHE,
+            "size-limit", G_MAXINT,
+            NULL);
+      g_weak_ref_set (&shared_cache, cache);
+    }
+
+  g_mutex_unlock (&shared_cache_lock);
+
+  return cache;
+}
+
+
+static guint
+tile_key_hash (gconstpointer key)
+{
+  guint64 h = *(const guint64 *) key;
+
+  /* Mix all the bits, since neighboring tiles only differ in the low bits of
+   * the x and y fields */
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  h ^= h >> 33;
+
+  return (guint) h;
+}
+
+
 static void
 shumate_memory_cache_init (ShumateMemoryCache *memory_cache)
 {
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
 
   priv->queue = g_queue_new ();
-  priv->hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->hash_table = g_hash_table_new (tile_key_hash, g_int64_equal);
+  priv->deep_hash_table = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->source_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
 
 
@@ -181,6 +289,9 @@ shumate_memory_cache_get_size_limit (ShumateMemoryCache *memory_cache)
 }
 
 
+static void evict (ShumateMemoryCache *self, guint length, guint64 size_bytes);
+
+
 /**
  * shumate_memory_cache_set_size_limit:
  * @memory_cache: a #ShumateMemoryCache
@@ -197,26 +308,199 @@ shumate_memory_cache_set_size_limit (ShumateMemoryCache *memory_cache,
   g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache));
 
   priv->size_limit = size_limit;
+  evict (memory_cache, 0, 0);
   g_object_notify (G_OBJECT (memory_cache), "size-limit");
 }
 
 
+/**
+ * shumate_memory_cache_get_size_limit_bytes:
+ * @memory_cache: a #ShumateMemoryCache
+ *
+ * Gets the maximum amount of texture memory used by the tiles stored in the
+ * cache.
+ *
+ * Returns: maximum size of the stored tiles, in bytes
+ */
+guint64
+shumate_memory_cache_get_size_limit_bytes (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), 0);
+
+  return priv->size_limit_bytes;
+}
+
+
+/**
+ * shumate_memory_cache_set_size_limit_bytes:
+ * @memory_cache: a #ShumateMemoryCache
+ * @size_limit_bytes: maximum size of the stored tiles, in bytes
+ *
+ * Sets the maximum amount of texture memory used by the tiles stored in the
+ * cache.
+ */
+void
+shumate_memory_cache_set_size_limit_bytes (ShumateMemoryCache *memory_cache,
+    guint64 size_limit_bytes)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache));
+
+  priv->size_limit_bytes = size_limit_bytes;
+  evict (memory_cache, 0, 0);
+  g_object_notify (G_OBJECT (memory_cache), "size-limit-bytes");
+}
+
+
+/**
+ * shumate_memory_cache_get_size_bytes:
+ * @memory_cache: a #ShumateMemoryCache
+ *
+ * Gets the amount of texture memory currently used by the tiles stored in
+ * the cache.
+ *
+ * Returns: the size of the stored tiles, in bytes
+ */
+guint64
+shumate_memory_cache_get_size_bytes (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), 0);
+
+  return priv->size_bytes;
+}
+
+
+/**
+ * shumate_memory_cache_get_statistics:
+ * @memory_cache: a #ShumateMemoryCache
+ * @hits: (out) (optional): return location for the number of lookups that
+ *   found a tile
+ * @misses: (out) (optional): return location for the number of lookups that
+ *   did not find a tile
+ * @evictions: (out) (optional): return location for the number of tiles that
+ *   were dropped to stay within the size limits
+ *
+ * Gets counters describing how effective the cache has been since it was
+ * created.
+ */
+void
+shumate_memory_cache_get_statistics (ShumateMemoryCache *memory_cache,
+    guint64 *hits,
+    guint64 *misses,
+    guint64 *evictions)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache));
+
+  if (hits)
+    *hits = priv->hits;
+  if (misses)
+    *misses = priv->misses;
+  if (evictions)
+    *evictions = priv->evictions;
+}
+
+
+/* Looks up the interned ID of a source. If @intern is FALSE and the source
+ * has never been seen, returns FALSE. No allocation happens unless a new
+ * source is interned. */
+static gboolean
+get_source_index (ShumateMemoryCache *self,
+    const char *source_id,
+    gboolean intern,
+    guint *index)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (self);
+  gpointer value;
+
+  if (source_id == NULL)
+    source_id = "";
+
+  if (g_hash_table_lookup_extended (priv->source_ids, source_id, NULL, &value))
+    {
+      *index = GPOINTER_TO_UINT (value);
+      return TRUE;
+    }
+
+  if (!intern || priv->n_source_ids > KEY_MAX_SOURCE_ID)
+    return FALSE;
+
+  *index = priv->n_source_ids ++;
+  g_hash_table_insert (priv->source_ids, g_strdup (source_id), GUINT_TO_POINTER (*index));
+  return TRUE;
+}
+
+
+static gboolean
+generate_key (ShumateMemoryCache *memory_cache,
+    guint x,
+    guint y,
+    guint zoom_level,
+    const char *source_id,
+    gboolean intern,
+    guint64 *key)
+{
+  guint source_index;
+
+  if (zoom_level > KEY_MAX_ZOOM_LEVEL)
+    return FALSE;
+
+  if (!get_source_index (memory_cache, source_id, intern, &source_index))
+    return FALSE;
+
+  *key = ((guint64) source_index << (KEY_ZOOM_BITS + 2 * KEY_COORD_BITS))
+         | ((guint64) zoom_level << (2 * KEY_COORD_BITS))
+         | ((guint64) x << KEY_COORD_BITS)
+         | (guint64) y;
+  return TRUE;
+}
+
+
 static char *
-generate_queue_key (ShumateMemoryCache *memory_cache,
-    ShumateTile *tile,
+generate_deep_key (guint x,
+    guint y,
+    guint zoom_level,
     const char *source_id)
 {
-  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), NULL);
-  g_return_val_if_fail (SHUMATE_IS_TILE (tile), NULL);
+  return g_strdup_printf ("%s/%u/%u/%u", source_id ? source_id : "", zoom_level, x, y);
+}
+
 
-  char *key;
+/* Finds the queue link of a tile, whichever table it is stored in. */
+static GList *
+lookup_link (ShumateMemoryCache *memory_cache,
+    guint x,
+    guint y,
+    guint zoom_level,
+    const char *source_id)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+  g_autofree char *deep_key = NULL;
+  guint64 key;
 
-  key = g_strdup_printf ("%d/%d/%d/%s",
-        shumate_tile_get_zoom_level (tile),
-        shumate_tile_get_x (tile),
-        shumate_tile_get_y (tile),
-        source_id);
-  return key;
+  if (zoom_level <= KEY_MAX_ZOOM_LEVEL)
+    {
+      if (!generate_key (memory_cache, x, y, zoom_level, source_id, FALSE, &key))
+        return NULL;
+      return g_hash_table_lookup (priv->hash_table, &key);
+    }
+
+  deep_key = generate_deep_key (x, y, zoom_level, source_id);
+  return g_hash_table_lookup (priv->deep_hash_table, deep_key);
+}
+
+
+static gsize
+get_texture_size (GdkTexture *texture)
+{
+  /* Textures are uploaded with 4 bytes per pixel */
+  return (gsize) gdk_texture_get_width (texture) * gdk_texture_get_height (texture) * 4;
 }
 
 
@@ -234,12 +518,36 @@ delete_queue_member (QueueMember *member, gpointer user_data)
   if (member)
     {
       g_clear_object (&member->texture);
-      g_free (member->key);
+      g_free (member->deep_key);
       g_free (member);
     }
 }
 
 
+/* Drops the least recently used tiles until there is room for @length more
+ * tiles using @size_bytes more bytes. */
+static void
+evict (ShumateMemoryCache *self, guint length, guint64 size_bytes)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (self);
+
+  while (priv->queue->length > 0
+         && (priv->queue->length + length > priv->size_limit
+             || priv->size_bytes + size_bytes > priv->size_limit_bytes))
+    {
+      QueueMember *member = g_queue_pop_tail (priv->queue);
+
+      if (member->deep_key)
+        g_hash_table_remove (priv->deep_hash_table, member->deep_key);
+      else
+        g_hash_table_remove (priv->hash_table, &member->key);
+      priv->size_bytes -= member->size;
+      priv->evictions ++;
+      delete_queue_member (member, NULL);
+    }
+}
+
+
 /**
  * shumate_memory_cache_clean:
  * @memory_cache: a #ShumateMemoryCache
@@ -251,10 +559,11 @@ shumate_memory_cache_clean (ShumateMemoryCache *memory_cache)
 {
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
 
+  g_hash_table_remove_all (priv->hash_table);
+  g_hash_table_remove_all (priv->deep_hash_table);
   g_queue_foreach (priv->queue, (GFunc) delete_queue_member, NULL);
   g_queue_clear (priv->queue);
-  g_hash_table_unref (priv->hash_table);
-  priv->hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->size_bytes = 0;
 }
 
 
@@ -265,23 +574,25 @@ shumate_memory_cache_try_fill_tile (ShumateMemoryCache *self, ShumateTile *tile,
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
   GList *link;
   QueueMember *member;
-  g_autofree char *key = NULL;
 
   g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (self), FALSE);
   g_return_val_if_fail (SHUMATE_IS_TILE (tile), FALSE);
 
-  key = generate_queue_key (memory_cache, tile, source_id);
-
-  link = g_hash_table_lookup (priv->hash_table, key);
+  link = lookup_link (memory_cache,
+                      shumate_tile_get_x (tile),
+                      shumate_tile_get_y (tile),
+                      shumate_tile_get_zoom_level (tile),
+                      source_id);
   if (link == NULL)
-    return FALSE;
+    {
+      priv->misses ++;
+      return FALSE;
+    }
 
   member = link->data;
 
   move_queue_member_to_head (priv->queue, link);
-
-  if (!member->texture)
-    return FALSE;
+  priv->hits ++;
 
   shumate_tile_set_texture (tile, member->texture);
   shumate_tile_set_fade_in (tile, FALSE);
@@ -293,35 +604,79 @@ void
 shumate_memory_cache_store_texture (ShumateMemoryCache *self, ShumateTile *tile, GdkTexture *texture, const char *source_id)
 {
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (self);
+  QueueMember *member;
   GList *link;
-  char *key;
+  guint x, y, zoom_level;
+  guint64 key = 0;
+  g_autofree char *deep_key = NULL;
 
   g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (self));
   g_return_if_fail (SHUMATE_IS_TILE (tile));
+  g_return_if_fail (GDK_IS_TEXTURE (texture));
+
+  x = shumate_tile_get_x (tile);
+  y = shumate_tile_get_y (tile);
+  zoom_level = shumate_tile_get_zoom_level (tile);
+
+  if (zoom_level <= KEY_MAX_ZOOM_LEVEL)
+    {
+      if (!generate_key (self, x, y, zoom_level, source_id, TRUE, &key))
+        return;
+      link = g_hash_table_lookup (priv->hash_table, &key);
+    }
+  else
+    {
+      deep_key = generate_deep_key (x, y, zoom_level, source_id);
+      link = g_hash_table_lookup (priv->deep_hash_table, deep_key);
+    }
 
-  key = generate_queue_key (self, tile, source_id);
-  link = g_hash_table_lookup (priv->hash_table, key);
   if (link)
     {
+      member = link->data;
       move_queue_member_to_head (priv->queue, link);
-      g_free (key);
+
+      /* Replace the texture, in case the tile was refreshed */
+      priv->size_bytes -= member->size;
+      g_set_object (&member->texture, texture);
+      member->size = get_texture_size (texture);
+      priv->size_bytes += member->size;
+      return;
     }
+
+  member = g_new0 (QueueMember, 1);
+  member->key = key;
+  member->deep_key = g_steal_pointer (&deep_key);
+  member->texture = g_object_ref (texture);
+  member->size = get_texture_size (texture);
+
+  evict (self, 1, member->size);
+
+  priv->size_bytes += member->size;
+  g_queue_push_head (priv->queue, member);
+  if (member->deep_key)
+    g_hash_table_insert (priv->deep_hash_table, member->deep_key, g_queue_peek_head_link (priv->queue));
   else
-    {
-      QueueMember *member;
+    g_hash_table_insert (priv->hash_table, &member->key, g_queue_peek_head_link (priv->queue));
+}
+
+/* Looks up a texture without a ShumateTile to fill, for example to draw a
+ * placeholder from a tile on another zoom level. The lookup doesn't count
+ * towards the cache statistics. */
+GdkTexture *
+shumate_memory_cache_lookup_texture (ShumateMemoryCache *self,
+                                     guint               x,
+                                     guint               y,
+                                     guint               zoom_level,
+                                     const char         *source_id)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (self);
+  GList *link;
 
-      if (priv->queue->length >= priv->size_limit)
-        {
-          member = g_queue_pop_tail (priv->queue);
-          g_hash_table_remove (priv->hash_table, member->key);
-          delete_queue_member (member, NULL);
-        }
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (self), NULL);
 
-      member = g_new0 (QueueMember, 1);
-      member->key = key;
-      member->texture = g_object_ref (texture);
+  if (!(link = lookup_link (self, x, y, zoom_level, source_id)))
+    return NULL;
 
-      g_queue_push_head (priv->queue, member);
-      g_hash_table_insert (priv->hash_table, g_strdup (key), g_queue_peek_head_link (priv->queue));
-    }
+  move_queue_member_to_head (priv->queue, link);
+  return ((QueueMember *) link->data)->texture;
 }
@@ -38,11 +38,22 @@ struct _ShumateMemoryCacheClass
 };
 
 ShumateMemoryCache *shumate_memory_cache_new_full (guint size_limit);
+ShumateMemoryCache *shumate_memory_cache_dup_shared (void);
 
 guint shumate_memory_cache_get_size_limit (ShumateMemoryCache *memory_cache);
 void shumate_memory_cache_set_size_limit (ShumateMemoryCache *memory_cache,
     guint size_limit);
 
+guint64 shumate_memory_cache_get_size_limit_bytes (ShumateMemoryCache *memory_cache);
+void shumate_memory_cache_set_size_limit_bytes (ShumateMemoryCache *memory_cache,
+    guint64 size_limit_bytes);
+guint64 shumate_memory_cache_get_size_bytes (ShumateMemoryCache *memory_cache);
+
+void shumate_memory_cache_get_statistics (ShumateMemoryCache *memory_cache,
+    guint64 *hits,
+    guint64 *misses,
+    guint64 *evictions);
+
 void shumate_memory_cache_clean (ShumateMemoryCache *memory_cache);
 
 gboolean shumate_memory_cache_try_fill_tile (ShumateMemoryCache *self,
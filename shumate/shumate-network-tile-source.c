@@ -33,8 +33,11 @@
 
 #include "shumate.h"
 #include "shumate-enum-types.h"
+#include "shumate-file-cache-private.h"
 #include "shumate-map-source.h"
 #include "shumate-marshal.h"
+#include "shumate-tile-index-private.h"
+#include "shumate-vector-style-private.h"
 
 #include <errno.h>
 #include <gdk/gdk.h>
@@ -62,6 +65,14 @@ enum
 
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
 
+enum
+{
+  DOWNLOAD_PROGRESS,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0, };
+
 typedef struct
 {
   gboolean offline;
@@ -71,6 +82,17 @@ typedef struct
   int max_conns;
   ShumateFileCache *file_cache;
   ShumateVectorStyle *style;
+
+  /* Recently rendered vector tiles, already decoded, so that rendering a
+   * tile again (at a new zoom level, or after its texture was dropped from
+   * the memory cache) skips decoding. Accessed from the render pool. */
+  GMutex parsed_tiles_lock;
+  ShumateTileIndex *parsed_tiles;
+  GQueue parsed_tiles_lru;
+
+  /* Tiles being filled, so that requests for a tile that is already on its
+   * way share the work instead of fetching it again */
+  ShumateTileIndex *pending_fills;
 } ShumateNetworkTileSourcePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShumateNetworkTileSource, shumate_network_tile_source, SHUMATE_TYPE_MAP_SOURCE);
@@ -80,6 +102,36 @@ G_DEFINE_TYPE_WITH_PRIVATE (ShumateNetworkTileSource, shumate_network_tile_sourc
  */
 #define MAX_CONNS_DEFAULT 2
 
+/* The number of decoded vector tiles kept per source. A decoded tile takes
+ * a few times the space of its compressed data, so this is kept to roughly
+ * a screenful. */
+#define PARSED_TILE_CACHE_SIZE 64
+
+/* Vector tiles are shown up to this many zoom levels beyond the source's
+ * maximum zoom level, by rendering part of a tile on that level */
+#define MAX_OVERZOOM_LEVELS 8
+
+/* Responses up to this size are read to the end even if their tile is
+ * cancelled, to keep the connection alive. Anything larger, or of unknown
+ * size, is dropped along with its connection. */
+#define MAX_DRAIN_LENGTH (256 * 1024)
+
+typedef struct {
+  ShumateVectorTile *tile;
+  /* Link in the LRU queue, whose data is this entry */
+  GList link;
+  int x;
+  int y;
+  int zoom;
+} ParsedTile;
+
+static void
+parsed_tile_free (ParsedTile *entry)
+{
+  g_clear_pointer (&entry->tile, shumate_vector_tile_unref);
+  g_free (entry);
+}
+
 
 static void fill_tile_async (ShumateMapSource *map_source,
                              ShumateTile *tile,
@@ -214,6 +266,9 @@ shumate_network_tile_source_finalize (GObject *object)
   g_clear_pointer (&priv->uri_format, g_free);
   g_clear_pointer (&priv->proxy_uri, g_free);
   g_clear_object (&priv->file_cache);
+  g_clear_pointer (&priv->parsed_tiles, shumate_tile_index_free);
+  g_clear_pointer (&priv->pending_fills, shumate_tile_index_free);
+  g_mutex_clear (&priv->parsed_tiles_lock);
 
   G_OBJECT_CLASS (shumate_network_tile_source_parent_class)->finalize (object);
 }
@@ -324,6 +379,27 @@ shumate_network_tile_source_class_init (ShumateNetworkTileSourceClass *klass)
                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
   g_object_class_install_properties (object_class, N_PROPERTIES, obj_properties);
+
+  /**
+   * ShumateNetworkTileSource::download-progress:
+   * @self: the source emitting the signal
+   * @completed: the number of tiles downloaded so far
+   * @failed: the number of tiles that couldn't be downloaded so far
+   * @total: the number of tiles to download
+   *
+   * Emitted as tiles are downloaded by
+   * [method@NetworkTileSource.download_region_async]. The counts are those
+   * of a single region, including the tiles that a resumed download had
+   * already downloaded. When several regions are downloaded at once, each
+   * of them reports its own counts.
+   */
+  signals[DOWNLOAD_PROGRESS] =
+    g_signal_new ("download-progress",
+                  G_OBJECT_CLASS_TYPE (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  3, G_TYPE_UINT64, G_TYPE_UINT64, G_TYPE_UINT64);
 }
 
 
@@ -337,6 +413,11 @@ shumate_network_tile_source_init (ShumateNetworkTileSource *tile_source)
   priv->offline = FALSE;
   priv->max_conns = MAX_CONNS_DEFAULT;
 
+  g_mutex_init (&priv->parsed_tiles_lock);
+  priv->parsed_tiles = shumate_tile_index_new ((GDestroyNotify) parsed_tile_free);
+  g_queue_init (&priv->parsed_tiles_lru);
+  priv->pending_fills = shumate_tile_index_new (NULL);
+
   priv->soup_session = soup_session_new_with_options (
         "proxy-uri", NULL,
         "ssl-strict", FALSE,
@@ -490,6 +571,19 @@ shumate_network_tile_source_set_uri_format (ShumateNetworkTileSource *tile_sourc
   g_free (priv->uri_format);
   priv->uri_format = g_strdup (uri_format);
 
+  /* Resolve the tile server's address now, rather than when the first tile
+   * is requested. The placeholders are in the path, so the host can be
+   * parsed from the format itself. */
+  if (uri_format != NULL && priv->soup_session != NULL)
+    {
+      SoupURI *uri = soup_uri_new (uri_format);
+
+      if (uri != NULL && uri->host != NULL)
+        soup_session_prefetch_dns (priv->soup_session, uri->host, NULL, NULL, NULL);
+
+      g_clear_pointer (&uri, soup_uri_free);
+    }
+
   g_object_notify_by_pspec (G_OBJECT (tile_source), obj_properties[PROP_URI_FORMAT]);
 }
 
@@ -738,18 +832,42 @@ static void on_tile_rendered_from_cache (GObject *source_object, GAsyncResult *r
 static void fetch_from_network (GTask *task);
 static void on_message_sent (GObject *source_object, GAsyncResult *res, gpointer user_data);
 static void on_message_read (GObject *source_object, GAsyncResult *res, gpointer user_data);
-static void on_pixbuf_created (GObject *source_object, GAsyncResult *res, gpointer user_data);
 static void on_tile_rendered (GObject *source_object, GAsyncResult *res, gpointer user_data);
 
+/* A tile is filled once, however many times it is requested while the fill
+ * is in progress. The fill has its own task and cancellable; each request is
+ * a waiter, with a task of its own, that gets the fill's texture and result.
+ * The fill is only cancelled once all of its waiters have been. */
 typedef struct {
   ShumateNetworkTileSource *self;
+  /* The tile whose data is fetched: the tile of the first request, or for
+   * vector tiles beyond the source's maximum zoom level, its ancestor on
+   * that level. Only its position and size are used, the texture is set on
+   * the tiles of the waiters. */
   ShumateTile *tile;
+  /* The position that was requested */
+  int x;
+  int y;
+  int zoom_level;
   GBytes *bytes;
   char *etag;
   SoupMessage *msg;
   GDateTime *modtime;
+  GCancellable *cancellable;
+  /* The latest texture, for waiters that join late */
+  GdkTexture *texture;
+  /* The tasks of the waiters */
+  GPtrArray *waiters;
 } FillTileData;
 
+typedef struct {
+  /* NULL once the waiter has been detached from the fill */
+  FillTileData *fill;
+  ShumateTile *tile;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+} FillTileWaiter;
+
 static void
 fill_tile_data_free (FillTileData *data)
 {
@@ -759,9 +877,20 @@ fill_tile_data_free (FillTileData *data)
   g_clear_pointer (&data->etag, g_free);
   g_clear_object (&data->msg);
   g_clear_pointer (&data->modtime, g_date_time_unref);
+  g_clear_object (&data->cancellable);
+  g_clear_object (&data->texture);
+  g_clear_pointer (&data->waiters, g_ptr_array_unref);
   g_free (data);
 }
 
+static void
+fill_tile_waiter_free (FillTileWaiter *waiter)
+{
+  g_clear_object (&waiter->tile);
+  g_clear_object (&waiter->cancellable);
+  g_free (waiter);
+}
+
 static gboolean
 tile_is_expired (GDateTime *modified_time)
 {
@@ -781,75 +910,414 @@ get_modified_time_string (GDateTime *modified_time)
 }
 
 
+/* Tiles are decoded (and vector tiles rasterized) on a pool of worker
+ * threads, so that panning doesn't stall while a tile is rendered. The pool
+ * is shared by all sources and is bounded by the number of processors.
+ *
+ * Render requests beyond that wait in render_queue, oldest at the tail,
+ * which the workers take from in order. Each request pushes one job to the
+ * pool, which pops whatever request is oldest at that point. The queue holds
+ * at most MAX_QUEUED_RENDERS requests; past that, the oldest one fails
+ * without being rendered, since its tile has most likely been scrolled out
+ * of view by then. */
+static GThreadPool *render_pool = NULL;
+static GMutex render_queue_lock;
+static GQueue render_queue = G_QUEUE_INIT;
+
+#define MAX_QUEUED_RENDERS 64
+
+typedef struct {
+  /* NULL for raster tiles */
+  ShumateVectorStyle *style;
+  GBytes *bytes;
+  int size;
+  int x;
+  int y;
+  int zoom_level;
+  /* For vector tiles beyond the source's maximum zoom level, the part of
+   * the tile to render, as in shumate_vector_style_render_tile_area() */
+  int overzoom;
+  int overzoom_x;
+  int overzoom_y;
+} RenderTileData;
+
 static void
-render_tile_async (ShumateNetworkTileSource *self,
-                   ShumateTile *tile,
-                   GBytes *bytes,
-                   GCancellable *cancellable,
-                   GAsyncReadyCallback callback,
-                   gpointer user_data)
+render_tile_data_free (RenderTileData *data)
+{
+  g_clear_object (&data->style);
+  g_clear_pointer (&data->bytes, g_bytes_unref);
+  g_free (data);
+}
+
+/* Time spent in the render pool, logged every RENDER_STATS_INTERVAL tiles */
+#define RENDER_STATS_INTERVAL 256
+
+typedef struct {
+  const char *name;
+  guint n_tiles;
+  gint64 total_time;
+  gint64 max_time;
+} RenderStats;
+
+static GMutex render_stats_lock;
+static RenderStats raster_stats = { "raster", 0, 0, 0 };
+static RenderStats vector_stats = { "vector", 0, 0, 0 };
+
+static void
+add_render_time (RenderStats *stats, gint64 time)
+{
+  g_mutex_lock (&render_stats_lock);
+
+  stats->n_tiles ++;
+  stats->total_time += time;
+  stats->max_time = MAX (stats->max_time, time);
+
+  if (stats->n_tiles % RENDER_STATS_INTERVAL == 0)
+    g_debug ("Rendered %u %s tiles, %" G_GINT64_FORMAT " µs on average, at most %" G_GINT64_FORMAT " µs",
+             stats->n_tiles, stats->name, stats->total_time / stats->n_tiles, stats->max_time);
+
+  g_mutex_unlock (&render_stats_lock);
+}
+
+/* Returns the decoded form of a vector tile, from the source's cache of
+ * parsed tiles if it holds the same data for that position, or by decoding
+ * it and adding it to the cache. Called from the render pool. */
+static ShumateVectorTile *
+get_parsed_tile (ShumateNetworkTileSource *self,
+                 RenderTileData           *data)
 {
   ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  ShumateVectorTile *tile = NULL;
+  ParsedTile *entry;
 
-  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
-  g_task_set_source_tag (task, render_tile_async);
+  g_mutex_lock (&priv->parsed_tiles_lock);
 
-  if (priv->style)
+  entry = shumate_tile_index_lookup (priv->parsed_tiles, data->x, data->y, data->zoom_level);
+  if (entry != NULL)
     {
-      g_autoptr(GdkTexture) texture = NULL;
-      g_autoptr(GError) error = NULL;
+      GBytes *parsed_data = shumate_vector_tile_get_data (entry->tile);
 
-      texture = shumate_vector_style_render (priv->style, shumate_tile_get_size (tile), bytes, shumate_tile_get_zoom_level (tile));
-      if (error != NULL)
+      /* The tile may have been refreshed since it was decoded */
+      if (parsed_data == data->bytes || g_bytes_equal (parsed_data, data->bytes))
         {
-          g_task_return_error (task, g_steal_pointer (&error));
-          return;
+          tile = shumate_vector_tile_ref (entry->tile);
+          g_queue_unlink (&priv->parsed_tiles_lru, &entry->link);
+          g_queue_push_head_link (&priv->parsed_tiles_lru, &entry->link);
         }
+    }
 
-      shumate_tile_set_texture (tile, texture);
-      shumate_tile_set_fade_in (tile, TRUE);
+  g_mutex_unlock (&priv->parsed_tiles_lock);
 
-      g_task_return_boolean (task, TRUE);
-    }
-  else
+  if (tile != NULL)
+    return tile;
+
+  /* Decode outside the lock so other render threads aren't held up */
+  tile = shumate_vector_tile_new (data->bytes);
+  if (tile == NULL)
+    return NULL;
+
+  g_mutex_lock (&priv->parsed_tiles_lock);
+
+  entry = shumate_tile_index_lookup (priv->parsed_tiles, data->x, data->y, data->zoom_level);
+  if (entry != NULL)
+    g_queue_unlink (&priv->parsed_tiles_lru, &entry->link);
+
+  entry = g_new0 (ParsedTile, 1);
+  entry->tile = shumate_vector_tile_ref (tile);
+  entry->link.data = entry;
+  entry->x = data->x;
+  entry->y = data->y;
+  entry->zoom = data->zoom_level;
+
+  /* Replaces (and frees) any entry for an older version of the tile */
+  shumate_tile_index_insert (priv->parsed_tiles, entry->x, entry->y, entry->zoom, entry);
+  g_queue_push_head_link (&priv->parsed_tiles_lru, &entry->link);
+
+  while (priv->parsed_tiles_lru.length > PARSED_TILE_CACHE_SIZE)
     {
-      g_autoptr(GInputStream) input_stream = g_memory_input_stream_new_from_bytes (bytes);
+      ParsedTile *oldest = g_queue_peek_tail (&priv->parsed_tiles_lru);
+
+      g_queue_unlink (&priv->parsed_tiles_lru, &oldest->link);
+      shumate_tile_index_remove (priv->parsed_tiles, oldest->x, oldest->y, oldest->zoom);
+    }
+
+  g_mutex_unlock (&priv->parsed_tiles_lock);
+
+  return tile;
+}
 
-      g_task_set_task_data (task, g_object_ref (tile), g_object_unref);
+/* Raster tiles are fed to the pixbuf loader directly from the GBytes, and
+ * the decoded pixels become the texture's memory without being copied */
+static GdkTexture *
+decode_raster_tile (GBytes *bytes, GError **error)
+{
+  g_autoptr(GdkPixbufLoader) loader = gdk_pixbuf_loader_new ();
+  GdkPixbuf *pixbuf;
+  g_autoptr(GBytes) pixels = NULL;
 
-      gdk_pixbuf_new_from_stream_async (input_stream, cancellable, on_pixbuf_created, g_object_ref (task));
+  if (!gdk_pixbuf_loader_write_bytes (loader, bytes, error))
+    {
+      gdk_pixbuf_loader_close (loader, NULL);
+      return NULL;
     }
+
+  if (!gdk_pixbuf_loader_close (loader, error))
+    return NULL;
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  pixels = g_bytes_new_with_free_func (gdk_pixbuf_get_pixels (pixbuf),
+                                       gdk_pixbuf_get_byte_length (pixbuf),
+                                       g_object_unref,
+                                       g_object_ref (pixbuf));
+
+  return gdk_memory_texture_new (gdk_pixbuf_get_width (pixbuf),
+                                 gdk_pixbuf_get_height (pixbuf),
+                                 gdk_pixbuf_get_has_alpha (pixbuf) ? GDK_MEMORY_R8G8B8A8 : GDK_MEMORY_R8G8B8,
+                                 pixels,
+                                 gdk_pixbuf_get_rowstride (pixbuf));
 }
 
 static void
-on_pixbuf_created (GObject *source_object, GAsyncResult *res, gpointer user_data)
+render_pool_func (gpointer job, gpointer user_data)
 {
-  g_autoptr(GTask) task = user_data;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
-  g_autoptr(GdkTexture) texture = NULL;
-  ShumateTile *tile = SHUMATE_TILE (g_task_get_task_data (task));
+  g_autoptr(GTask) task = NULL;
+  RenderTileData *data;
+  GdkTexture *texture;
+  GError *error = NULL;
+  gint64 start;
 
-  pixbuf = gdk_pixbuf_new_from_stream_finish (res, &error);
-  if (error != NULL)
+  g_mutex_lock (&render_queue_lock);
+  task = g_queue_pop_tail (&render_queue);
+  g_mutex_unlock (&render_queue_lock);
+
+  /* Every request pushes a job, but dropped requests leave the queue
+   * without one being run, so there may be more jobs than requests */
+  if (task == NULL)
+    return;
+
+  data = g_task_get_task_data (task);
+
+  /* The tile may have gone out of view while the request was queued */
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  start = g_get_monotonic_time ();
+
+  if (data->style)
     {
-      g_task_return_error (task, g_steal_pointer (&error));
-      return;
+      g_autoptr(ShumateVectorTile) tile = get_parsed_tile (g_task_get_source_object (task), data);
+
+      if (tile != NULL && data->overzoom > 0)
+        texture = shumate_vector_style_render_tile_area (data->style, data->size, tile,
+                                                         data->zoom_level + data->overzoom,
+                                                         data->overzoom, data->overzoom_x, data->overzoom_y);
+      else if (tile != NULL)
+        texture = shumate_vector_style_render_tile (data->style, data->size, tile, data->zoom_level);
+      else
+        texture = shumate_vector_style_render (data->style, data->size, data->bytes, data->zoom_level);
+
+      add_render_time (&vector_stats, g_get_monotonic_time () - start);
+    }
+  else
+    {
+      texture = decode_raster_tile (data->bytes, &error);
+      add_render_time (&raster_stats, g_get_monotonic_time () - start);
     }
 
-  texture = gdk_texture_new_for_pixbuf (pixbuf);
-  shumate_tile_set_texture (tile, texture);
-  shumate_tile_set_fade_in (tile, TRUE);
+  if (texture == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, texture, g_object_unref);
+}
 
-  g_task_return_boolean (task, TRUE);
+static GThreadPool *
+get_render_pool (void)
+{
+  if (g_once_init_enter (&render_pool))
+    {
+      GThreadPool *pool = g_thread_pool_new (render_pool_func,
+                                             NULL,
+                                             MAX (1, g_get_num_processors ()),
+                                             FALSE,
+                                             NULL);
+      g_once_init_leave (&render_pool, pool);
+    }
+
+  return render_pool;
 }
 
-gboolean
+static void
+render_tile_async (FillTileData *fill,
+                   GCancellable *cancellable,
+                   GAsyncReadyCallback callback,
+                   gpointer user_data)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fill->self);
+  g_autoptr(GTask) task = g_task_new (fill->self, cancellable, callback, user_data);
+  g_autoptr(GTask) dropped = NULL;
+  RenderTileData *data = g_new0 (RenderTileData, 1);
+
+  g_task_set_source_tag (task, render_tile_async);
+
+  data->style = priv->style ? g_object_ref (priv->style) : NULL;
+  data->bytes = g_bytes_ref (fill->bytes);
+  data->size = shumate_tile_get_size (fill->tile);
+  data->x = shumate_tile_get_x (fill->tile);
+  data->y = shumate_tile_get_y (fill->tile);
+  data->zoom_level = shumate_tile_get_zoom_level (fill->tile);
+  data->overzoom = fill->zoom_level - data->zoom_level;
+  data->overzoom_x = fill->x - (data->x << data->overzoom);
+  data->overzoom_y = fill->y - (data->y << data->overzoom);
+  g_task_set_task_data (task, data, (GDestroyNotify) render_tile_data_free);
+
+  g_mutex_lock (&render_queue_lock);
+  g_queue_push_head (&render_queue, g_object_ref (task));
+  dropped = render_queue.length > MAX_QUEUED_RENDERS ? g_queue_pop_tail (&render_queue) : NULL;
+  g_mutex_unlock (&render_queue_lock);
+
+  if (dropped != NULL)
+    g_task_return_new_error (dropped, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                             "Too many tiles are waiting to be rendered");
+
+  /* The job only says there is something in the queue, it doesn't carry
+   * the request itself */
+  g_thread_pool_push (get_render_pool (), &render_queue, NULL);
+}
+
+/* Returns the rendered texture. The tile itself is only touched here, on the
+ * main thread, since it is a widget. */
+static GdkTexture *
 render_tile_finish (ShumateNetworkTileSource *self,
                     GAsyncResult *result,
                     GError **error)
 {
-  return g_task_propagate_boolean (G_TASK (result), error);
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/* Shows @texture on the tiles of all of the fill's waiters */
+static void
+set_fill_texture (FillTileData *data, GdkTexture *texture)
+{
+  g_set_object (&data->texture, texture);
+
+  for (guint i = 0; i < data->waiters->len; i ++)
+    {
+      FillTileWaiter *waiter = g_task_get_task_data (data->waiters->pdata[i]);
+
+      shumate_tile_set_texture (waiter->tile, texture);
+      shumate_tile_set_fade_in (waiter->tile, TRUE);
+    }
+}
+
+static void
+detach_waiter (GTask *task)
+{
+  FillTileWaiter *waiter = g_task_get_task_data (task);
+
+  g_cancellable_disconnect (waiter->cancellable, waiter->cancelled_id);
+  waiter->cancelled_id = 0;
+  waiter->fill = NULL;
+}
+
+static void
+remove_pending_fill (FillTileData *data)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+
+  if (shumate_tile_index_lookup (priv->pending_fills, data->x, data->y, data->zoom_level) == data)
+    shumate_tile_index_remove (priv->pending_fills, data->x, data->y, data->zoom_level);
+}
+
+/* Runs in an idle callback, since a cancellable's handlers can't disconnect
+ * themselves */
+static gboolean
+on_waiter_cancelled_idle (gpointer user_data)
+{
+  GTask *task = user_data;
+  FillTileWaiter *waiter = g_task_get_task_data (task);
+  FillTileData *data = waiter->fill;
+
+  /* The fill finished in the meantime */
+  if (data == NULL)
+    return G_SOURCE_REMOVE;
+
+  detach_waiter (task);
+  g_task_return_error_if_cancelled (task);
+
+  /* Removing the task drops the array's reference, but the idle callback
+   * still holds one */
+  g_ptr_array_remove (data->waiters, task);
+
+  if (data->waiters->len == 0)
+    {
+      /* Nobody wants the tile anymore. New requests will start over. */
+      remove_pending_fill (data);
+      g_cancellable_cancel (data->cancellable);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_waiter_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  GTask *task = user_data;
+
+  g_idle_add_full (G_PRIORITY_DEFAULT, on_waiter_cancelled_idle, g_object_ref (task), g_object_unref);
+}
+
+static void
+add_waiter (FillTileData *data, GTask *task)
+{
+  FillTileWaiter *waiter = g_task_get_task_data (task);
+
+  waiter->fill = data;
+  g_ptr_array_add (data->waiters, g_object_ref (task));
+
+  if (data->texture != NULL)
+    {
+      shumate_tile_set_texture (waiter->tile, data->texture);
+      shumate_tile_set_fade_in (waiter->tile, TRUE);
+    }
+
+  if (waiter->cancellable != NULL)
+    waiter->cancelled_id = g_cancellable_connect (waiter->cancellable,
+                                                  G_CALLBACK (on_waiter_cancelled),
+                                                  task, NULL);
+}
+
+/* Hands the result of a fill to each of its waiters */
+static void
+on_fill_done (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FillTileData *data = g_task_get_task_data (G_TASK (res));
+  g_autoptr(GError) error = NULL;
+
+  g_task_propagate_boolean (G_TASK (res), &error);
+
+  remove_pending_fill (data);
+
+  if (data->waiters->len > 1)
+    g_debug ("Filled tile %d/%d/%d for %u requests",
+             data->zoom_level, data->x, data->y, data->waiters->len);
+
+  for (guint i = 0; i < data->waiters->len; i ++)
+    {
+      GTask *task = data->waiters->pdata[i];
+      FillTileWaiter *waiter = g_task_get_task_data (task);
+
+      detach_waiter (task);
+
+      if (error == NULL)
+        {
+          shumate_tile_set_state (waiter->tile, SHUMATE_STATE_DONE);
+          g_task_return_boolean (task, TRUE);
+        }
+      else
+        g_task_return_error (task, g_error_copy (error));
+    }
+
+  g_ptr_array_set_size (data->waiters, 0);
 }
 
 static void
@@ -860,9 +1328,13 @@ fill_tile_async (ShumateMapSource *self,
                  gpointer user_data)
 {
   g_autoptr(GTask) task = NULL;
+  g_autoptr(GTask) fill_task = NULL;
   ShumateNetworkTileSource *tile_source = SHUMATE_NETWORK_TILE_SOURCE (self);
   ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (tile_source);
+  FillTileWaiter *waiter;
   FillTileData *data;
+  int x, y, zoom_level;
+  int overzoom;
 
   g_return_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (self));
   g_return_if_fail (SHUMATE_IS_TILE (tile));
@@ -879,12 +1351,54 @@ fill_tile_async (ShumateMapSource *self,
       return;
     }
 
+  waiter = g_new0 (FillTileWaiter, 1);
+  waiter->tile = g_object_ref (tile);
+  waiter->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  g_task_set_task_data (task, waiter, (GDestroyNotify) fill_tile_waiter_free);
+
+  x = shumate_tile_get_x (tile);
+  y = shumate_tile_get_y (tile);
+  zoom_level = shumate_tile_get_zoom_level (tile);
+
+  data = shumate_tile_index_lookup (priv->pending_fills, x, y, zoom_level);
+  if (data != NULL && shumate_tile_get_size (data->tile) == shumate_tile_get_size (tile))
+    {
+      add_waiter (data, task);
+      return;
+    }
+
   data = g_new0 (FillTileData, 1);
   data->self = g_object_ref (tile_source);
-  data->tile = g_object_ref (tile);
-  g_task_set_task_data (task, data, (GDestroyNotify) fill_tile_data_free);
+  data->x = x;
+  data->y = y;
+  data->zoom_level = zoom_level;
+
+  /* The server has no vector tiles past the maximum zoom level, but they can
+   * be rendered from a tile on that level */
+  overzoom = zoom_level - (int) shumate_map_source_get_max_zoom_level (self);
+  if (priv->style != NULL && overzoom > 0 && overzoom <= MAX_OVERZOOM_LEVELS)
+    data->tile = g_object_ref_sink (shumate_tile_new_full (x >> overzoom,
+                                                           y >> overzoom,
+                                                           shumate_tile_get_size (tile),
+                                                           zoom_level - overzoom));
+  else
+    data->tile = g_object_ref (tile);
 
-  shumate_file_cache_get_tile_async (priv->file_cache, tile, cancellable, on_file_cache_get_tile, g_object_ref (task));
+  data->cancellable = g_cancellable_new ();
+  data->waiters = g_ptr_array_new_with_free_func (g_object_unref);
+
+  fill_task = g_task_new (self, data->cancellable, on_fill_done, NULL);
+  g_task_set_source_tag (fill_task, fill_tile_async);
+  g_task_set_task_data (fill_task, data, (GDestroyNotify) fill_tile_data_free);
+
+  /* A fill for a tile of another size is left alone; this one just isn't
+   * shared */
+  if (!shumate_tile_index_contains (priv->pending_fills, x, y, zoom_level))
+    shumate_tile_index_insert (priv->pending_fills, x, y, zoom_level, data);
+
+  add_waiter (data, task);
+
+  shumate_file_cache_get_tile_async (priv->file_cache, data->tile, data->cancellable, on_file_cache_get_tile, g_object_ref (fill_task));
 }
 
 /* If the cache returned data, parse it into a pixbuf, otherwise go straight
@@ -902,7 +1416,7 @@ on_file_cache_get_tile (GObject *source_object, GAsyncResult *res, gpointer user
   if (data->bytes != NULL)
     /* When on_pixbuf_created_from_cache() is called, it will call
      * fetch_from_network() if needed */
-    render_tile_async (data->self, data->tile, data->bytes, cancellable, on_tile_rendered_from_cache, g_object_ref (task));
+    render_tile_async (data, cancellable, on_tile_rendered_from_cache, g_object_ref (task));
   else
     fetch_from_network (task);
 }
@@ -915,20 +1429,19 @@ on_tile_rendered_from_cache (GObject *source_object, GAsyncResult *res, gpointer
   g_autoptr(GTask) task = user_data;
   FillTileData *data = g_task_get_task_data (task);
   g_autoptr(GdkTexture) texture = NULL;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
   g_autoptr(GError) error = NULL;
 
-  if (!render_tile_finish (data->self, res, &error))
+  texture = render_tile_finish (data->self, res, &error);
+  if (texture == NULL)
     {
       g_task_return_error (task, g_steal_pointer (&error));
       return;
     }
 
+  set_fill_texture (data, texture);
+
   if (data->bytes != NULL && !tile_is_expired (data->modtime))
-    {
-      shumate_tile_set_state (data->tile, SHUMATE_STATE_DONE);
-      g_task_return_boolean (task, TRUE);
-    }
+    g_task_return_boolean (task, TRUE);
   else
     fetch_from_network (task);
 }
@@ -987,11 +1500,11 @@ on_message_sent (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
   g_autoptr(GTask) task = user_data;
   FillTileData *data = g_task_get_task_data (task);
-  GCancellable *cancellable = g_task_get_cancellable (task);
   g_autoptr(GInputStream) input_stream = NULL;
   g_autoptr(GError) error = NULL;
   ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
   g_autoptr(GOutputStream) output_stream = NULL;
+  GCancellable *read_cancellable = NULL;
 
   input_stream = soup_session_send_finish (priv->soup_session, res, &error);
   if (error != NULL)
@@ -1001,7 +1514,6 @@ on_message_sent (GObject *source_object, GAsyncResult *res, gpointer user_data)
           /* The tile has already been filled from the cache, so the operation
            * was overall successful even though the network request failed. */
           g_debug ("Fetching tile failed, but there is a cached version (error: %s)", error->message);
-          shumate_tile_set_state (data->tile, SHUMATE_STATE_DONE);
           g_task_return_boolean (task, TRUE);
         }
       else
@@ -1022,7 +1534,6 @@ on_message_sent (GObject *source_object, GAsyncResult *res, gpointer user_data)
 
       shumate_file_cache_mark_up_to_date (priv->file_cache, data->tile);
 
-      shumate_tile_set_state (data->tile, SHUMATE_STATE_DONE);
       g_task_return_boolean (task, TRUE);
       return;
     }
@@ -1033,7 +1544,6 @@ on_message_sent (GObject *source_object, GAsyncResult *res, gpointer user_data)
         {
           g_debug ("Fetching tile failed, but there is a cached version (HTTP %s)",
                    soup_status_get_phrase (data->msg->status_code));
-          shumate_tile_set_state (data->tile, SHUMATE_STATE_DONE);
           g_task_return_boolean (task, TRUE);
         }
       else
@@ -1052,12 +1562,21 @@ on_message_sent (GObject *source_object, GAsyncResult *res, gpointer user_data)
   data->etag = g_strdup (soup_message_headers_get_one (data->msg->response_headers, "ETag"));
   g_debug ("Received ETag %s", data->etag);
 
+  /* Once the response has started, read it to the end even if the tile is
+   * cancelled in the meantime. Closing the stream early would close the
+   * connection too, and the next tile would wait for a new one to be set up;
+   * finishing the response is cheaper and keeps the connection alive. That
+   * only holds for small responses, so the read can't be stopped otherwise. */
+  if (soup_message_headers_get_encoding (data->msg->response_headers) != SOUP_ENCODING_CONTENT_LENGTH
+      || soup_message_headers_get_content_length (data->msg->response_headers) > MAX_DRAIN_LENGTH)
+    read_cancellable = g_task_get_cancellable (task);
+
   output_stream = g_memory_output_stream_new_resizable ();
   g_output_stream_splice_async (output_stream,
                                 input_stream,
                                 G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
                                 G_PRIORITY_DEFAULT,
-                                cancellable,
+                                read_cancellable,
                                 on_message_read,
                                 g_steal_pointer (&task));
 }
@@ -1069,6 +1588,7 @@ on_message_read (GObject *source_object, GAsyncResult *res, gpointer user_data)
   GOutputStream *output_stream = G_OUTPUT_STREAM (source_object);
   g_autoptr(GTask) task = user_data;
   FillTileData *data = g_task_get_task_data (task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
   g_autoptr(GError) error = NULL;
 
   g_output_stream_splice_finish (output_stream, res, &error);
@@ -1081,7 +1601,16 @@ on_message_read (GObject *source_object, GAsyncResult *res, gpointer user_data)
   g_bytes_unref (data->bytes);
   data->bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output_stream));
 
-  render_tile_async (data->self, data->tile, data->bytes, NULL, on_tile_rendered, g_object_ref (task));
+  /* The tile was cancelled while its response was being read. Don't render
+   * it, but keep the data, since the tile is likely to come back into view. */
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    {
+      shumate_file_cache_store_tile_async (priv->file_cache, data->tile, data->bytes, data->etag, NULL, NULL, NULL);
+      g_task_return_error_if_cancelled (task);
+      return;
+    }
+
+  render_tile_async (data, NULL, on_tile_rendered, g_object_ref (task));
 }
 
 /* Fill the tile from the pixbuf, created from the network response. Begin
@@ -1095,23 +1624,572 @@ on_tile_rendered (GObject *source_object, GAsyncResult *res, gpointer user_data)
   ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
   GCancellable *cancellable = g_task_get_cancellable (task);
   g_autoptr(GError) error = NULL;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
   g_autoptr(GdkTexture) texture = NULL;
 
-  if (!render_tile_finish (data->self, res, &error))
+  texture = render_tile_finish (data->self, res, &error);
+  if (texture == NULL)
     {
       g_task_return_error (task, g_steal_pointer (&error));
       return;
     }
 
-  shumate_file_cache_store_tile_async (priv->file_cache, data->tile, data->bytes, data->etag, cancellable, NULL, NULL);
+  set_fill_texture (data, texture);
 
-  shumate_tile_set_state (data->tile, SHUMATE_STATE_DONE);
+  shumate_file_cache_store_tile_async (priv->file_cache, data->tile, data->bytes, data->etag, cancellable, NULL, NULL);
 
   g_task_return_boolean (task, TRUE);
 }
 
 
+/* Region downloads save their progress every this many tiles */
+#define DOWNLOAD_CHECKPOINT_INTERVAL 64
+
+typedef struct {
+  int zoom_level;
+  int min_x;
+  int max_x;
+  int min_y;
+  int max_y;
+  /* The index of the first tile of this zoom level in the download */
+  guint64 first_tile;
+} DownloadZoomRange;
+
+/* The tiles of a region are numbered zoom level by zoom level, row by row,
+ * so that a single index is enough to resume the download */
+typedef struct {
+  ShumateNetworkTileSource *self;
+  char *region;
+  GArray *ranges;
+  guint64 n_tiles;
+  guint64 n_completed;
+  guint64 n_failed;
+
+  guint64 next_tile;
+  /* Indices of the tiles being downloaded */
+  GArray *in_flight;
+  guint64 first_failed;
+  guint since_checkpoint;
+  /* The first tile that failed, reported once the rest are downloaded */
+  GError *tile_error;
+  /* An error that stops the whole download */
+  GError *error;
+} DownloadRegionData;
+
+static void
+download_region_data_free (DownloadRegionData *data)
+{
+  g_clear_object (&data->self);
+  g_clear_pointer (&data->region, g_free);
+  g_clear_pointer (&data->ranges, g_array_unref);
+  g_clear_pointer (&data->in_flight, g_array_unref);
+  g_clear_error (&data->tile_error);
+  g_clear_error (&data->error);
+  g_free (data);
+}
+
+typedef struct {
+  GTask *task;
+  ShumateTile *tile;
+  guint64 index;
+  char *etag;
+  GDateTime *modtime;
+  SoupMessage *msg;
+} DownloadTileData;
+
+static void
+download_tile_data_free (DownloadTileData *data)
+{
+  g_clear_object (&data->task);
+  g_clear_object (&data->tile);
+  g_clear_pointer (&data->etag, g_free);
+  g_clear_pointer (&data->modtime, g_date_time_unref);
+  g_clear_object (&data->msg);
+  g_free (data);
+}
+
+static void start_tile_downloads (GTask *task);
+
+static void
+emit_download_progress (DownloadRegionData *data)
+{
+  g_signal_emit (data->self, signals[DOWNLOAD_PROGRESS], 0, data->n_completed, data->n_failed, data->n_tiles);
+}
+
+/* The first tile that hasn't been downloaded yet; everything before it is in
+ * the cache */
+static guint64
+get_download_checkpoint (DownloadRegionData *data)
+{
+  guint64 checkpoint = MIN (data->next_tile, data->first_failed);
+
+  for (guint i = 0; i < data->in_flight->len; i ++)
+    checkpoint = MIN (checkpoint, g_array_index (data->in_flight, guint64, i));
+
+  return checkpoint;
+}
+
+static void
+finish_region_download (GTask *task)
+{
+  DownloadRegionData *data = g_task_get_task_data (task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+
+  if (data->error != NULL)
+    {
+      shumate_file_cache_set_download_checkpoint (priv->file_cache, data->region, get_download_checkpoint (data));
+      g_task_return_error (task, g_steal_pointer (&data->error));
+    }
+  else if (data->tile_error != NULL)
+    {
+      shumate_file_cache_set_download_checkpoint (priv->file_cache, data->region, get_download_checkpoint (data));
+      g_prefix_error (&data->tile_error,
+                      "%" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " tiles couldn't be downloaded: ",
+                      data->n_failed, data->n_tiles);
+      g_task_return_error (task, g_steal_pointer (&data->tile_error));
+    }
+  else
+    {
+      shumate_file_cache_clear_download_checkpoint (priv->file_cache, data->region);
+      g_task_return_boolean (task, TRUE);
+    }
+}
+
+/* Whether an error stops the rest of the region from being downloaded.
+ * Anything else only affects one tile, like a tile the server doesn't have,
+ * so the other tiles are still worth downloading. */
+static gboolean
+is_fatal_download_error (GError *error)
+{
+  return g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)
+      || error->domain == SHUMATE_FILE_CACHE_ERROR;
+}
+
+/* Called when a tile is in the cache, or couldn't be downloaded. Takes
+ * ownership of @tile_data and @error. */
+static void
+tile_download_finished (DownloadTileData *tile_data, GError *error)
+{
+  g_autoptr(GTask) task = g_object_ref (tile_data->task);
+  DownloadRegionData *data = g_task_get_task_data (task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+
+  for (guint i = 0; i < data->in_flight->len; i ++)
+    {
+      if (g_array_index (data->in_flight, guint64, i) == tile_data->index)
+        {
+          g_array_remove_index_fast (data->in_flight, i);
+          break;
+        }
+    }
+
+  if (error != NULL && is_fatal_download_error (error))
+    {
+      data->first_failed = MIN (data->first_failed, tile_data->index);
+
+      if (data->error == NULL)
+        data->error = error;
+      else
+        g_error_free (error);
+    }
+  else if (error != NULL)
+    {
+      g_debug ("Failed to download tile %u, %u, %u: %s",
+               shumate_tile_get_x (tile_data->tile),
+               shumate_tile_get_y (tile_data->tile),
+               shumate_tile_get_zoom_level (tile_data->tile),
+               error->message);
+
+      data->first_failed = MIN (data->first_failed, tile_data->index);
+      data->n_failed ++;
+      emit_download_progress (data);
+
+      if (data->tile_error == NULL)
+        data->tile_error = error;
+      else
+        g_error_free (error);
+    }
+  else
+    {
+      data->n_completed ++;
+      emit_download_progress (data);
+    }
+
+  if (++ data->since_checkpoint >= DOWNLOAD_CHECKPOINT_INTERVAL)
+    {
+      data->since_checkpoint = 0;
+      shumate_file_cache_set_download_checkpoint (priv->file_cache, data->region, get_download_checkpoint (data));
+    }
+
+  download_tile_data_free (tile_data);
+  start_tile_downloads (task);
+}
+
+static void
+on_download_stored (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  DownloadTileData *tile_data = user_data;
+  GError *error = NULL;
+
+  shumate_file_cache_store_tile_finish (SHUMATE_FILE_CACHE (source_object), res, &error);
+  tile_download_finished (tile_data, error);
+}
+
+static void
+on_download_read (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GOutputStream *output_stream = G_OUTPUT_STREAM (source_object);
+  DownloadTileData *tile_data = user_data;
+  DownloadRegionData *data = g_task_get_task_data (tile_data->task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+  g_autoptr(GBytes) bytes = NULL;
+  GError *error = NULL;
+
+  g_output_stream_splice_finish (output_stream, res, &error);
+  if (error != NULL)
+    {
+      tile_download_finished (tile_data, error);
+      return;
+    }
+
+  bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output_stream));
+
+  /* Wait for the tile to be stored, so that the checkpoint never gets ahead
+   * of the cache */
+  shumate_file_cache_store_tile_async (priv->file_cache, tile_data->tile, bytes, tile_data->etag,
+                                       g_task_get_cancellable (tile_data->task),
+                                       on_download_stored, tile_data);
+}
+
+static void
+on_download_sent (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  DownloadTileData *tile_data = user_data;
+  DownloadRegionData *data = g_task_get_task_data (tile_data->task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+  g_autoptr(GInputStream) input_stream = NULL;
+  g_autoptr(GOutputStream) output_stream = NULL;
+  GError *error = NULL;
+
+  input_stream = soup_session_send_finish (priv->soup_session, res, &error);
+  if (error != NULL)
+    {
+      tile_download_finished (tile_data, error);
+      return;
+    }
+
+  if (tile_data->msg->status_code == SOUP_STATUS_NOT_MODIFIED)
+    {
+      shumate_file_cache_mark_up_to_date (priv->file_cache, tile_data->tile);
+      tile_download_finished (tile_data, NULL);
+      return;
+    }
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (tile_data->msg->status_code))
+    {
+      tile_download_finished (tile_data,
+                              g_error_new (SHUMATE_NETWORK_SOURCE_ERROR,
+                                           SHUMATE_NETWORK_SOURCE_ERROR_BAD_RESPONSE,
+                                           "Unable to download tile: HTTP %s",
+                                           soup_status_get_phrase (tile_data->msg->status_code)));
+      return;
+    }
+
+  g_clear_pointer (&tile_data->etag, g_free);
+  tile_data->etag = g_strdup (soup_message_headers_get_one (tile_data->msg->response_headers, "ETag"));
+
+  output_stream = g_memory_output_stream_new_resizable ();
+  g_output_stream_splice_async (output_stream,
+                                input_stream,
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                G_PRIORITY_DEFAULT,
+                                g_task_get_cancellable (tile_data->task),
+                                on_download_read,
+                                tile_data);
+}
+
+/* Tiles that are already in the cache are only downloaded again if they
+ * have expired, and then only if the server has a newer version */
+static void
+on_download_cache_checked (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  DownloadTileData *tile_data = user_data;
+  DownloadRegionData *data = g_task_get_task_data (tile_data->task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree char *uri = NULL;
+  g_autofree char *modtime_string = NULL;
+  GError *error = NULL;
+
+  bytes = shumate_file_cache_get_tile_finish (SHUMATE_FILE_CACHE (source_object),
+                                              &tile_data->etag, &tile_data->modtime, res, &error);
+  if (error != NULL)
+    {
+      tile_download_finished (tile_data, error);
+      return;
+    }
+
+  if (bytes != NULL && !tile_is_expired (tile_data->modtime))
+    {
+      tile_download_finished (tile_data, NULL);
+      return;
+    }
+
+  uri = get_tile_uri (data->self,
+                      shumate_tile_get_x (tile_data->tile),
+                      shumate_tile_get_y (tile_data->tile),
+                      shumate_tile_get_zoom_level (tile_data->tile));
+
+  tile_data->msg = soup_message_new (SOUP_METHOD_GET, uri);
+  if (tile_data->msg == NULL)
+    {
+      tile_download_finished (tile_data,
+                              g_error_new (SHUMATE_NETWORK_SOURCE_ERROR,
+                                           SHUMATE_NETWORK_SOURCE_ERROR_MALFORMED_URL,
+                                           "The URL %s is not valid", uri));
+      return;
+    }
+
+  modtime_string = get_modified_time_string (tile_data->modtime);
+
+  if (tile_data->etag)
+    soup_message_headers_append (tile_data->msg->request_headers,
+                                 "If-None-Match", tile_data->etag);
+  else if (modtime_string)
+    soup_message_headers_append (tile_data->msg->request_headers,
+                                 "If-Modified-Since", modtime_string);
+
+  soup_session_send_async (priv->soup_session, tile_data->msg,
+                           g_task_get_cancellable (tile_data->task),
+                           on_download_sent, tile_data);
+}
+
+static void
+download_tile (GTask *task, guint64 index)
+{
+  DownloadRegionData *data = g_task_get_task_data (task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+  guint tile_size = shumate_map_source_get_tile_size (SHUMATE_MAP_SOURCE (data->self));
+  DownloadTileData *tile_data;
+  guint i = data->ranges->len - 1;
+  DownloadZoomRange *range;
+  guint64 offset;
+  int columns;
+
+  while (g_array_index (data->ranges, DownloadZoomRange, i).first_tile > index)
+    i --;
+
+  range = &g_array_index (data->ranges, DownloadZoomRange, i);
+  columns = range->max_x - range->min_x + 1;
+  offset = index - range->first_tile;
+
+  tile_data = g_new0 (DownloadTileData, 1);
+  tile_data->task = g_object_ref (task);
+  tile_data->index = index;
+  tile_data->tile = g_object_ref_sink (shumate_tile_new_full (range->min_x + offset % columns,
+                                                              range->min_y + offset / columns,
+                                                              tile_size,
+                                                              range->zoom_level));
+
+  g_array_append_val (data->in_flight, index);
+
+  shumate_file_cache_get_tile_async (priv->file_cache, tile_data->tile,
+                                     g_task_get_cancellable (task),
+                                     on_download_cache_checked, tile_data);
+}
+
+/* Keeps up to max-conns tiles downloading at a time */
+static void
+start_tile_downloads (GTask *task)
+{
+  DownloadRegionData *data = g_task_get_task_data (task);
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (data->self);
+
+  while (data->error == NULL
+         && data->next_tile < data->n_tiles
+         && data->in_flight->len < (guint) priv->max_conns)
+    download_tile (task, data->next_tile ++);
+
+  if (data->in_flight->len == 0)
+    finish_region_download (task);
+}
+
+static void
+on_download_checkpoint (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  DownloadRegionData *data = g_task_get_task_data (task);
+  GError *error = NULL;
+  guint64 checkpoint;
+
+  checkpoint = shumate_file_cache_get_download_checkpoint_finish (SHUMATE_FILE_CACHE (source_object), res, &error);
+  if (error != NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (checkpoint > 0 && checkpoint < data->n_tiles)
+    {
+      g_debug ("Resuming download of %s at tile %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT,
+               data->region, checkpoint, data->n_tiles);
+      data->next_tile = checkpoint;
+      data->n_completed = checkpoint;
+    }
+
+  emit_download_progress (data);
+
+  start_tile_downloads (task);
+}
+
+static int
+get_tile_column (ShumateMapSource *source, guint zoom_level, double longitude)
+{
+  guint tile_size = shumate_map_source_get_tile_size (source);
+  int column = floor (shumate_map_source_get_x (source, zoom_level, longitude) / tile_size);
+
+  return CLAMP (column, 0, (int) shumate_map_source_get_column_count (source, zoom_level) - 1);
+}
+
+static int
+get_tile_row (ShumateMapSource *source, guint zoom_level, double latitude)
+{
+  guint tile_size = shumate_map_source_get_tile_size (source);
+  int row = floor (shumate_map_source_get_y (source, zoom_level, latitude) / tile_size);
+
+  return CLAMP (row, 0, (int) shumate_map_source_get_row_count (source, zoom_level) - 1);
+}
+
+/**
+ * shumate_network_tile_source_download_region_async:
+ * @self: a [class@NetworkTileSource]
+ * @min_latitude: the southern edge of the region
+ * @min_longitude: the western edge of the region
+ * @max_latitude: the northern edge of the region
+ * @max_longitude: the eastern edge of the region
+ * @min_zoom: the lowest zoom level to download
+ * @max_zoom: the highest zoom level to download
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to execute upon completion
+ * @user_data: closure data for @callback
+ *
+ * Downloads every tile of a region, at every zoom level from @min_zoom to
+ * @max_zoom, into the source's [class@FileCache], so that the region can be
+ * shown later without a network connection. Tiles that are already cached
+ * and up to date are not downloaded again.
+ *
+ * At most [property@NetworkTileSource:max-conns] tiles are downloaded at a
+ * time. Progress is reported with the
+ * [signal@NetworkTileSource::download-progress] signal.
+ *
+ * Tiles that can't be downloaded don't stop the download; the rest of the
+ * region is downloaded, and then the first of those errors is returned.
+ * Only cancelling the download or an error in the file cache stop it
+ * early. Either way, its progress is saved in the file cache, and
+ * downloading the same region again resumes at the first missing tile.
+ * Make sure the cache's size limit leaves room for the region, or its tiles
+ * may be evicted again.
+ */
+void
+shumate_network_tile_source_download_region_async (ShumateNetworkTileSource *self,
+                                                   double                    min_latitude,
+                                                   double                    min_longitude,
+                                                   double                    max_latitude,
+                                                   double                    max_longitude,
+                                                   guint                     min_zoom,
+                                                   guint                     max_zoom,
+                                                   GCancellable             *cancellable,
+                                                   GAsyncReadyCallback       callback,
+                                                   gpointer                  user_data)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  ShumateMapSource *source = SHUMATE_MAP_SOURCE (self);
+  g_autoptr(GTask) task = NULL;
+  DownloadRegionData *data;
+  char coords[4][G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_return_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (self));
+  g_return_if_fail (min_latitude <= max_latitude);
+  g_return_if_fail (min_longitude <= max_longitude);
+  g_return_if_fail (min_zoom <= max_zoom);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, shumate_network_tile_source_download_region_async);
+
+  if (priv->offline)
+    {
+      g_task_return_new_error (task, SHUMATE_NETWORK_SOURCE_ERROR,
+                               SHUMATE_NETWORK_SOURCE_ERROR_OFFLINE,
+                               "The tile source is offline.");
+      return;
+    }
+
+  min_zoom = MAX (min_zoom, shumate_map_source_get_min_zoom_level (source));
+  max_zoom = MIN (max_zoom, shumate_map_source_get_max_zoom_level (source));
+
+  data = g_new0 (DownloadRegionData, 1);
+  data->self = g_object_ref (self);
+  data->ranges = g_array_new (FALSE, FALSE, sizeof (DownloadZoomRange));
+  data->in_flight = g_array_new (FALSE, FALSE, sizeof (guint64));
+  data->first_failed = G_MAXUINT64;
+  g_task_set_task_data (task, data, (GDestroyNotify) download_region_data_free);
+
+  for (guint zoom_level = min_zoom; zoom_level <= max_zoom; zoom_level ++)
+    {
+      DownloadZoomRange range;
+
+      range.zoom_level = zoom_level;
+      range.min_x = get_tile_column (source, zoom_level, min_longitude);
+      range.max_x = get_tile_column (source, zoom_level, max_longitude);
+      /* Rows are counted from the north */
+      range.min_y = get_tile_row (source, zoom_level, max_latitude);
+      range.max_y = get_tile_row (source, zoom_level, min_latitude);
+      range.first_tile = data->n_tiles;
+      g_array_append_val (data->ranges, range);
+
+      data->n_tiles += (guint64) (range.max_x - range.min_x + 1) * (range.max_y - range.min_y + 1);
+    }
+
+  data->region = g_strdup_printf ("%s,%s,%s,%s/%u-%u",
+                                  g_ascii_dtostr (coords[0], sizeof coords[0], min_latitude),
+                                  g_ascii_dtostr (coords[1], sizeof coords[1], min_longitude),
+                                  g_ascii_dtostr (coords[2], sizeof coords[2], max_latitude),
+                                  g_ascii_dtostr (coords[3], sizeof coords[3], max_longitude),
+                                  min_zoom, max_zoom);
+
+  if (data->n_tiles == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  shumate_file_cache_get_download_checkpoint_async (priv->file_cache, data->region, cancellable,
+                                                    on_download_checkpoint, g_object_ref (task));
+}
+
+/**
+ * shumate_network_tile_source_download_region_finish:
+ * @self: a [class@NetworkTileSource]
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError, or %NULL
+ *
+ * Gets the success value of a completed
+ * [method@NetworkTileSource.download_region_async] operation.
+ *
+ * Returns: %TRUE if every tile of the region is in the cache, otherwise
+ *   %FALSE
+ */
+gboolean
+shumate_network_tile_source_download_region_finish (ShumateNetworkTileSource  *self,
+                                                    GAsyncResult              *result,
+                                                    GError                   **error)
+{
+  g_return_val_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 /**
  * shumate_network_source_error_quark:
  *
@@ -110,6 +110,20 @@ void shumate_network_tile_source_set_user_agent (ShumateNetworkTileSource *tile_
 
 ShumateVectorStyle *shumate_network_tile_source_get_style (ShumateNetworkTileSource *self);
 
+void shumate_network_tile_source_download_region_async (ShumateNetworkTileSource *self,
+    double min_latitude,
+    double min_longitude,
+    double max_latitude,
+    double max_longitude,
+    guint min_zoom,
+    guint max_zoom,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+gboolean shumate_network_tile_source_download_region_finish (ShumateNetworkTileSource *self,
+    GAsyncResult *result,
+    GError **error);
+
 G_END_DECLS
 
 #endif /* _SHUMATE_NETWORK_TILE_SOURCE_H_ */
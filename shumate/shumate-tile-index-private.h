@@ -0,0 +1,68 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A hash table from tile grid positions (x, y, zoom) to non-%NULL values.
+ * Entries are stored inline in a single open-addressed array, so looking a
+ * position up never allocates. */
+typedef struct _ShumateTileIndex ShumateTileIndex;
+
+typedef struct
+{
+  ShumateTileIndex *index;
+  gsize position;
+} ShumateTileIndexIter;
+
+ShumateTileIndex *shumate_tile_index_new  (GDestroyNotify    value_destroy_func);
+void              shumate_tile_index_free (ShumateTileIndex *self);
+
+guint    shumate_tile_index_get_size   (ShumateTileIndex *self);
+gpointer shumate_tile_index_lookup     (ShumateTileIndex *self,
+                                        int               x,
+                                        int               y,
+                                        int               zoom);
+gboolean shumate_tile_index_contains   (ShumateTileIndex *self,
+                                        int               x,
+                                        int               y,
+                                        int               zoom);
+void     shumate_tile_index_insert     (ShumateTileIndex *self,
+                                        int               x,
+                                        int               y,
+                                        int               zoom,
+                                        gpointer          value);
+gboolean shumate_tile_index_remove     (ShumateTileIndex *self,
+                                        int               x,
+                                        int               y,
+                                        int               zoom);
+void     shumate_tile_index_remove_all (ShumateTileIndex *self);
+
+void     shumate_tile_index_iter_init   (ShumateTileIndexIter *iter,
+                                         ShumateTileIndex     *index);
+gboolean shumate_tile_index_iter_next   (ShumateTileIndexIter *iter,
+                                         int                  *x,
+                                         int                  *y,
+                                         int                  *zoom,
+                                         gpointer             *value);
+void     shumate_tile_index_iter_remove (ShumateTileIndexIter *iter);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ShumateTileIndex, shumate_tile_index_free)
+
+G_END_DECLS
@@ -0,0 +1,373 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+
+#include "shumate-tile-index-private.h"
+
+#define MIN_CAPACITY 16
+
+typedef struct
+{
+  int x;
+  int y;
+  int zoom;
+  /* NULL if the slot is free, TOMBSTONE if its entry was removed */
+  gpointer value;
+} Slot;
+
+static const char tombstone;
+#define TOMBSTONE ((gpointer) &tombstone)
+
+#define SLOT_IS_USED(slot) ((slot)->value != NULL && (slot)->value != TOMBSTONE)
+
+struct _ShumateTileIndex
+{
+  /* Linear probing over a power-of-two array of slots */
+  Slot *slots;
+  gsize capacity;
+  guint size;
+  guint n_tombstones;
+
+  GDestroyNotify value_destroy_func;
+};
+
+
+static inline gsize
+hash_position (int x, int y, int zoom)
+{
+  /* Pack the position into one word and mix all of its bits, so that nearby
+   * positions--which are what the map layer stores--spread evenly over the
+   * table */
+  guint64 h = ((guint64) (guint32) x << 32) | (guint32) y;
+
+  h ^= (guint64) (guint32) zoom * G_GUINT64_CONSTANT (0x9e3779b97f4a7c15);
+  h ^= h >> 30;
+  h *= G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  h ^= h >> 27;
+  h *= G_GUINT64_CONSTANT (0x94d049bb133111eb);
+  h ^= h >> 31;
+
+  return (gsize) h;
+}
+
+static Slot *
+find_slot (ShumateTileIndex *self, int x, int y, int zoom)
+{
+  gsize mask = self->capacity - 1;
+
+  /* There is always at least one free slot, so this terminates */
+  for (gsize i = hash_position (x, y, zoom) & mask; ; i = (i + 1) & mask)
+    {
+      Slot *slot = &self->slots[i];
+
+      if (slot->value == NULL)
+        return NULL;
+
+      if (slot->value != TOMBSTONE && slot->x == x && slot->y == y && slot->zoom == zoom)
+        return slot;
+    }
+}
+
+static Slot *
+find_free_slot (ShumateTileIndex *self, int x, int y, int zoom)
+{
+  gsize mask = self->capacity - 1;
+
+  for (gsize i = hash_position (x, y, zoom) & mask; ; i = (i + 1) & mask)
+    {
+      if (!SLOT_IS_USED (&self->slots[i]))
+        return &self->slots[i];
+    }
+}
+
+static void
+resize (ShumateTileIndex *self, gsize capacity)
+{
+  Slot *old_slots = self->slots;
+  gsize old_capacity = self->capacity;
+
+  self->slots = g_new0 (Slot, capacity);
+  self->capacity = capacity;
+  self->n_tombstones = 0;
+
+  for (gsize i = 0; i < old_capacity; i ++)
+    {
+      if (SLOT_IS_USED (&old_slots[i]))
+        *find_free_slot (self, old_slots[i].x, old_slots[i].y, old_slots[i].zoom) = old_slots[i];
+    }
+
+  g_free (old_slots);
+}
+
+static void
+remove_slot (ShumateTileIndex *self, Slot *slot)
+{
+  gpointer value = slot->value;
+  gsize next = (slot - self->slots + 1) & (self->capacity - 1);
+
+  /* No probe sequence continues past a free slot, so if the next one is
+   * free this one can be freed too instead of leaving a tombstone */
+  if (self->slots[next].value == NULL)
+    slot->value = NULL;
+  else
+    {
+      slot->value = TOMBSTONE;
+      self->n_tombstones ++;
+    }
+
+  self->size --;
+
+  if (self->value_destroy_func)
+    self->value_destroy_func (value);
+}
+
+
+/*
+ * shumate_tile_index_new:
+ * @value_destroy_func: (nullable): a function to free values with when they
+ *   are removed, or %NULL
+ *
+ * Creates a new, empty tile index.
+ *
+ * Returns: (transfer full): a new #ShumateTileIndex
+ */
+ShumateTileIndex *
+shumate_tile_index_new (GDestroyNotify value_destroy_func)
+{
+  ShumateTileIndex *self = g_new0 (ShumateTileIndex, 1);
+
+  self->capacity = MIN_CAPACITY;
+  self->slots = g_new0 (Slot, self->capacity);
+  self->value_destroy_func = value_destroy_func;
+
+  return self;
+}
+
+
+void
+shumate_tile_index_free (ShumateTileIndex *self)
+{
+  if (self == NULL)
+    return;
+
+  shumate_tile_index_remove_all (self);
+  g_free (self->slots);
+  g_free (self);
+}
+
+
+guint
+shumate_tile_index_get_size (ShumateTileIndex *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return self->size;
+}
+
+
+gpointer
+shumate_tile_index_lookup (ShumateTileIndex *self,
+                           int               x,
+                           int               y,
+                           int               zoom)
+{
+  Slot *slot;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  slot = find_slot (self, x, y, zoom);
+  return slot ? slot->value : NULL;
+}
+
+
+gboolean
+shumate_tile_index_contains (ShumateTileIndex *self,
+                             int               x,
+                             int               y,
+                             int               zoom)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return find_slot (self, x, y, zoom) != NULL;
+}
+
+
+/*
+ * shumate_tile_index_insert:
+ *
+ * Inserts @value at the given position, replacing (and freeing) any value
+ * that was already there. Invalidates iterators.
+ */
+void
+shumate_tile_index_insert (ShumateTileIndex *self,
+                           int               x,
+                           int               y,
+                           int               zoom,
+                           gpointer          value)
+{
+  Slot *slot;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (value != NULL);
+
+  if ((slot = find_slot (self, x, y, zoom)))
+    {
+      gpointer old_value = slot->value;
+
+      slot->value = value;
+      if (old_value != value && self->value_destroy_func)
+        self->value_destroy_func (old_value);
+      return;
+    }
+
+  /* Keep the table at most 3/4 full, counting tombstones, so probe
+   * sequences stay short. If it is mostly tombstones, rehashing at the same
+   * capacity is enough. */
+  if ((self->size + self->n_tombstones + 1) * 4 > self->capacity * 3)
+    {
+      gsize capacity = self->capacity;
+
+      while ((self->size + 1) * 2 > capacity)
+        capacity *= 2;
+
+      resize (self, capacity);
+    }
+
+  slot = find_free_slot (self, x, y, zoom);
+  if (slot->value == TOMBSTONE)
+    self->n_tombstones --;
+
+  slot->x = x;
+  slot->y = y;
+  slot->zoom = zoom;
+  slot->value = value;
+  self->size ++;
+}
+
+
+gboolean
+shumate_tile_index_remove (ShumateTileIndex *self,
+                           int               x,
+                           int               y,
+                           int               zoom)
+{
+  Slot *slot;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  if (!(slot = find_slot (self, x, y, zoom)))
+    return FALSE;
+
+  remove_slot (self, slot);
+  return TRUE;
+}
+
+
+void
+shumate_tile_index_remove_all (ShumateTileIndex *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (self->value_destroy_func)
+    {
+      for (gsize i = 0; i < self->capacity; i ++)
+        {
+          if (SLOT_IS_USED (&self->slots[i]))
+            self->value_destroy_func (self->slots[i].value);
+        }
+    }
+
+  memset (self->slots, 0, self->capacity * sizeof (Slot));
+  self->size = 0;
+  self->n_tombstones = 0;
+}
+
+
+void
+shumate_tile_index_iter_init (ShumateTileIndexIter *iter,
+                              ShumateTileIndex     *index)
+{
+  g_return_if_fail (iter != NULL);
+  g_return_if_fail (index != NULL);
+
+  iter->index = index;
+  iter->position = 0;
+}
+
+
+/*
+ * shumate_tile_index_iter_next:
+ *
+ * Advances @iter to the next entry. Any of the out parameters may be %NULL.
+ *
+ * Returns: %FALSE if the end of the index has been reached
+ */
+gboolean
+shumate_tile_index_iter_next (ShumateTileIndexIter *iter,
+                              int                  *x,
+                              int                  *y,
+                              int                  *zoom,
+                              gpointer             *value)
+{
+  ShumateTileIndex *self;
+
+  g_return_val_if_fail (iter != NULL, FALSE);
+
+  self = iter->index;
+
+  while (iter->position < self->capacity)
+    {
+      Slot *slot = &self->slots[iter->position ++];
+
+      if (!SLOT_IS_USED (slot))
+        continue;
+
+      if (x)
+        *x = slot->x;
+      if (y)
+        *y = slot->y;
+      if (zoom)
+        *zoom = slot->zoom;
+      if (value)
+        *value = slot->value;
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+
+/*
+ * shumate_tile_index_iter_remove:
+ *
+ * Removes the entry last returned by shumate_tile_index_iter_next(). Unlike
+ * insertion, this does not invalidate the iterator.
+ */
+void
+shumate_tile_index_iter_remove (ShumateTileIndexIter *iter)
+{
+  Slot *slot;
+
+  g_return_if_fail (iter != NULL);
+  g_return_if_fail (iter->position > 0);
+
+  slot = &iter->index->slots[iter->position - 1];
+  g_return_if_fail (SLOT_IS_USED (slot));
+
+  remove_slot (iter->index, slot);
+}
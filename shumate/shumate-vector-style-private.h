@@ -0,0 +1,47 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "shumate-vector-style.h"
+
+G_BEGIN_DECLS
+
+/* A decoded vector tile. It is immutable and reference counted, so it can be
+ * kept around and rendered again, from any thread, without decoding the
+ * tile data a second time. */
+typedef struct _ShumateVectorTile ShumateVectorTile;
+
+ShumateVectorTile *shumate_vector_tile_new      (GBytes            *tile_data);
+ShumateVectorTile *shumate_vector_tile_ref      (ShumateVectorTile *self);
+void               shumate_vector_tile_unref    (ShumateVectorTile *self);
+GBytes            *shumate_vector_tile_get_data (ShumateVectorTile *self);
+
+GdkTexture *shumate_vector_style_render_tile (ShumateVectorStyle *self,
+                                              int                 texture_size,
+                                              ShumateVectorTile  *tile,
+                                              double              zoom_level);
+GdkTexture *shumate_vector_style_render_tile_area (ShumateVectorStyle *self,
+                                                   int                 texture_size,
+                                                   ShumateVectorTile  *tile,
+                                                   double              zoom_level,
+                                                   int                 overzoom,
+                                                   int                 x,
+                                                   int                 y);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ShumateVectorTile, shumate_vector_tile_unref)
+
+G_END_DECLS
@@ -26,7 +26,7 @@
 #endif
 
 #include <glib-object.h>
-#include "shumate-vector-style.h"
+#include "shumate-vector-style-private.h"
 
 struct _ShumateVectorStyle
 {
@@ -281,46 +281,249 @@ texture_new_for_surface (cairo_surface_t *surface)
 #endif
 
 
-/**
- * shumate_vector_style_render:
- * @self: a [class@VectorStyle]
+struct _ShumateVectorTile
+{
+  GBytes *data;
+#ifdef SHUMATE_VECTOR_RENDERER
+  VectorTile__Tile *tile;
+  /* The bounds of each feature, by layer, so rendering part of the tile can
+   * skip the features outside of it */
+  ShumateVectorBounds **feature_bounds;
+#endif
+};
+
+static void
+vector_tile_clear (ShumateVectorTile *self)
+{
+  g_clear_pointer (&self->data, g_bytes_unref);
+#ifdef SHUMATE_VECTOR_RENDERER
+  for (int i = 0; i < self->tile->n_layers; i ++)
+    g_free (self->feature_bounds[i]);
+  g_free (self->feature_bounds);
+
+  vector_tile__tile__free_unpacked (self->tile, NULL);
+#endif
+}
+
+/*
+ * shumate_vector_tile_new:
+ * @tile_data: the tile in Mapbox Vector Tile format
  *
- * Renders a tile to a texture using this style.
+ * Decodes a vector tile.
  *
- * Returns: (transfer full): a [class@Gdk.Texture] containing the rendered tile
+ * Returns: (transfer full) (nullable): the decoded tile, or %NULL if
+ *   @tile_data isn't a valid vector tile
  */
-GdkTexture *
-shumate_vector_style_render (ShumateVectorStyle *self, int texture_size, GBytes *tile_data, double zoom_level)
+ShumateVectorTile *
+shumate_vector_tile_new (GBytes *tile_data)
 {
 #ifdef SHUMATE_VECTOR_RENDERER
-  ShumateVectorRenderScope scope;
-  GdkTexture *texture;
-  cairo_surface_t *surface;
+  ShumateVectorTile *self;
+  VectorTile__Tile *tile;
   gconstpointer data;
   gsize len;
 
-  g_return_val_if_fail (SHUMATE_IS_VECTOR_STYLE (self), NULL);
+  g_return_val_if_fail (tile_data != NULL, NULL);
+
+  data = g_bytes_get_data (tile_data, &len);
+  tile = vector_tile__tile__unpack (NULL, len, data);
+  if (tile == NULL)
+    return NULL;
+
+  self = g_atomic_rc_box_new0 (ShumateVectorTile);
+  self->data = g_bytes_ref (tile_data);
+  self->tile = tile;
 
-  scope.target_size = texture_size;
+  self->feature_bounds = g_new (ShumateVectorBounds *, MAX (tile->n_layers, 1));
+  for (int i = 0; i < tile->n_layers; i ++)
+    {
+      VectorTile__Tile__Layer *layer = tile->layers[i];
+
+      self->feature_bounds[i] = g_new (ShumateVectorBounds, MAX (layer->n_features, 1));
+      for (int j = 0; j < layer->n_features; j ++)
+        shumate_vector_feature_get_bounds (layer->features[j], &self->feature_bounds[i][j]);
+    }
+
+  return self;
+#else
+  g_return_val_if_reached (NULL);
+#endif
+}
+
+ShumateVectorTile *
+shumate_vector_tile_ref (ShumateVectorTile *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  return g_atomic_rc_box_acquire (self);
+}
+
+void
+shumate_vector_tile_unref (ShumateVectorTile *self)
+{
+  g_return_if_fail (self != NULL);
+  g_atomic_rc_box_release_full (self, (GDestroyNotify) vector_tile_clear);
+}
+
+/*
+ * shumate_vector_tile_get_data:
+ *
+ * Returns: (transfer none): the data the tile was decoded from
+ */
+GBytes *
+shumate_vector_tile_get_data (ShumateVectorTile *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  return self->data;
+}
+
+
+#ifdef SHUMATE_VECTOR_RENDERER
+/* Renders the square of the tile that the descendant tile at (x, y), overzoom
+ * levels deeper, covers. feature_bounds may be NULL, in which case they are
+ * computed as needed. If cull is set, features outside of that square are
+ * skipped. */
+static GdkTexture *
+render (ShumateVectorStyle   *self,
+        int                   texture_size,
+        VectorTile__Tile     *tile,
+        ShumateVectorBounds **feature_bounds,
+        gboolean              cull,
+        double                zoom_level,
+        int                   overzoom,
+        int                   x,
+        int                   y)
+{
+  ShumateVectorRenderScope scope;
+  GdkTexture *texture;
+  cairo_surface_t *surface;
+
+  /* Draw the whole tile scaled up, shifted so the square ends up on the
+   * texture */
+  scope.target_size = texture_size << overzoom;
   scope.zoom_level = zoom_level;
+  scope.visible_area = (cairo_rectangle_t) { x * texture_size, y * texture_size, texture_size, texture_size };
 
   surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, texture_size, texture_size);
   scope.cr = cairo_create (surface);
+  cairo_translate (scope.cr, -scope.visible_area.x, -scope.visible_area.y);
 
-  data = g_bytes_get_data (tile_data, &len);
-  scope.tile = vector_tile__tile__unpack (NULL, len, data);
+  scope.tile = tile;
+  scope.feature_bounds = feature_bounds;
+  scope.cull = cull;
+  scope.layer_keys = NULL;
+  scope.pending_paint.op = SHUMATE_VECTOR_PAINT_NONE;
+  scope.pending_bounds = NULL;
+  scope.n_draw_calls = 0;
 
   if (scope.tile != NULL)
     for (int i = 0; i < self->layers->len; i ++)
       shumate_vector_layer_render ((ShumateVectorLayer *)self->layers->pdata[i], &scope);
 
+  shumate_vector_render_scope_clear (&scope);
+
   texture = texture_new_for_surface (surface);
 
   cairo_destroy (scope.cr);
   cairo_surface_destroy (surface);
-  vector_tile__tile__free_unpacked (scope.tile, NULL);
 
   return texture;
+}
+#endif
+
+
+/**
+ * shumate_vector_style_render:
+ * @self: a [class@VectorStyle]
+ *
+ * Renders a tile to a texture using this style.
+ *
+ * A style is immutable once it has been created, so this function may be
+ * called from several threads at once.
+ *
+ * Returns: (transfer full): a [class@Gdk.Texture] containing the rendered tile
+ */
+GdkTexture *
+shumate_vector_style_render (ShumateVectorStyle *self, int texture_size, GBytes *tile_data, double zoom_level)
+{
+#ifdef SHUMATE_VECTOR_RENDERER
+  VectorTile__Tile *tile;
+  GdkTexture *texture;
+  gconstpointer data;
+  gsize len;
+
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_STYLE (self), NULL);
+
+  data = g_bytes_get_data (tile_data, &len);
+  tile = vector_tile__tile__unpack (NULL, len, data);
+
+  texture = render (self, texture_size, tile, NULL, FALSE, zoom_level, 0, 0, 0);
+
+  vector_tile__tile__free_unpacked (tile, NULL);
+
+  return texture;
+#else
+  g_return_val_if_reached (NULL);
+#endif
+}
+
+/*
+ * shumate_vector_style_render_tile:
+ * @self: a [class@VectorStyle]
+ *
+ * Like shumate_vector_style_render(), but for a tile that has already been
+ * decoded. Rendering doesn't modify @tile, so the same tile may be rendered
+ * from several threads at once.
+ *
+ * Returns: (transfer full): a [class@Gdk.Texture] containing the rendered tile
+ */
+GdkTexture *
+shumate_vector_style_render_tile (ShumateVectorStyle *self,
+                                  int                 texture_size,
+                                  ShumateVectorTile  *tile,
+                                  double              zoom_level)
+{
+#ifdef SHUMATE_VECTOR_RENDERER
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_STYLE (self), NULL);
+  g_return_val_if_fail (tile != NULL, NULL);
+
+  return render (self, texture_size, tile->tile, tile->feature_bounds, FALSE, zoom_level, 0, 0, 0);
+#else
+  g_return_val_if_reached (NULL);
+#endif
+}
+
+/*
+ * shumate_vector_style_render_tile_area:
+ * @self: a [class@VectorStyle]
+ * @overzoom: how many zoom levels below @tile the area is
+ * @x: the column of the area, counted from @tile's left edge
+ * @y: the row of the area, counted from @tile's top edge
+ *
+ * Renders the part of @tile that a tile @overzoom levels deeper covers, for
+ * showing a tile beyond the highest zoom level that has data. @zoom_level
+ * is the zoom level of the deeper tile. Features outside of the area are
+ * not drawn at all, so this costs about as much as rendering the part of
+ * the tile that is visible.
+ *
+ * Returns: (transfer full): a [class@Gdk.Texture] containing the rendered area
+ */
+GdkTexture *
+shumate_vector_style_render_tile_area (ShumateVectorStyle *self,
+                                       int                 texture_size,
+                                       ShumateVectorTile  *tile,
+                                       double              zoom_level,
+                                       int                 overzoom,
+                                       int                 x,
+                                       int                 y)
+{
+#ifdef SHUMATE_VECTOR_RENDERER
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_STYLE (self), NULL);
+  g_return_val_if_fail (tile != NULL, NULL);
+  g_return_val_if_fail (overzoom >= 0 && overzoom < 16, NULL);
+  g_return_val_if_fail (x >= 0 && x < 1 << overzoom, NULL);
+  g_return_val_if_fail (y >= 0 && y < 1 << overzoom, NULL);
+
+  return render (self, texture_size, tile->tile, tile->feature_bounds, TRUE, zoom_level, overzoom, x, y);
 #else
   g_return_val_if_reached (NULL);
 #endif
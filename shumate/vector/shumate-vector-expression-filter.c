@@ -211,164 +211,213 @@ shumate_vector_expression_filter_finalize (GObject *object)
 }
 
 
+/* If @expr is a literal string, returns the index of a constant holding it,
+ * so variable lookups can use it directly */
 static gboolean
-shumate_vector_expression_filter_eval (ShumateVectorExpression  *expr,
-                                       ShumateVectorRenderScope *scope,
-                                       ShumateVectorValue       *out)
+get_key_constant (ShumateVectorExpression *expr,
+                  ShumateVectorProgram    *program,
+                  guint                   *constant)
+{
+  ShumateVectorValue *value;
+  const char *string;
+
+  if (!SHUMATE_IS_VECTOR_EXPRESSION_LITERAL (expr))
+    return FALSE;
+
+  value = shumate_vector_expression_literal_get_value ((ShumateVectorExpressionLiteral *)expr);
+  if (!shumate_vector_value_get_string (value, &string))
+    return FALSE;
+
+  *constant = shumate_vector_program_add_constant (program, value);
+  return TRUE;
+}
+
+
+static void
+push_boolean (ShumateVectorProgram *program, gboolean boolean)
 {
-  ShumateVectorExpressionFilter *self = (ShumateVectorExpressionFilter *)expr;
   g_auto(ShumateVectorValue) value = SHUMATE_VECTOR_VALUE_INIT;
-  g_auto(ShumateVectorValue) value2 = SHUMATE_VECTOR_VALUE_INIT;
-  gboolean inverted = FALSE;
-  gboolean boolean;
-  double number, number2;
-  g_autofree char *string = NULL;
+
+  shumate_vector_value_set_boolean (&value, boolean);
+  shumate_vector_program_emit (program,
+                               SHUMATE_VECTOR_OP_PUSH,
+                               shumate_vector_program_add_constant (program, &value));
+}
+
+
+/* Emits code that evaluates the expressions in order until one of them is
+ * @stop_at, which pushes @stop_at ^ @inverted, or pushes !@stop_at ^
+ * @inverted if none are. A result that isn't a boolean fails. */
+static void
+compile_short_circuit (ShumateVectorExpressionFilter *self,
+                       ShumateVectorProgram          *program,
+                       gboolean                       stop_at,
+                       gboolean                       inverted)
+{
+  g_autoptr(GArray) jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+  guint jump_to_end;
+
+  for (guint i = 0; i < self->expressions->len; i ++)
+    {
+      guint jump;
+
+      shumate_vector_expression_compile (self->expressions->pdata[i], program);
+      jump = shumate_vector_program_emit (program,
+                                          stop_at ? SHUMATE_VECTOR_OP_JUMP_IF_TRUE : SHUMATE_VECTOR_OP_JUMP_IF_FALSE,
+                                          0);
+      g_array_append_val (jumps, jump);
+    }
+
+  push_boolean (program, !stop_at ^ inverted);
+  jump_to_end = shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_JUMP, 0);
+
+  for (guint i = 0; i < jumps->len; i ++)
+    shumate_vector_program_patch (program,
+                                  g_array_index (jumps, guint, i),
+                                  shumate_vector_program_get_position (program));
+  push_boolean (program, stop_at ^ inverted);
+
+  shumate_vector_program_patch (program, jump_to_end, shumate_vector_program_get_position (program));
+}
+
+
+/* Emits code that compares the first expression to each of the others, in
+ * order, until one is equal */
+static void
+compile_in (ShumateVectorExpressionFilter *self,
+            ShumateVectorProgram          *program,
+            gboolean                       inverted)
+{
+  g_autoptr(GArray) jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+  guint jump_to_end;
+
+  shumate_vector_expression_compile (self->expressions->pdata[0], program);
+
+  for (guint i = 1; i < self->expressions->len; i ++)
+    {
+      guint jump;
+
+      shumate_vector_expression_compile (self->expressions->pdata[i], program);
+      jump = shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_JUMP_IF_EQUAL, 0);
+      g_array_append_val (jumps, jump);
+    }
+
+  shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_POP, 0);
+  push_boolean (program, FALSE ^ inverted);
+  jump_to_end = shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_JUMP, 0);
+
+  for (guint i = 0; i < jumps->len; i ++)
+    shumate_vector_program_patch (program,
+                                  g_array_index (jumps, guint, i),
+                                  shumate_vector_program_get_position (program));
+  shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_POP, 0);
+  push_boolean (program, TRUE ^ inverted);
+
+  shumate_vector_program_patch (program, jump_to_end, shumate_vector_program_get_position (program));
+}
+
+
+static void
+compile_binary (ShumateVectorExpressionFilter *self,
+                ShumateVectorProgram          *program,
+                ShumateVectorOp                op)
+{
+  g_assert (self->expressions->len == 2);
+
+  shumate_vector_expression_compile (self->expressions->pdata[0], program);
+  shumate_vector_expression_compile (self->expressions->pdata[1], program);
+  shumate_vector_program_emit (program, op, 0);
+}
+
+
+static void
+shumate_vector_expression_filter_compile (ShumateVectorExpression *expr,
+                                          ShumateVectorProgram    *program)
+{
+  ShumateVectorExpressionFilter *self = (ShumateVectorExpressionFilter *)expr;
   ShumateVectorExpression **expressions = (ShumateVectorExpression **)self->expressions->pdata;
   guint n_expressions = self->expressions->len;
+  guint key;
 
   switch (self->type)
     {
     case EXPR_NOT:
       g_assert (n_expressions == 1);
 
-      if (!shumate_vector_expression_eval (expressions[0], scope, &value))
-        return FALSE;
-      if (!shumate_vector_value_get_boolean (&value, &boolean))
-        return FALSE;
-
-      shumate_vector_value_set_boolean (out, !boolean);
-      return TRUE;
+      shumate_vector_expression_compile (expressions[0], program);
+      shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_NOT, 0);
+      break;
 
     case EXPR_NONE:
-      inverted = TRUE;
-      G_GNUC_FALLTHROUGH;
-    case EXPR_ANY:
-      for (int i = 0; i < n_expressions; i ++)
-        {
-          if (!shumate_vector_expression_eval (expressions[i], scope, &value))
-            return FALSE;
-          if (!shumate_vector_value_get_boolean (&value, &boolean))
-            return FALSE;
-
-          if (boolean)
-            {
-              shumate_vector_value_set_boolean (out, TRUE ^ inverted);
-              return TRUE;
-            }
-        }
+      compile_short_circuit (self, program, TRUE, TRUE);
+      break;
 
-      shumate_vector_value_set_boolean (out, FALSE ^ inverted);
-      return TRUE;
+    case EXPR_ANY:
+      compile_short_circuit (self, program, TRUE, FALSE);
+      break;
 
     case EXPR_ALL:
-      for (int i = 0; i < n_expressions; i ++)
-        {
-          if (!shumate_vector_expression_eval (expressions[i], scope, &value))
-            return FALSE;
-          if (!shumate_vector_value_get_boolean (&value, &boolean))
-            return FALSE;
-
-          if (!boolean)
-            {
-              shumate_vector_value_set_boolean (out, FALSE);
-              return TRUE;
-            }
-        }
-
-      shumate_vector_value_set_boolean (out, TRUE);
-      return TRUE;
+      compile_short_circuit (self, program, FALSE, FALSE);
+      break;
 
-    case EXPR_NOT_HAS:
-      inverted = TRUE;
-      G_GNUC_FALLTHROUGH;
     case EXPR_HAS:
+    case EXPR_NOT_HAS:
       g_assert (n_expressions == 1);
 
-      string = shumate_vector_expression_eval_string (expressions[0], scope, NULL);
-      shumate_vector_render_scope_get_variable (scope, string, &value);
-      shumate_vector_value_set_boolean (out, !shumate_vector_value_is_null (&value) ^ inverted);
-      return TRUE;
+      if (get_key_constant (expressions[0], program, &key))
+        shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_HAS_KEY, key);
+      else
+        {
+          shumate_vector_expression_compile (expressions[0], program);
+          shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_HAS, 0);
+        }
+
+      if (self->type == EXPR_NOT_HAS)
+        shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_NOT, 0);
+      break;
 
     case EXPR_GET:
       g_assert (n_expressions == 1);
 
-      string = shumate_vector_expression_eval_string (expressions[0], scope, NULL);
-      shumate_vector_render_scope_get_variable (scope, string, &value);
-      shumate_vector_value_copy (&value, out);
-      return TRUE;
+      if (get_key_constant (expressions[0], program, &key))
+        shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_GET_KEY, key);
+      else
+        {
+          shumate_vector_expression_compile (expressions[0], program);
+          shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_GET, 0);
+        }
+      break;
 
-    case EXPR_NOT_IN:
-      inverted = TRUE;
-      G_GNUC_FALLTHROUGH;
     case EXPR_IN:
+    case EXPR_NOT_IN:
       g_assert (n_expressions >= 1);
 
-      shumate_vector_expression_eval (expressions[0], scope, &value);
-
-      for (int i = 1; i < n_expressions; i ++)
-        {
-          shumate_vector_expression_eval (expressions[i], scope, &value2);
-          if (shumate_vector_value_equal (&value, &value2))
-            {
-              shumate_vector_value_set_boolean (out, TRUE ^ inverted);
-              return TRUE;
-            }
-        }
-
-      shumate_vector_value_set_boolean (out, FALSE ^ inverted);
-      return TRUE;
+      compile_in (self, program, self->type == EXPR_NOT_IN);
+      break;
 
-    case EXPR_NE:
-      inverted = TRUE;
-      G_GNUC_FALLTHROUGH;
     case EXPR_EQ:
-      g_assert (n_expressions == 2);
-
-      if (!shumate_vector_expression_eval (expressions[0], scope, &value))
-        return FALSE;
-      if (!shumate_vector_expression_eval (expressions[1], scope, &value2))
-        return FALSE;
+      compile_binary (self, program, SHUMATE_VECTOR_OP_EQ);
+      break;
 
-      shumate_vector_value_set_boolean (out, shumate_vector_value_equal (&value, &value2) ^ inverted);
-      return TRUE;
+    case EXPR_NE:
+      compile_binary (self, program, SHUMATE_VECTOR_OP_NE);
+      break;
 
-    case EXPR_LE:
-      inverted = TRUE;
-      G_GNUC_FALLTHROUGH;
     case EXPR_GT:
-      g_assert (n_expressions == 2);
-
-      if (!shumate_vector_expression_eval (expressions[0], scope, &value))
-        return FALSE;
-      if (!shumate_vector_expression_eval (expressions[1], scope, &value2))
-        return FALSE;
-
-      if (!shumate_vector_value_get_number (&value, &number))
-        return FALSE;
-      if (!shumate_vector_value_get_number (&value2, &number2))
-        return FALSE;
-
-      shumate_vector_value_set_boolean (out, (number > number2) ^ inverted);
-      return TRUE;
+      compile_binary (self, program, SHUMATE_VECTOR_OP_GT);
+      break;
 
-    case EXPR_GE:
-      inverted = TRUE;
-      G_GNUC_FALLTHROUGH;
     case EXPR_LT:
-      g_assert (n_expressions == 2);
-
-      if (!shumate_vector_expression_eval (expressions[0], scope, &value))
-        return FALSE;
-      if (!shumate_vector_expression_eval (expressions[1], scope, &value2))
-        return FALSE;
+      compile_binary (self, program, SHUMATE_VECTOR_OP_LT);
+      break;
 
-      if (!shumate_vector_value_get_number (&value, &number))
-        return FALSE;
-      if (!shumate_vector_value_get_number (&value2, &number2))
-        return FALSE;
+    case EXPR_GE:
+      compile_binary (self, program, SHUMATE_VECTOR_OP_GE);
+      break;
 
-      shumate_vector_value_set_boolean (out, (number < number2) ^ inverted);
-      return TRUE;
+    case EXPR_LE:
+      compile_binary (self, program, SHUMATE_VECTOR_OP_LE);
+      break;
 
     default:
       g_assert_not_reached ();
@@ -382,7 +431,7 @@ shumate_vector_expression_filter_class_init (ShumateVectorExpressionFilterClass
   ShumateVectorExpressionClass *expr_class = SHUMATE_VECTOR_EXPRESSION_CLASS (klass);
 
   object_class->finalize = shumate_vector_expression_filter_finalize;
-  expr_class->eval = shumate_vector_expression_filter_eval;
+  expr_class->compile = shumate_vector_expression_filter_compile;
 }
 
 
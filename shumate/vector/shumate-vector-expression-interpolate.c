@@ -17,12 +17,11 @@
 
 #include "shumate-vector-style.h"
 #include "shumate-vector-expression-interpolate-private.h"
-#include "shumate-vector-expression-literal-private.h"
 #include "shumate-vector-utils-private.h"
 
 typedef struct {
   double point;
-  ShumateVectorExpression *expr;
+  ShumateVectorValue value;
 } Stop;
 
 struct _ShumateVectorExpressionInterpolate
@@ -109,7 +108,7 @@ shumate_vector_expression_interpolate_from_json_obj (JsonObject *object, GError
 
           stop = g_new0 (Stop, 1);
           stop->point = json_node_get_double (point_node);
-          stop->expr = shumate_vector_expression_literal_new (&value);
+          shumate_vector_value_copy (&value, &stop->value);
 
           g_ptr_array_add (self->stops, stop);
         }
@@ -122,59 +121,11 @@ shumate_vector_expression_interpolate_from_json_obj (JsonObject *object, GError
 static void
 stop_free (Stop *stop)
 {
-  g_clear_object (&stop->expr);
+  shumate_vector_value_unset (&stop->value);
   g_free (stop);
 }
 
 
-static double
-lerp_double (double a, double b, double pos)
-{
-  return (b - a) * pos + a;
-}
-
-
-static void
-lerp (ShumateVectorValue *last_value, ShumateVectorValue *next_value, double pos, ShumateVectorValue *out)
-{
-  gdouble last_double, next_double;
-  GdkRGBA last_color, next_color;
-
-  if (shumate_vector_value_get_number (last_value, &last_double)
-      && shumate_vector_value_get_number (next_value, &next_double))
-    shumate_vector_value_set_number (out, lerp_double (last_double, next_double, pos));
-  else if (shumate_vector_value_get_color (last_value, &last_color)
-      && shumate_vector_value_get_color (next_value, &next_color))
-    {
-      GdkRGBA color = {
-        .red = lerp_double (last_color.red, next_color.red, pos),
-        .green = lerp_double (last_color.green, next_color.green, pos),
-        .blue = lerp_double (last_color.blue, next_color.blue, pos),
-        .alpha = lerp_double (last_color.alpha, next_color.alpha, pos),
-      };
-      shumate_vector_value_set_color (out, &color);
-    }
-  else
-    shumate_vector_value_unset (out);
-}
-
-
-static void
-exp_interp (double last_point,
-            double next_point,
-            ShumateVectorValue *last_value,
-            ShumateVectorValue *next_value,
-            double input,
-            double base,
-            ShumateVectorValue *dest)
-{
-  double diff = next_point - last_point;
-  double pos = input - last_point;
-
-  lerp (last_value, next_value, (pow (base, pos) - 1.0) / (pow (base, diff) - 1.0), dest);
-}
-
-
 static void
 shumate_vector_expression_interpolate_finalize (GObject *object)
 {
@@ -187,47 +138,20 @@ shumate_vector_expression_interpolate_finalize (GObject *object)
 }
 
 
-static gboolean
-shumate_vector_expression_interpolate_eval (ShumateVectorExpression  *expr,
-                                            ShumateVectorRenderScope *scope,
-                                            ShumateVectorValue       *out)
+static void
+shumate_vector_expression_interpolate_compile (ShumateVectorExpression *expr,
+                                               ShumateVectorProgram    *program)
 {
   ShumateVectorExpressionInterpolate *self = (ShumateVectorExpressionInterpolate *)expr;
-  double zoom = scope->zoom_level;
-  Stop **stops = (Stop **)self->stops->pdata;
-  guint n_stops = self->stops->len;
-
-  if (n_stops == 0)
-    return FALSE;
+  guint interpolation = shumate_vector_program_add_interpolation (program, self->base);
 
-  if (zoom < stops[0]->point)
-    return shumate_vector_expression_eval (stops[0]->expr, scope, out);
-
-  for (int i = 1; i < n_stops; i ++)
+  for (guint i = 0; i < self->stops->len; i ++)
     {
-      Stop *last = stops[i - 1];
-      Stop *next = stops[i];
-      if (last->point <= zoom && zoom < next->point)
-        {
-          double pos_norm = (zoom - last->point) / (next->point - last->point);
-          g_auto(ShumateVectorValue) last_value = SHUMATE_VECTOR_VALUE_INIT;
-          g_auto(ShumateVectorValue) next_value = SHUMATE_VECTOR_VALUE_INIT;
-
-          if (!shumate_vector_expression_eval (last->expr, scope, &last_value))
-            return FALSE;
-          if (!shumate_vector_expression_eval (next->expr, scope, &next_value))
-            return FALSE;
-
-          if (self->base == 1.0)
-            lerp (&last_value, &next_value, pos_norm, out);
-          else
-            exp_interp (last->point, next->point, &last_value, &next_value, zoom, self->base, out);
-
-          return TRUE;
-        }
+      Stop *stop = self->stops->pdata[i];
+      shumate_vector_program_add_stop (program, interpolation, stop->point, &stop->value);
     }
 
-  return shumate_vector_expression_eval (stops[n_stops - 1]->expr, scope, out);
+  shumate_vector_program_emit (program, SHUMATE_VECTOR_OP_INTERPOLATE, interpolation);
 }
 
 
@@ -238,7 +162,7 @@ shumate_vector_expression_interpolate_class_init (ShumateVectorExpressionInterpo
   ShumateVectorExpressionClass *expr_class = SHUMATE_VECTOR_EXPRESSION_CLASS (klass);
 
   object_class->finalize = shumate_vector_expression_interpolate_finalize;
-  expr_class->eval = shumate_vector_expression_interpolate_eval;
+  expr_class->compile = shumate_vector_expression_interpolate_compile;
 }
 
 static void
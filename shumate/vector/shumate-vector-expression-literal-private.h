@@ -27,4 +27,6 @@ G_DECLARE_FINAL_TYPE (ShumateVectorExpressionLiteral, shumate_vector_expression_
 
 ShumateVectorExpression *shumate_vector_expression_literal_new (ShumateVectorValue *value);
 
+ShumateVectorValue *shumate_vector_expression_literal_get_value (ShumateVectorExpressionLiteral *self);
+
 G_END_DECLS
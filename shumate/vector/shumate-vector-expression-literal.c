@@ -31,10 +31,26 @@ ShumateVectorExpression *
 shumate_vector_expression_literal_new (ShumateVectorValue *value)
 {
   ShumateVectorExpressionLiteral *self = g_object_new (SHUMATE_TYPE_VECTOR_EXPRESSION_LITERAL, NULL);
+  const char *string;
+
   shumate_vector_value_copy (value, &self->value);
+
+  /* Any string may be used as a key. Intern them while the style is loaded,
+   * because render scopes only recognize the keys of a tile layer that are
+   * already quarks. */
+  if (shumate_vector_value_get_string (value, &string))
+    g_quark_from_string (string);
+
   return (ShumateVectorExpression *)self;
 }
 
+ShumateVectorValue *
+shumate_vector_expression_literal_get_value (ShumateVectorExpressionLiteral *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION_LITERAL (self), NULL);
+  return &self->value;
+}
+
 static void
 shumate_vector_expression_literal_finalize (GObject *object)
 {
@@ -45,14 +61,15 @@ shumate_vector_expression_literal_finalize (GObject *object)
   G_OBJECT_CLASS (shumate_vector_expression_literal_parent_class)->finalize (object);
 }
 
-static gboolean
-shumate_vector_expression_literal_eval (ShumateVectorExpression  *expr,
-                                        ShumateVectorRenderScope *scope,
-                                        ShumateVectorValue       *out)
+static void
+shumate_vector_expression_literal_compile (ShumateVectorExpression *expr,
+                                           ShumateVectorProgram    *program)
 {
   ShumateVectorExpressionLiteral *self = (ShumateVectorExpressionLiteral *)expr;
-  shumate_vector_value_copy (&self->value, out);
-  return TRUE;
+
+  shumate_vector_program_emit (program,
+                               SHUMATE_VECTOR_OP_PUSH,
+                               shumate_vector_program_add_constant (program, &self->value));
 }
 
 static void
@@ -62,7 +79,7 @@ shumate_vector_expression_literal_class_init (ShumateVectorExpressionLiteralClas
   ShumateVectorExpressionClass *expr_class = SHUMATE_VECTOR_EXPRESSION_CLASS (klass);
 
   object_class->finalize = shumate_vector_expression_literal_finalize;
-  expr_class->eval = shumate_vector_expression_literal_eval;
+  expr_class->compile = shumate_vector_expression_literal_compile;
 }
 
 static void
@@ -18,6 +18,7 @@
 #pragma once
 
 #include <json-glib/json-glib.h>
+#include "shumate-vector-program-private.h"
 #include "shumate-vector-render-scope-private.h"
 #include "shumate-vector-value-private.h"
 
@@ -30,13 +31,17 @@ struct _ShumateVectorExpressionClass
 {
   GObjectClass parent_class;
 
-  gboolean (*eval) (ShumateVectorExpression  *self,
-                    ShumateVectorRenderScope *scope,
-                    ShumateVectorValue       *out);
+  void (*compile) (ShumateVectorExpression *self,
+                   ShumateVectorProgram    *program);
 };
 
 ShumateVectorExpression *shumate_vector_expression_from_json (JsonNode *json, GError **error);
 
+void shumate_vector_expression_compile (ShumateVectorExpression *self,
+                                        ShumateVectorProgram    *program);
+
+ShumateVectorDependency shumate_vector_expression_get_dependency (ShumateVectorExpression *self);
+
 gboolean shumate_vector_expression_eval (ShumateVectorExpression  *self,
                                          ShumateVectorRenderScope *scope,
                                          ShumateVectorValue       *out);
@@ -60,4 +65,14 @@ char *shumate_vector_expression_eval_string (ShumateVectorExpression  *self,
 void shumate_vector_expression_eval_color (ShumateVectorExpression  *self,
                                            ShumateVectorRenderScope *scope,
                                            GdkRGBA                  *color);
+
+double shumate_vector_expression_eval_number_cached (ShumateVectorExpression  *self,
+                                                     ShumateVectorRenderScope *scope,
+                                                     guint                     property,
+                                                     double                    default_val);
+
+void shumate_vector_expression_eval_color_cached (ShumateVectorExpression  *self,
+                                                  ShumateVectorRenderScope *scope,
+                                                  guint                     property,
+                                                  GdkRGBA                  *color);
 G_END_DECLS
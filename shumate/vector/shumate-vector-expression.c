@@ -24,7 +24,13 @@
 #include "shumate-vector-value-private.h"
 
 
-G_DEFINE_TYPE (ShumateVectorExpression, shumate_vector_expression, G_TYPE_OBJECT)
+typedef struct
+{
+  /* Compiled the first time the expression is evaluated */
+  ShumateVectorProgram *program;
+} ShumateVectorExpressionPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (ShumateVectorExpression, shumate_vector_expression, G_TYPE_OBJECT)
 
 
 ShumateVectorExpression *
@@ -58,19 +64,33 @@ shumate_vector_expression_from_json (JsonNode *json, GError **error)
 }
 
 
-static gboolean
-shumate_vector_expression_real_eval (ShumateVectorExpression  *self,
-                                     ShumateVectorRenderScope *scope,
-                                     ShumateVectorValue       *out)
+static void
+shumate_vector_expression_real_compile (ShumateVectorExpression *self,
+                                        ShumateVectorProgram    *program)
 {
   g_assert_not_reached ();
 }
 
 
+static void
+shumate_vector_expression_finalize (GObject *object)
+{
+  ShumateVectorExpression *self = (ShumateVectorExpression *)object;
+  ShumateVectorExpressionPrivate *priv = shumate_vector_expression_get_instance_private (self);
+
+  g_clear_pointer (&priv->program, shumate_vector_program_free);
+
+  G_OBJECT_CLASS (shumate_vector_expression_parent_class)->finalize (object);
+}
+
+
 static void
 shumate_vector_expression_class_init (ShumateVectorExpressionClass *klass)
 {
-  klass->eval = shumate_vector_expression_real_eval;
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = shumate_vector_expression_finalize;
+  klass->compile = shumate_vector_expression_real_compile;
 }
 
 
@@ -80,13 +100,62 @@ shumate_vector_expression_init (ShumateVectorExpression *self)
 }
 
 
+/*
+ * shumate_vector_expression_compile:
+ *
+ * Emits the instructions that evaluate @self, leaving its value on top of
+ * the stack.
+ */
+void
+shumate_vector_expression_compile (ShumateVectorExpression *self,
+                                   ShumateVectorProgram    *program)
+{
+  g_return_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self));
+  SHUMATE_VECTOR_EXPRESSION_GET_CLASS (self)->compile (self, program);
+}
+
+
+/* Expressions are evaluated from the render pool, so compilation has to be
+ * thread safe */
+static ShumateVectorProgram *
+get_program (ShumateVectorExpression *self)
+{
+  ShumateVectorExpressionPrivate *priv = shumate_vector_expression_get_instance_private (self);
+
+  if (g_once_init_enter (&priv->program))
+    {
+      ShumateVectorProgram *program = shumate_vector_program_new ();
+
+      shumate_vector_expression_compile (self, program);
+      shumate_vector_program_optimize (program);
+      g_once_init_leave (&priv->program, program);
+    }
+
+  return priv->program;
+}
+
+
+/*
+ * shumate_vector_expression_get_dependency:
+ *
+ * Gets what the value of @self can change with. Expressions that only depend
+ * on the zoom level have the same value for all of a tile's features.
+ */
+ShumateVectorDependency
+shumate_vector_expression_get_dependency (ShumateVectorExpression *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self), SHUMATE_VECTOR_DEPENDS_FEATURE);
+  return shumate_vector_program_get_dependency (get_program (self));
+}
+
+
 gboolean
 shumate_vector_expression_eval (ShumateVectorExpression  *self,
                                 ShumateVectorRenderScope *scope,
                                 ShumateVectorValue       *out)
 {
   g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self), FALSE);
-  return SHUMATE_VECTOR_EXPRESSION_GET_CLASS (self)->eval (self, scope, out);
+  return shumate_vector_program_eval (get_program (self), scope, out);
 }
 
 
@@ -96,11 +165,10 @@ shumate_vector_expression_eval_number (ShumateVectorExpression  *self,
                                        double                    default_val)
 {
   double result;
-  g_auto(ShumateVectorValue) value = SHUMATE_VECTOR_VALUE_INIT;
 
-  shumate_vector_expression_eval (self, scope, &value);
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self), default_val);
 
-  if (shumate_vector_value_get_number (&value, &result))
+  if (shumate_vector_program_eval_number (get_program (self), scope, &result))
     return result;
   else
     return default_val;
@@ -113,11 +181,10 @@ shumate_vector_expression_eval_boolean (ShumateVectorExpression  *self,
                                         gboolean                  default_val)
 {
   gboolean result;
-  g_auto(ShumateVectorValue) value = SHUMATE_VECTOR_VALUE_INIT;
 
-  shumate_vector_expression_eval (self, scope, &value);
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self), default_val);
 
-  if (shumate_vector_value_get_boolean (&value, &result))
+  if (shumate_vector_program_eval_boolean (get_program (self), scope, &result))
     return result;
   else
     return default_val;
@@ -130,11 +197,10 @@ shumate_vector_expression_eval_string (ShumateVectorExpression  *self,
                                        const char               *default_val)
 {
   const char *result;
-  g_auto(ShumateVectorValue) value = SHUMATE_VECTOR_VALUE_INIT;
 
-  shumate_vector_expression_eval (self, scope, &value);
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self), NULL);
 
-  if (shumate_vector_value_get_string (&value, &result))
+  if ((result = shumate_vector_program_eval_string (get_program (self), scope)))
     return g_strdup (result);
   else
     return g_strdup (default_val);
@@ -146,7 +212,75 @@ shumate_vector_expression_eval_color (ShumateVectorExpression  *self,
                                       ShumateVectorRenderScope *scope,
                                       GdkRGBA                  *color)
 {
-  g_auto(ShumateVectorValue) value = SHUMATE_VECTOR_VALUE_INIT;
-  shumate_vector_expression_eval (self, scope, &value);
-  shumate_vector_value_get_color (&value, color);
+  g_return_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self));
+  shumate_vector_program_eval_color (get_program (self), scope, color);
+}
+
+
+/*
+ * shumate_vector_expression_eval_number_cached:
+ * @property: the index of the property in the scope's property cache
+ *
+ * Like shumate_vector_expression_eval_number(), but if @self doesn't depend on
+ * the feature, it is only evaluated for the first feature of the style layer
+ * and the result is reused for the rest.
+ */
+double
+shumate_vector_expression_eval_number_cached (ShumateVectorExpression  *self,
+                                              ShumateVectorRenderScope *scope,
+                                              guint                     property,
+                                              double                    default_val)
+{
+  ShumateVectorPropertyCache *cache;
+  double result;
+
+  g_return_val_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self), default_val);
+  g_return_val_if_fail (property < SHUMATE_VECTOR_RENDER_SCOPE_N_PROPERTIES, default_val);
+
+  cache = &scope->properties[property];
+  if (cache->cached)
+    return cache->number;
+
+  result = shumate_vector_expression_eval_number (self, scope, default_val);
+
+  if (!(shumate_vector_expression_get_dependency (self) & SHUMATE_VECTOR_DEPENDS_FEATURE))
+    {
+      cache->cached = TRUE;
+      cache->number = result;
+    }
+
+  return result;
+}
+
+
+/*
+ * shumate_vector_expression_eval_color_cached:
+ *
+ * Like shumate_vector_expression_eval_number_cached(), but for colors.
+ */
+void
+shumate_vector_expression_eval_color_cached (ShumateVectorExpression  *self,
+                                             ShumateVectorRenderScope *scope,
+                                             guint                     property,
+                                             GdkRGBA                  *color)
+{
+  ShumateVectorPropertyCache *cache;
+
+  g_return_if_fail (SHUMATE_IS_VECTOR_EXPRESSION (self));
+  g_return_if_fail (property < SHUMATE_VECTOR_RENDER_SCOPE_N_PROPERTIES);
+
+  cache = &scope->properties[property];
+  if (cache->cached)
+    {
+      *color = cache->color;
+      return;
+    }
+
+  shumate_vector_expression_eval_color (self, scope, color);
+
+  if (!(shumate_vector_expression_get_dependency (self) & SHUMATE_VECTOR_DEPENDS_FEATURE))
+    {
+      cache->cached = TRUE;
+      cache->color = *color;
+    }
 }
@@ -31,6 +31,12 @@ struct _ShumateVectorFillLayer
 
 G_DEFINE_TYPE (ShumateVectorFillLayer, shumate_vector_fill_layer, SHUMATE_TYPE_VECTOR_LAYER)
 
+/* Slots in the render scope's property cache */
+enum {
+  PAINT_COLOR,
+  PAINT_OPACITY,
+};
+
 
 ShumateVectorLayer *
 shumate_vector_fill_layer_create_from_json (JsonObject *object, GError **error)
@@ -60,16 +66,12 @@ static void
 shumate_vector_fill_layer_render (ShumateVectorLayer *layer, ShumateVectorRenderScope *scope)
 {
   ShumateVectorFillLayer *self = SHUMATE_VECTOR_FILL_LAYER (layer);
-  GdkRGBA color = SHUMATE_VECTOR_COLOR_BLACK;
-  double opacity;
-
-  shumate_vector_expression_eval_color (self->color, scope, &color);
-  opacity = shumate_vector_expression_eval_number (self->opacity, scope, 1.0);
+  ShumateVectorPaint paint = { SHUMATE_VECTOR_PAINT_FILL, SHUMATE_VECTOR_COLOR_BLACK };
 
-  shumate_vector_render_scope_exec_geometry (scope);
+  shumate_vector_expression_eval_color_cached (self->color, scope, PAINT_COLOR, &paint.color);
+  paint.color.alpha = shumate_vector_expression_eval_number_cached (self->opacity, scope, PAINT_OPACITY, 1.0);
 
-  cairo_set_source_rgba (scope->cr, color.red, color.green, color.blue, opacity);
-  cairo_fill (scope->cr);
+  shumate_vector_render_scope_paint (scope, &paint);
 }
 
 
@@ -131,13 +131,30 @@ shumate_vector_layer_render (ShumateVectorLayer *self, ShumateVectorRenderScope
 
   scope->feature = NULL;
 
+  for (int i = 0; i < SHUMATE_VECTOR_RENDER_SCOPE_N_PROPERTIES; i ++)
+    scope->properties[i].cached = FALSE;
+
   if (priv->source_layer == NULL)
-    /* Style layers with no source layer are rendered once */
-    SHUMATE_VECTOR_LAYER_GET_CLASS (self)->render (self, scope);
+    {
+      /* Style layers with no source layer are rendered once */
+      SHUMATE_VECTOR_LAYER_GET_CLASS (self)->render (self, scope);
+      shumate_vector_render_scope_flush (scope);
+    }
   else if (shumate_vector_render_scope_find_layer (scope, priv->source_layer))
     {
       /* Style layers with a source layer are rendered once for each feature
        * in that layer, if it exists */
+      gboolean filter_per_feature = FALSE;
+
+      /* A filter that doesn't look at the features either matches all of
+       * them or none, so it only has to be evaluated once */
+      if (priv->filter != NULL)
+        {
+          if (shumate_vector_expression_get_dependency (priv->filter) & SHUMATE_VECTOR_DEPENDS_FEATURE)
+            filter_per_feature = TRUE;
+          else if (!shumate_vector_expression_eval_boolean (priv->filter, scope, FALSE))
+            return;
+        }
 
       cairo_save (scope->cr);
 
@@ -147,10 +164,14 @@ shumate_vector_layer_render (ShumateVectorLayer *self, ShumateVectorRenderScope
       for (int j = 0; j < scope->layer->n_features; j ++)
         {
           scope->feature = scope->layer->features[j];
-          if (priv->filter == NULL || shumate_vector_expression_eval_boolean (priv->filter, scope, FALSE))
+          scope->feature_index = j;
+          if (!filter_per_feature || shumate_vector_expression_eval_boolean (priv->filter, scope, FALSE))
             SHUMATE_VECTOR_LAYER_GET_CLASS (self)->render (self, scope);
         }
 
+      /* Before restoring, since line widths are in tile units */
+      shumate_vector_render_scope_flush (scope);
+
       cairo_restore (scope->cr);
     }
 }
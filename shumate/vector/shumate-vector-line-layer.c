@@ -32,6 +32,13 @@ struct _ShumateVectorLineLayer
 
 G_DEFINE_TYPE (ShumateVectorLineLayer, shumate_vector_line_layer, SHUMATE_TYPE_VECTOR_LAYER)
 
+/* Slots in the render scope's property cache */
+enum {
+  PAINT_COLOR,
+  PAINT_OPACITY,
+  PAINT_WIDTH,
+};
+
 
 ShumateVectorLayer *
 shumate_vector_line_layer_create_from_json (JsonObject *object, GError **error)
@@ -77,19 +84,13 @@ static void
 shumate_vector_line_layer_render (ShumateVectorLayer *layer, ShumateVectorRenderScope *scope)
 {
   ShumateVectorLineLayer *self = SHUMATE_VECTOR_LINE_LAYER (layer);
-  GdkRGBA color = SHUMATE_VECTOR_COLOR_BLACK;
-  double opacity;
-  double width;
-
-  shumate_vector_expression_eval_color (self->color, scope, &color);
-  opacity = shumate_vector_expression_eval_number (self->opacity, scope, 1.0);
-  width = shumate_vector_expression_eval_number (self->width, scope, 1.0);
+  ShumateVectorPaint paint = { SHUMATE_VECTOR_PAINT_STROKE, SHUMATE_VECTOR_COLOR_BLACK };
 
-  shumate_vector_render_scope_exec_geometry (scope);
+  shumate_vector_expression_eval_color_cached (self->color, scope, PAINT_COLOR, &paint.color);
+  paint.color.alpha = shumate_vector_expression_eval_number_cached (self->opacity, scope, PAINT_OPACITY, 1.0);
+  paint.line_width = shumate_vector_expression_eval_number_cached (self->width, scope, PAINT_WIDTH, 1.0) * scope->scale;
 
-  cairo_set_source_rgba (scope->cr, color.red, color.green, color.blue, opacity);
-  cairo_set_line_width (scope->cr, width * scope->scale);
-  cairo_stroke (scope->cr);
+  shumate_vector_render_scope_paint (scope, &paint);
 }
 
 
@@ -0,0 +1,111 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+#include "shumate-vector-render-scope-private.h"
+#include "shumate-vector-value-private.h"
+
+G_BEGIN_DECLS
+
+/* Expressions are compiled into programs for a small stack machine, so that
+ * evaluating one is a loop over a flat array of instructions rather than a
+ * walk over a tree of objects. A program is immutable once compiled, and
+ * running it doesn't allocate: strings on the stack point into the program's
+ * constants or into the tile being rendered. */
+typedef struct _ShumateVectorProgram ShumateVectorProgram;
+
+typedef enum {
+  /* Pushes constant `arg` */
+  SHUMATE_VECTOR_OP_PUSH,
+  /* Pops the top of the stack */
+  SHUMATE_VECTOR_OP_POP,
+  /* Replaces a key on the stack with the value of that variable */
+  SHUMATE_VECTOR_OP_GET,
+  /* Pushes the value of the variable named by constant `arg` */
+  SHUMATE_VECTOR_OP_GET_KEY,
+  /* Replaces a key on the stack with whether that variable is set */
+  SHUMATE_VECTOR_OP_HAS,
+  /* Pushes whether the variable named by constant `arg` is set */
+  SHUMATE_VECTOR_OP_HAS_KEY,
+  /* Negates the boolean on top of the stack */
+  SHUMATE_VECTOR_OP_NOT,
+  /* Replace the top two values with the result of comparing them */
+  SHUMATE_VECTOR_OP_EQ,
+  SHUMATE_VECTOR_OP_NE,
+  SHUMATE_VECTOR_OP_GT,
+  SHUMATE_VECTOR_OP_LT,
+  SHUMATE_VECTOR_OP_GE,
+  SHUMATE_VECTOR_OP_LE,
+  /* Jumps to instruction `arg` */
+  SHUMATE_VECTOR_OP_JUMP,
+  /* Pops a boolean, and jumps to instruction `arg` if it is true or false */
+  SHUMATE_VECTOR_OP_JUMP_IF_TRUE,
+  SHUMATE_VECTOR_OP_JUMP_IF_FALSE,
+  /* Pops a value, and jumps to instruction `arg` if it is equal to the
+   * value below it */
+  SHUMATE_VECTOR_OP_JUMP_IF_EQUAL,
+  /* Pushes the value of interpolation `arg` at the current zoom level */
+  SHUMATE_VECTOR_OP_INTERPOLATE,
+} ShumateVectorOp;
+
+/* What the value of a program can change with */
+typedef enum {
+  SHUMATE_VECTOR_DEPENDS_NOTHING = 0,
+  SHUMATE_VECTOR_DEPENDS_ZOOM = 1 << 0,
+  SHUMATE_VECTOR_DEPENDS_FEATURE = 1 << 1,
+} ShumateVectorDependency;
+
+ShumateVectorProgram *shumate_vector_program_new  (void);
+void                  shumate_vector_program_free (ShumateVectorProgram *self);
+
+guint shumate_vector_program_emit              (ShumateVectorProgram *self,
+                                                ShumateVectorOp       op,
+                                                guint                 arg);
+void  shumate_vector_program_patch             (ShumateVectorProgram *self,
+                                                guint                 instruction,
+                                                guint                 target);
+guint shumate_vector_program_get_position      (ShumateVectorProgram *self);
+guint shumate_vector_program_add_constant      (ShumateVectorProgram *self,
+                                                ShumateVectorValue   *value);
+guint shumate_vector_program_add_interpolation (ShumateVectorProgram *self,
+                                                double                base);
+void  shumate_vector_program_add_stop          (ShumateVectorProgram *self,
+                                                guint                 interpolation,
+                                                double                point,
+                                                ShumateVectorValue   *value);
+
+void                    shumate_vector_program_optimize        (ShumateVectorProgram *self);
+ShumateVectorDependency shumate_vector_program_get_dependency (ShumateVectorProgram *self);
+
+gboolean    shumate_vector_program_eval         (ShumateVectorProgram     *self,
+                                                 ShumateVectorRenderScope *scope,
+                                                 ShumateVectorValue       *out);
+gboolean    shumate_vector_program_eval_number  (ShumateVectorProgram     *self,
+                                                 ShumateVectorRenderScope *scope,
+                                                 double                   *number);
+gboolean    shumate_vector_program_eval_boolean (ShumateVectorProgram     *self,
+                                                 ShumateVectorRenderScope *scope,
+                                                 gboolean                 *boolean);
+const char *shumate_vector_program_eval_string  (ShumateVectorProgram     *self,
+                                                 ShumateVectorRenderScope *scope);
+gboolean    shumate_vector_program_eval_color   (ShumateVectorProgram     *self,
+                                                 ShumateVectorRenderScope *scope,
+                                                 GdkRGBA                  *color);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ShumateVectorProgram, shumate_vector_program_free)
+
+G_END_DECLS
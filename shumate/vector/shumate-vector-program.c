@@ -0,0 +1,799 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "shumate-vector-program-private.h"
+
+enum {
+  TYPE_NULL,
+  TYPE_NUMBER,
+  TYPE_BOOLEAN,
+  TYPE_STRING,
+  TYPE_COLOR,
+};
+
+enum {
+  COLOR_UNSET,
+  COLOR_SET,
+  COLOR_INVALID,
+};
+
+/* Like ShumateVectorValue, but strings are borrowed, so values can be copied
+ * around the stack freely */
+typedef struct {
+  int type;
+  union {
+    double number;
+    gboolean boolean;
+    const char *string;
+  };
+  /* For colors, and for strings that have been parsed as one */
+  GdkRGBA color;
+  int color_state;
+  /* For string constants, so they can be used as keys without comparing
+   * strings. 0 for other strings. */
+  GQuark quark;
+} Value;
+
+typedef struct {
+  guint op;
+  guint arg;
+} Instruction;
+
+typedef struct {
+  double base;
+  guint first_stop;
+  guint n_stops;
+} Interpolation;
+
+typedef struct {
+  double point;
+  Value value;
+} Stop;
+
+struct _ShumateVectorProgram
+{
+  GArray *instructions;
+  GArray *constants;
+  /* The strings that string constants point to */
+  GPtrArray *strings;
+  GArray *interpolations;
+  GArray *stops;
+
+  /* The stack depth while emitting, and its maximum, which is how much
+   * stack running the program needs. Code after unconditional jumps is
+   * counted as if it followed on, so this may overestimate slightly. */
+  int depth;
+  int max_depth;
+
+  ShumateVectorDependency dependency;
+};
+
+static GQuark zoom_quark;
+static GQuark type_quark;
+
+
+ShumateVectorProgram *
+shumate_vector_program_new (void)
+{
+  static gsize quarks_initialized = 0;
+  ShumateVectorProgram *self = g_new0 (ShumateVectorProgram, 1);
+
+  if (g_once_init_enter (&quarks_initialized))
+    {
+      zoom_quark = g_quark_from_static_string ("zoom");
+      type_quark = g_quark_from_static_string ("$type");
+      g_once_init_leave (&quarks_initialized, 1);
+    }
+
+  self->instructions = g_array_new (FALSE, FALSE, sizeof (Instruction));
+  self->constants = g_array_new (FALSE, FALSE, sizeof (Value));
+  self->strings = g_ptr_array_new_with_free_func (g_free);
+  self->interpolations = g_array_new (FALSE, FALSE, sizeof (Interpolation));
+  self->stops = g_array_new (FALSE, FALSE, sizeof (Stop));
+
+  return self;
+}
+
+
+void
+shumate_vector_program_free (ShumateVectorProgram *self)
+{
+  if (self == NULL)
+    return;
+
+  g_array_unref (self->instructions);
+  g_array_unref (self->constants);
+  g_ptr_array_unref (self->strings);
+  g_array_unref (self->interpolations);
+  g_array_unref (self->stops);
+  g_free (self);
+}
+
+
+static int
+get_stack_effect (ShumateVectorOp op)
+{
+  switch (op)
+    {
+    case SHUMATE_VECTOR_OP_PUSH:
+    case SHUMATE_VECTOR_OP_GET_KEY:
+    case SHUMATE_VECTOR_OP_HAS_KEY:
+    case SHUMATE_VECTOR_OP_INTERPOLATE:
+      return 1;
+    case SHUMATE_VECTOR_OP_GET:
+    case SHUMATE_VECTOR_OP_HAS:
+    case SHUMATE_VECTOR_OP_NOT:
+    case SHUMATE_VECTOR_OP_JUMP:
+      return 0;
+    case SHUMATE_VECTOR_OP_POP:
+    case SHUMATE_VECTOR_OP_EQ:
+    case SHUMATE_VECTOR_OP_NE:
+    case SHUMATE_VECTOR_OP_GT:
+    case SHUMATE_VECTOR_OP_LT:
+    case SHUMATE_VECTOR_OP_GE:
+    case SHUMATE_VECTOR_OP_LE:
+    case SHUMATE_VECTOR_OP_JUMP_IF_TRUE:
+    case SHUMATE_VECTOR_OP_JUMP_IF_FALSE:
+    case SHUMATE_VECTOR_OP_JUMP_IF_EQUAL:
+      return -1;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+
+/*
+ * shumate_vector_program_emit:
+ *
+ * Appends an instruction to the program.
+ *
+ * Returns: the index of the instruction, for shumate_vector_program_patch()
+ */
+guint
+shumate_vector_program_emit (ShumateVectorProgram *self,
+                             ShumateVectorOp       op,
+                             guint                 arg)
+{
+  Instruction instruction = { op, arg };
+
+  g_array_append_val (self->instructions, instruction);
+
+  switch (op)
+    {
+    case SHUMATE_VECTOR_OP_GET_KEY:
+    case SHUMATE_VECTOR_OP_HAS_KEY:
+      if (g_strcmp0 (g_array_index (self->constants, Value, arg).string, "zoom") == 0)
+        self->dependency |= SHUMATE_VECTOR_DEPENDS_ZOOM;
+      else
+        self->dependency |= SHUMATE_VECTOR_DEPENDS_FEATURE;
+      break;
+    case SHUMATE_VECTOR_OP_GET:
+    case SHUMATE_VECTOR_OP_HAS:
+      /* The key isn't known, so it could be anything */
+      self->dependency |= SHUMATE_VECTOR_DEPENDS_ZOOM | SHUMATE_VECTOR_DEPENDS_FEATURE;
+      break;
+    case SHUMATE_VECTOR_OP_INTERPOLATE:
+      self->dependency |= SHUMATE_VECTOR_DEPENDS_ZOOM;
+      break;
+    default:
+      break;
+    }
+
+  self->depth += get_stack_effect (op);
+  g_assert (self->depth >= 0);
+  self->max_depth = MAX (self->max_depth, self->depth);
+
+  return self->instructions->len - 1;
+}
+
+
+/*
+ * shumate_vector_program_patch:
+ *
+ * Sets the target of a jump that was emitted before the target was known.
+ */
+void
+shumate_vector_program_patch (ShumateVectorProgram *self,
+                              guint                 instruction,
+                              guint                 target)
+{
+  g_assert (instruction < self->instructions->len);
+  g_array_index (self->instructions, Instruction, instruction).arg = target;
+}
+
+
+/* The index the next instruction will have, to use as a jump target */
+guint
+shumate_vector_program_get_position (ShumateVectorProgram *self)
+{
+  return self->instructions->len;
+}
+
+
+static void
+value_from_vector_value (ShumateVectorProgram *self,
+                         ShumateVectorValue   *vector_value,
+                         Value                *value)
+{
+  const char *string;
+
+  memset (value, 0, sizeof (Value));
+
+  if (shumate_vector_value_get_number (vector_value, &value->number))
+    value->type = TYPE_NUMBER;
+  else if (shumate_vector_value_get_boolean (vector_value, &value->boolean))
+    value->type = TYPE_BOOLEAN;
+  else if (shumate_vector_value_get_string (vector_value, &string))
+    {
+      char *copy = g_strdup (string);
+
+      g_ptr_array_add (self->strings, copy);
+      value->type = TYPE_STRING;
+      value->string = copy;
+      value->quark = g_quark_from_string (copy);
+
+      /* Parse colors now rather than every time they are used */
+      value->color_state = gdk_rgba_parse (&value->color, copy) ? COLOR_SET : COLOR_INVALID;
+    }
+  else if (shumate_vector_value_get_color (vector_value, &value->color))
+    value->type = TYPE_COLOR;
+  else
+    value->type = TYPE_NULL;
+}
+
+
+guint
+shumate_vector_program_add_constant (ShumateVectorProgram *self,
+                                     ShumateVectorValue   *value)
+{
+  Value constant;
+
+  value_from_vector_value (self, value, &constant);
+  g_array_append_val (self->constants, constant);
+
+  return self->constants->len - 1;
+}
+
+
+/*
+ * shumate_vector_program_add_interpolation:
+ *
+ * Adds an interpolation over the zoom level. Its stops must be added right
+ * after, in order.
+ *
+ * Returns: the index of the interpolation
+ */
+guint
+shumate_vector_program_add_interpolation (ShumateVectorProgram *self,
+                                          double                base)
+{
+  Interpolation interpolation = { base, self->stops->len, 0 };
+
+  g_array_append_val (self->interpolations, interpolation);
+
+  return self->interpolations->len - 1;
+}
+
+
+void
+shumate_vector_program_add_stop (ShumateVectorProgram *self,
+                                 guint                 interpolation,
+                                 double                point,
+                                 ShumateVectorValue   *value)
+{
+  Interpolation *interp = &g_array_index (self->interpolations, Interpolation, interpolation);
+  Stop stop;
+
+  g_assert (interp->first_stop + interp->n_stops == self->stops->len);
+
+  stop.point = point;
+  value_from_vector_value (self, value, &stop.value);
+  g_array_append_val (self->stops, stop);
+
+  interp->n_stops ++;
+}
+
+
+static gboolean run (ShumateVectorProgram     *self,
+                     ShumateVectorRenderScope *scope,
+                     Value                    *out);
+
+/*
+ * shumate_vector_program_optimize:
+ *
+ * Called once the whole expression has been compiled. A program that depends
+ * on nothing is run right away and replaced with its result.
+ */
+void
+shumate_vector_program_optimize (ShumateVectorProgram *self)
+{
+  Instruction instruction = { SHUMATE_VECTOR_OP_PUSH, 0 };
+  Value result;
+
+  if (self->dependency != SHUMATE_VECTOR_DEPENDS_NOTHING)
+    return;
+
+  /* Programs that fail are left alone, so they keep failing */
+  if (!run (self, NULL, &result))
+    return;
+
+  /* String results point into self->strings, which is kept */
+  g_array_append_val (self->constants, result);
+  instruction.arg = self->constants->len - 1;
+
+  g_array_set_size (self->instructions, 0);
+  g_array_append_val (self->instructions, instruction);
+  g_array_set_size (self->interpolations, 0);
+  g_array_set_size (self->stops, 0);
+  self->max_depth = 1;
+}
+
+
+ShumateVectorDependency
+shumate_vector_program_get_dependency (ShumateVectorProgram *self)
+{
+  return self->dependency;
+}
+
+
+static void
+set_boolean (Value *value, gboolean boolean)
+{
+  value->type = TYPE_BOOLEAN;
+  value->boolean = boolean;
+}
+
+
+static void
+set_number (Value *value, double number)
+{
+  value->type = TYPE_NUMBER;
+  value->number = number;
+}
+
+
+static void
+set_string (Value *value, const char *string)
+{
+  value->type = TYPE_STRING;
+  value->string = string;
+  value->color_state = COLOR_UNSET;
+  value->quark = 0;
+}
+
+
+static gboolean
+get_color (Value *value, GdkRGBA *color)
+{
+  if (value->type == TYPE_STRING)
+    {
+      if (value->color_state == COLOR_UNSET)
+        value->color_state = gdk_rgba_parse (&value->color, value->string) ? COLOR_SET : COLOR_INVALID;
+
+      if (value->color_state != COLOR_SET)
+        return FALSE;
+    }
+  else if (value->type != TYPE_COLOR)
+    return FALSE;
+
+  *color = value->color;
+  return TRUE;
+}
+
+
+static gboolean
+value_equal (Value *a, Value *b)
+{
+  if (a->type != b->type)
+    return FALSE;
+
+  switch (a->type)
+    {
+    case TYPE_NULL:
+      return TRUE;
+    case TYPE_NUMBER:
+      return a->number == b->number;
+    case TYPE_BOOLEAN:
+      return a->boolean == b->boolean;
+    case TYPE_STRING:
+      return g_strcmp0 (a->string, b->string) == 0;
+    case TYPE_COLOR:
+      return gdk_rgba_equal (&a->color, &b->color);
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+
+/* The quark of a value used as a variable name, or 0 if it isn't a string
+ * or no style uses it */
+static GQuark
+get_key (Value *value)
+{
+  if (value->type != TYPE_STRING)
+    return 0;
+
+  if (value->quark == 0)
+    return g_quark_try_string (value->string);
+
+  return value->quark;
+}
+
+
+/* Same as shumate_vector_render_scope_get_variable(), but strings point into
+ * the tile instead of being copied. The key is looked up by its quark, or by
+ * @name if it has none, which is the case for keys computed at runtime that
+ * no style uses. */
+static void
+get_variable (ShumateVectorRenderScope *scope, GQuark key, const char *name, Value *value)
+{
+  VectorTile__Tile__Value *feature_value;
+
+  value->type = TYPE_NULL;
+
+  if (key == zoom_quark)
+    {
+      set_number (value, scope->zoom_level);
+      return;
+    }
+
+  if (scope->feature == NULL)
+    return;
+
+  if (key == type_quark)
+    {
+      switch (scope->feature->type)
+        {
+        case VECTOR_TILE__TILE__GEOM_TYPE__POINT:
+          set_string (value, "Point");
+          return;
+        case VECTOR_TILE__TILE__GEOM_TYPE__LINESTRING:
+          set_string (value, "LineString");
+          return;
+        case VECTOR_TILE__TILE__GEOM_TYPE__POLYGON:
+          set_string (value, "Polygon");
+          return;
+        default:
+          return;
+        }
+    }
+
+  if (key != 0)
+    feature_value = shumate_vector_render_scope_find_tag_quark (scope, key);
+  else if (name != NULL)
+    feature_value = shumate_vector_render_scope_find_tag (scope, name);
+  else
+    return;
+
+  if (feature_value == NULL)
+    return;
+
+  if (feature_value->has_int_value)
+    set_number (value, feature_value->int_value);
+  else if (feature_value->has_uint_value)
+    set_number (value, feature_value->uint_value);
+  else if (feature_value->has_sint_value)
+    set_number (value, feature_value->sint_value);
+  else if (feature_value->has_float_value)
+    set_number (value, feature_value->float_value);
+  else if (feature_value->has_double_value)
+    set_number (value, feature_value->double_value);
+  else if (feature_value->has_bool_value)
+    set_boolean (value, feature_value->bool_value);
+  else if (feature_value->string_value != NULL)
+    set_string (value, feature_value->string_value);
+}
+
+
+static double
+lerp_double (double a, double b, double pos)
+{
+  return (b - a) * pos + a;
+}
+
+
+static void
+lerp (Value *last_value, Value *next_value, double pos, Value *out)
+{
+  GdkRGBA last_color, next_color;
+
+  if (last_value->type == TYPE_NUMBER && next_value->type == TYPE_NUMBER)
+    set_number (out, lerp_double (last_value->number, next_value->number, pos));
+  else if (get_color (last_value, &last_color) && get_color (next_value, &next_color))
+    {
+      out->type = TYPE_COLOR;
+      out->color.red = lerp_double (last_color.red, next_color.red, pos);
+      out->color.green = lerp_double (last_color.green, next_color.green, pos);
+      out->color.blue = lerp_double (last_color.blue, next_color.blue, pos);
+      out->color.alpha = lerp_double (last_color.alpha, next_color.alpha, pos);
+    }
+  else
+    out->type = TYPE_NULL;
+}
+
+
+static gboolean
+interpolate (ShumateVectorProgram *self,
+             Interpolation        *interpolation,
+             double                zoom,
+             Value                *out)
+{
+  Stop *stops = &g_array_index (self->stops, Stop, interpolation->first_stop);
+  guint n_stops = interpolation->n_stops;
+
+  if (n_stops == 0)
+    return FALSE;
+
+  if (zoom < stops[0].point)
+    {
+      *out = stops[0].value;
+      return TRUE;
+    }
+
+  for (guint i = 1; i < n_stops; i ++)
+    {
+      Stop *last = &stops[i - 1];
+      Stop *next = &stops[i];
+
+      if (last->point <= zoom && zoom < next->point)
+        {
+          /* Copies, since get_color() may cache a parsed color in them */
+          Value last_value = last->value;
+          Value next_value = next->value;
+          double pos;
+
+          if (interpolation->base == 1.0)
+            pos = (zoom - last->point) / (next->point - last->point);
+          else
+            pos = (pow (interpolation->base, zoom - last->point) - 1.0)
+                  / (pow (interpolation->base, next->point - last->point) - 1.0);
+
+          lerp (&last_value, &next_value, pos, out);
+          return TRUE;
+        }
+    }
+
+  *out = stops[n_stops - 1].value;
+  return TRUE;
+}
+
+
+static gboolean
+run (ShumateVectorProgram     *self,
+     ShumateVectorRenderScope *scope,
+     Value                    *out)
+{
+  Instruction *instructions = (Instruction *) self->instructions->data;
+  guint n_instructions = self->instructions->len;
+  Value *constants = (Value *) self->constants->data;
+  Value *stack = g_newa (Value, MAX (self->max_depth, 1));
+  int sp = 0;
+  guint pc = 0;
+
+  while (pc < n_instructions)
+    {
+      Instruction *instruction = &instructions[pc ++];
+      Value *top = &stack[sp - 1];
+
+      switch (instruction->op)
+        {
+        case SHUMATE_VECTOR_OP_PUSH:
+          stack[sp ++] = constants[instruction->arg];
+          break;
+
+        case SHUMATE_VECTOR_OP_POP:
+          sp --;
+          break;
+
+        case SHUMATE_VECTOR_OP_GET:
+          get_variable (scope, get_key (top), top->type == TYPE_STRING ? top->string : NULL, top);
+          break;
+
+        case SHUMATE_VECTOR_OP_GET_KEY:
+          get_variable (scope, constants[instruction->arg].quark, NULL, &stack[sp ++]);
+          break;
+
+        case SHUMATE_VECTOR_OP_HAS:
+          get_variable (scope, get_key (top), top->type == TYPE_STRING ? top->string : NULL, top);
+          set_boolean (top, top->type != TYPE_NULL);
+          break;
+
+        case SHUMATE_VECTOR_OP_HAS_KEY:
+          top = &stack[sp ++];
+          get_variable (scope, constants[instruction->arg].quark, NULL, top);
+          set_boolean (top, top->type != TYPE_NULL);
+          break;
+
+        case SHUMATE_VECTOR_OP_NOT:
+          if (top->type != TYPE_BOOLEAN)
+            return FALSE;
+          top->boolean = !top->boolean;
+          break;
+
+        case SHUMATE_VECTOR_OP_EQ:
+        case SHUMATE_VECTOR_OP_NE:
+          sp --;
+          set_boolean (&stack[sp - 1],
+                       value_equal (&stack[sp - 1], &stack[sp]) ^ (instruction->op == SHUMATE_VECTOR_OP_NE));
+          break;
+
+        case SHUMATE_VECTOR_OP_GT:
+        case SHUMATE_VECTOR_OP_LT:
+        case SHUMATE_VECTOR_OP_GE:
+        case SHUMATE_VECTOR_OP_LE:
+          {
+            double a, b;
+            gboolean result;
+
+            sp --;
+            if (stack[sp - 1].type != TYPE_NUMBER || stack[sp].type != TYPE_NUMBER)
+              return FALSE;
+
+            a = stack[sp - 1].number;
+            b = stack[sp].number;
+
+            /* >= and <= are the negations of < and >, as they were before
+             * expressions were compiled, which matters for NaN */
+            if (instruction->op == SHUMATE_VECTOR_OP_GT)
+              result = a > b;
+            else if (instruction->op == SHUMATE_VECTOR_OP_LT)
+              result = a < b;
+            else if (instruction->op == SHUMATE_VECTOR_OP_GE)
+              result = !(a < b);
+            else
+              result = !(a > b);
+
+            set_boolean (&stack[sp - 1], result);
+          }
+          break;
+
+        case SHUMATE_VECTOR_OP_JUMP:
+          pc = instruction->arg;
+          break;
+
+        case SHUMATE_VECTOR_OP_JUMP_IF_TRUE:
+        case SHUMATE_VECTOR_OP_JUMP_IF_FALSE:
+          sp --;
+          if (top->type != TYPE_BOOLEAN)
+            return FALSE;
+          if (top->boolean == (instruction->op == SHUMATE_VECTOR_OP_JUMP_IF_TRUE))
+            pc = instruction->arg;
+          break;
+
+        case SHUMATE_VECTOR_OP_JUMP_IF_EQUAL:
+          sp --;
+          if (value_equal (&stack[sp - 1], &stack[sp]))
+            pc = instruction->arg;
+          break;
+
+        case SHUMATE_VECTOR_OP_INTERPOLATE:
+          if (!interpolate (self,
+                            &g_array_index (self->interpolations, Interpolation, instruction->arg),
+                            scope->zoom_level,
+                            &stack[sp]))
+            return FALSE;
+          sp ++;
+          break;
+
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  g_assert (sp == 1);
+  *out = stack[0];
+  return TRUE;
+}
+
+
+gboolean
+shumate_vector_program_eval (ShumateVectorProgram     *self,
+                             ShumateVectorRenderScope *scope,
+                             ShumateVectorValue       *out)
+{
+  Value value;
+
+  if (!run (self, scope, &value))
+    return FALSE;
+
+  switch (value.type)
+    {
+    case TYPE_NULL:
+      shumate_vector_value_unset (out);
+      break;
+    case TYPE_NUMBER:
+      shumate_vector_value_set_number (out, value.number);
+      break;
+    case TYPE_BOOLEAN:
+      shumate_vector_value_set_boolean (out, value.boolean);
+      break;
+    case TYPE_STRING:
+      shumate_vector_value_set_string (out, value.string);
+      break;
+    case TYPE_COLOR:
+      shumate_vector_value_set_color (out, &value.color);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+
+  return TRUE;
+}
+
+
+gboolean
+shumate_vector_program_eval_number (ShumateVectorProgram     *self,
+                                    ShumateVectorRenderScope *scope,
+                                    double                   *number)
+{
+  Value value;
+
+  if (!run (self, scope, &value) || value.type != TYPE_NUMBER)
+    return FALSE;
+
+  *number = value.number;
+  return TRUE;
+}
+
+
+gboolean
+shumate_vector_program_eval_boolean (ShumateVectorProgram     *self,
+                                     ShumateVectorRenderScope *scope,
+                                     gboolean                 *boolean)
+{
+  Value value;
+
+  if (!run (self, scope, &value) || value.type != TYPE_BOOLEAN)
+    return FALSE;
+
+  *boolean = value.boolean;
+  return TRUE;
+}
+
+
+/*
+ * shumate_vector_program_eval_string:
+ *
+ * Returns: (transfer none) (nullable): the resulting string, which is valid
+ *   as long as the program and the scope's tile are, or %NULL if the result
+ *   isn't a string
+ */
+const char *
+shumate_vector_program_eval_string (ShumateVectorProgram     *self,
+                                    ShumateVectorRenderScope *scope)
+{
+  Value value;
+
+  if (!run (self, scope, &value) || value.type != TYPE_STRING)
+    return NULL;
+
+  return value.string;
+}
+
+
+gboolean
+shumate_vector_program_eval_color (ShumateVectorProgram     *self,
+                                   ShumateVectorRenderScope *scope,
+                                   GdkRGBA                  *color)
+{
+  Value value;
+
+  if (!run (self, scope, &value))
+    return FALSE;
+
+  return get_color (&value, color);
+}
@@ -22,6 +22,38 @@
 #include "vector_tile.pb-c.h"
 #include "shumate-vector-value-private.h"
 
+/* The number of paint properties a style layer can cache in the scope */
+#define SHUMATE_VECTOR_RENDER_SCOPE_N_PROPERTIES 4
+
+typedef struct {
+  gboolean cached;
+  union {
+    double number;
+    GdkRGBA color;
+  };
+} ShumateVectorPropertyCache;
+
+/* The extent of a feature's geometry, in tile units */
+typedef struct {
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+} ShumateVectorBounds;
+
+typedef enum {
+  SHUMATE_VECTOR_PAINT_NONE,
+  SHUMATE_VECTOR_PAINT_FILL,
+  SHUMATE_VECTOR_PAINT_STROKE,
+} ShumateVectorPaintOp;
+
+typedef struct {
+  ShumateVectorPaintOp op;
+  GdkRGBA color;
+  /* In tile units, for strokes */
+  double line_width;
+} ShumateVectorPaint;
+
 typedef struct {
   cairo_t *cr;
   int target_size;
@@ -31,9 +63,44 @@ typedef struct {
   VectorTile__Tile *tile;
   VectorTile__Tile__Layer *layer;
   VectorTile__Tile__Feature *feature;
+
+  /* The keys of each of the tile's layers as quarks, so that looking up a
+   * feature's tags compares integers rather than strings. Keys that no style
+   * uses are 0. Each layer's keys are resolved when its tags are first
+   * looked up, and freed by shumate_vector_render_scope_clear(). */
+  GQuark **layer_keys;
+  int layer_index;
+  int feature_index;
+
+  /* The bounds of each feature in each of the tile's layers, if they are
+   * known. If cull is set, features that lie entirely outside of the visible
+   * area, given in pixels, are skipped. */
+  ShumateVectorBounds **feature_bounds;
+  cairo_rectangle_t visible_area;
+  gboolean cull;
+
+  /* Paint properties of the current style layer that don't depend on the
+   * feature, so they are evaluated once per layer rather than per feature.
+   * Cleared before each style layer is rendered. */
+  ShumateVectorPropertyCache properties[SHUMATE_VECTOR_RENDER_SCOPE_N_PROPERTIES];
+
+  /* How to paint the features in the cairo context's current path, which
+   * are drawn together when a feature with different paint comes along or
+   * the style layer ends, and the area each of those features can touch.
+   * See shumate_vector_render_scope_paint(). */
+  ShumateVectorPaint pending_paint;
+  GArray *pending_bounds;
+  /* The number of fills and strokes so far, for benchmarks */
+  guint n_draw_calls;
 } ShumateVectorRenderScope;
 
 
+void shumate_vector_render_scope_clear (ShumateVectorRenderScope *self);
 gboolean shumate_vector_render_scope_find_layer (ShumateVectorRenderScope *self, const char *layer_name);
 void shumate_vector_render_scope_exec_geometry (ShumateVectorRenderScope *self);
+void shumate_vector_feature_get_bounds (VectorTile__Tile__Feature *feature, ShumateVectorBounds *bounds);
+void shumate_vector_render_scope_paint (ShumateVectorRenderScope *self, const ShumateVectorPaint *paint);
+void shumate_vector_render_scope_flush (ShumateVectorRenderScope *self);
 void shumate_vector_render_scope_get_variable (ShumateVectorRenderScope *self, const char *variable, ShumateVectorValue *value);
+VectorTile__Tile__Value *shumate_vector_render_scope_find_tag (ShumateVectorRenderScope *self, const char *key);
+VectorTile__Tile__Value *shumate_vector_render_scope_find_tag_quark (ShumateVectorRenderScope *self, GQuark key);
@@ -15,8 +15,28 @@
  * License along with this library; if not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
 #include "shumate-vector-render-scope-private.h"
 
+/* Every feature is checked against all of the ones waiting to be drawn, so
+ * keep that list short */
+#define MAX_PENDING_FEATURES 256
+
+/* Frees the data the scope has built up about its tile. */
+void
+shumate_vector_render_scope_clear (ShumateVectorRenderScope *self)
+{
+  if (self->layer_keys != NULL)
+    {
+      for (int i = 0; i < self->tile->n_layers; i ++)
+        g_free (self->layer_keys[i]);
+
+      g_clear_pointer (&self->layer_keys, g_free);
+    }
+
+  g_clear_pointer (&self->pending_bounds, g_array_unref);
+}
+
 /* Sets the current layer by name. */
 gboolean
 shumate_vector_render_scope_find_layer (ShumateVectorRenderScope *self, const char *layer_name)
@@ -27,6 +47,7 @@ shumate_vector_render_scope_find_layer (ShumateVectorRenderScope *self, const ch
       if (g_strcmp0 (layer->name, layer_name) == 0)
         {
           self->layer = layer;
+          self->layer_index = i;
           return TRUE;
         }
     }
@@ -41,13 +62,14 @@ zigzag (guint value)
   return (value >> 1) ^ (-(value & 1));
 }
 
-/* Draws the current feature as a path onto the scope's cairo context. */
+/* Adds the current feature to the current path of the scope's cairo
+ * context. */
 void
 shumate_vector_render_scope_exec_geometry (ShumateVectorRenderScope *self)
 {
   g_return_if_fail (self->feature != NULL);
 
-  cairo_new_path (self->cr);
+  /* Feature geometry starts at the origin, not where the last one ended */
   cairo_move_to (self->cr, 0, 0);
 
   for (int i = 0; i < self->feature->n_geometry; i ++)
@@ -87,9 +109,188 @@ shumate_vector_render_scope_exec_geometry (ShumateVectorRenderScope *self)
 }
 
 
+/* Computes the bounds of a feature's geometry. A feature without any points
+ * gets bounds that contain nothing. */
+void
+shumate_vector_feature_get_bounds (VectorTile__Tile__Feature *feature, ShumateVectorBounds *bounds)
+{
+  int x = 0, y = 0;
+
+  bounds->x1 = bounds->y1 = G_MAXINT;
+  bounds->x2 = bounds->y2 = G_MININT;
+
+  for (int i = 0; i < feature->n_geometry; i ++)
+    {
+      int cmd = feature->geometry[i];
+      int op = cmd & 0x7;
+      int repeat = cmd >> 3;
+
+      /* ClosePath has no parameters and doesn't move the cursor */
+      if (op != 1 && op != 2)
+        continue;
+
+      for (int j = 0; j < repeat && i + 2 < feature->n_geometry; j ++)
+        {
+          x += zigzag (feature->geometry[++i]);
+          y += zigzag (feature->geometry[++i]);
+
+          bounds->x1 = MIN (bounds->x1, x);
+          bounds->y1 = MIN (bounds->y1, y);
+          bounds->x2 = MAX (bounds->x2, x);
+          bounds->y2 = MAX (bounds->y2, y);
+        }
+    }
+}
+
+/* Gets the area, in tile units, that painting the current feature may
+ * change any pixel in. Returns FALSE if the feature has no geometry. */
+static gboolean
+get_paint_bounds (ShumateVectorRenderScope *self, const ShumateVectorPaint *paint, ShumateVectorBounds *bounds)
+{
+  double margin;
+
+  if (self->feature_bounds != NULL)
+    *bounds = self->feature_bounds[self->layer_index][self->feature_index];
+  else
+    shumate_vector_feature_get_bounds (self->feature, bounds);
+
+  if (bounds->x1 > bounds->x2)
+    return FALSE;
+
+  /* Antialiasing reaches into pixels up to a pixel away from the shape */
+  margin = self->scale;
+
+  /* Strokes reach past the geometry by half their width, or further at
+   * mitered corners and square caps */
+  if (paint->op == SHUMATE_VECTOR_PAINT_STROKE)
+    margin += paint->line_width / 2 * MAX (cairo_get_miter_limit (self->cr), G_SQRT2);
+
+  bounds->x1 -= ceil (margin);
+  bounds->y1 -= ceil (margin);
+  bounds->x2 += ceil (margin);
+  bounds->y2 += ceil (margin);
+  return TRUE;
+}
+
+static gboolean
+bounds_intersect (const ShumateVectorBounds *a, const ShumateVectorBounds *b)
+{
+  return a->x1 <= b->x2 && b->x1 <= a->x2 && a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+static gboolean
+is_feature_visible (ShumateVectorRenderScope *self, const ShumateVectorBounds *bounds)
+{
+  ShumateVectorBounds visible;
+
+  if (!self->cull)
+    return TRUE;
+
+  visible.x1 = floor (self->visible_area.x * self->scale);
+  visible.y1 = floor (self->visible_area.y * self->scale);
+  visible.x2 = ceil ((self->visible_area.x + self->visible_area.width) * self->scale);
+  visible.y2 = ceil ((self->visible_area.y + self->visible_area.height) * self->scale);
+
+  return bounds_intersect (bounds, &visible);
+}
+
+/* Whether the feature might share a pixel with one that is waiting to be
+ * drawn. Where features overlap, drawing them separately and drawing them
+ * as one path give different results: antialiased edges are blended twice
+ * rather than once, and with the nonzero fill rule, a polygon wound the
+ * other way cuts a hole into the one beneath it. */
+static gboolean
+overlaps_pending (ShumateVectorRenderScope *self, const ShumateVectorBounds *bounds)
+{
+  for (guint i = 0; i < self->pending_bounds->len; i ++)
+    if (bounds_intersect (bounds, &g_array_index (self->pending_bounds, ShumateVectorBounds, i)))
+      return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+paint_equal (const ShumateVectorPaint *a, const ShumateVectorPaint *b)
+{
+  return a->op == b->op
+      && gdk_rgba_equal (&a->color, &b->color)
+      && (a->op != SHUMATE_VECTOR_PAINT_STROKE || a->line_width == b->line_width);
+}
+
+/* Paints the current feature. Consecutive features with the same paint are
+ * collected into one path and drawn at once, which is much faster than
+ * drawing thousands of small paths. Features are only collected as long as
+ * none of them share a pixel, so the result is exactly the same as drawing
+ * them one by one. Call shumate_vector_render_scope_flush() to draw what has
+ * been collected. */
+void
+shumate_vector_render_scope_paint (ShumateVectorRenderScope *self, const ShumateVectorPaint *paint)
+{
+  ShumateVectorBounds bounds;
+
+  g_return_if_fail (paint->op != SHUMATE_VECTOR_PAINT_NONE);
+
+  /* Style layers without a source layer have no geometry to paint */
+  if (self->feature == NULL)
+    return;
+
+  if (!get_paint_bounds (self, paint, &bounds) || !is_feature_visible (self, &bounds))
+    return;
+
+  if (self->pending_bounds == NULL)
+    self->pending_bounds = g_array_new (FALSE, FALSE, sizeof (ShumateVectorBounds));
+
+  if (self->pending_paint.op != SHUMATE_VECTOR_PAINT_NONE
+      && (!paint_equal (&self->pending_paint, paint)
+          || self->pending_bounds->len >= MAX_PENDING_FEATURES
+          || overlaps_pending (self, &bounds)))
+    shumate_vector_render_scope_flush (self);
+
+  if (self->pending_paint.op == SHUMATE_VECTOR_PAINT_NONE)
+    {
+      cairo_new_path (self->cr);
+      self->pending_paint = *paint;
+    }
+
+  shumate_vector_render_scope_exec_geometry (self);
+  g_array_append_val (self->pending_bounds, bounds);
+
+  /* Where translucent features overlap, each one shows through the other,
+   * so they can't be drawn as one shape */
+  if (paint->color.alpha < 1.0)
+    shumate_vector_render_scope_flush (self);
+}
+
+/* Draws the features collected by shumate_vector_render_scope_paint(). */
+void
+shumate_vector_render_scope_flush (ShumateVectorRenderScope *self)
+{
+  ShumateVectorPaint *paint = &self->pending_paint;
+
+  if (paint->op == SHUMATE_VECTOR_PAINT_NONE)
+    return;
+
+  cairo_set_source_rgba (self->cr, paint->color.red, paint->color.green, paint->color.blue, paint->color.alpha);
+
+  if (paint->op == SHUMATE_VECTOR_PAINT_FILL)
+    cairo_fill (self->cr);
+  else
+    {
+      cairo_set_line_width (self->cr, paint->line_width);
+      cairo_stroke (self->cr);
+    }
+
+  paint->op = SHUMATE_VECTOR_PAINT_NONE;
+  g_array_set_size (self->pending_bounds, 0);
+  self->n_draw_calls ++;
+}
+
+
 void
 shumate_vector_render_scope_get_variable (ShumateVectorRenderScope *self, const char *variable, ShumateVectorValue *value)
 {
+  VectorTile__Tile__Value *feature_value;
+
   shumate_vector_value_unset (value);
 
   if (g_strcmp0 (variable, "zoom") == 0)
@@ -120,18 +321,81 @@ shumate_vector_render_scope_get_variable (ShumateVectorRenderScope *self, const
         }
     }
 
+  feature_value = shumate_vector_render_scope_find_tag (self, variable);
+  if (feature_value != NULL)
+    shumate_vector_value_set_from_feature_value (value, feature_value);
+}
+
+
+/* Looks up a tag of the current feature. Returns %NULL if the feature doesn't
+ * have the tag. */
+VectorTile__Tile__Value *
+shumate_vector_render_scope_find_tag (ShumateVectorRenderScope *self, const char *key)
+{
+  GQuark quark = g_quark_try_string (key);
+
+  if (quark != 0)
+    return shumate_vector_render_scope_find_tag_quark (self, quark);
+
+  if (self->feature == NULL || key == NULL)
+    return NULL;
+
+  /* No style uses the key, but it may be computed at runtime, so compare
+   * it to the tile's keys as a string. The tile's keys are not interned,
+   * since there is no limit to how many different ones tiles can have. */
   for (int i = 1; i < self->feature->n_tags; i += 2)
     {
-      int key = self->feature->tags[i - 1];
-      int val = self->feature->tags[i];
+      int key_index = self->feature->tags[i - 1];
+      int value_index = self->feature->tags[i];
 
-      if (key >= self->layer->n_keys || val >= self->layer->n_values)
-        return;
+      if (key_index >= self->layer->n_keys || value_index >= self->layer->n_values)
+        return NULL;
 
-      if (g_strcmp0 (self->layer->keys[key], variable) == 0)
-        {
-          shumate_vector_value_set_from_feature_value (value, self->layer->values[val]);
-          return;
-        }
+      if (g_strcmp0 (self->layer->keys[key_index], key) == 0)
+        return self->layer->values[value_index];
+    }
+
+  return NULL;
+}
+
+/* Like shumate_vector_render_scope_find_tag(), for a key that has been
+ * interned already. The value is the tile's own; it isn't copied. */
+VectorTile__Tile__Value *
+shumate_vector_render_scope_find_tag_quark (ShumateVectorRenderScope *self, GQuark key)
+{
+  GQuark *keys;
+
+  if (self->feature == NULL || key == 0)
+    return NULL;
+
+  if (self->layer_keys == NULL)
+    self->layer_keys = g_new0 (GQuark *, self->tile->n_layers);
+
+  if (self->layer_keys[self->layer_index] == NULL)
+    {
+      /* Only look up keys that are already quarks. Styles intern their
+       * strings when they are parsed; other keys are only looked up by
+       * shumate_vector_render_scope_find_tag(), as strings. */
+      keys = g_new (GQuark, MAX (self->layer->n_keys, 1));
+      for (int i = 0; i < self->layer->n_keys; i ++)
+        keys[i] = g_quark_try_string (self->layer->keys[i]);
+
+      self->layer_keys[self->layer_index] = keys;
     }
+
+  keys = self->layer_keys[self->layer_index];
+
+  for (int i = 1; i < self->feature->n_tags; i += 2)
+    {
+      int key_index = self->feature->tags[i - 1];
+      int value_index = self->feature->tags[i];
+
+      if (key_index >= self->layer->n_keys || value_index >= self->layer->n_values)
+        return NULL;
+
+      if (keys[key_index] == key)
+        return self->layer->values[value_index];
+    }
+
+  return NULL;
 }
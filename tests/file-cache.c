@@ -98,6 +98,283 @@ test_file_cache_miss ()
 }
 
 
+typedef struct {
+  GMainLoop *loop;
+  int pending;
+} BatchData;
+
+static void
+on_batch_tile_stored (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  BatchData *data = user_data;
+
+  shumate_file_cache_store_tile_finish ((ShumateFileCache *) object, res, &error);
+  g_assert_no_error (error);
+
+  if (--data->pending == 0)
+    g_main_loop_quit (data->loop);
+}
+
+/* Stores the n×n tiles of a zoom level at once and adds them to @tiles, in
+ * column order. Each tile's data is its index as a guint, or @bytes with
+ * TEST_ETAG if that is given. */
+static void
+store_grid (ShumateFileCache *cache, guint n, guint zoom, GBytes *bytes, GPtrArray *tiles)
+{
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  BatchData data = { loop, 0 };
+
+  for (guint x = 0; x < n; x ++)
+    {
+      for (guint y = 0; y < n; y ++)
+        {
+          ShumateTile *tile = g_object_ref_sink (shumate_tile_new_full (x, y, 256, zoom));
+          guint value = x * n + y;
+
+          g_ptr_array_add (tiles, tile);
+
+          data.pending ++;
+          if (bytes != NULL)
+            {
+              shumate_file_cache_store_tile_async (cache, tile, bytes, TEST_ETAG, NULL, on_batch_tile_stored, &data);
+            }
+          else
+            {
+              g_autoptr(GBytes) value_bytes = g_bytes_new (&value, sizeof value);
+              shumate_file_cache_store_tile_async (cache, tile, value_bytes, NULL, NULL, on_batch_tile_stored, &data);
+            }
+        }
+    }
+
+  g_main_loop_run (loop);
+}
+
+static void
+on_batch_tile_retrieved (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  BatchData *data = user_data;
+
+  bytes = shumate_file_cache_get_tile_finish ((ShumateFileCache *) object, NULL, NULL, res, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (bytes);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, sizeof (guint));
+
+  if (--data->pending == 0)
+    g_main_loop_quit (data->loop);
+}
+
+/* Test that many tiles stored at once, which are written in shared
+ * transactions, can all be retrieved */
+static void
+test_file_cache_store_many ()
+{
+  g_autoptr(ShumateFileCache) cache = shumate_file_cache_new_full (100000000, "test", NULL);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+  BatchData data = { loop, 0 };
+
+  store_grid (cache, 16, 4, NULL, tiles);
+
+  for (guint i = 0; i < tiles->len; i ++)
+    {
+      data.pending ++;
+      shumate_file_cache_get_tile_async (cache, tiles->pdata[i], NULL, on_batch_tile_retrieved, &data);
+    }
+
+  g_main_loop_run (loop);
+}
+
+
+static void
+on_purged (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GMainLoop *loop = user_data;
+
+  shumate_file_cache_purge_cache_finish ((ShumateFileCache *) object, res, &error);
+  g_assert_no_error (error);
+
+  g_main_loop_quit (loop);
+}
+
+/* Test that cache hits, which are written to the database lazily, are taken
+ * into account when the cache is purged */
+static void
+test_file_cache_popularity ()
+{
+  g_autoptr(ShumateFileCache) cache = shumate_file_cache_new_full (100000000, "test", NULL);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+  BatchData data = { loop, 0 };
+  ShumateTile *popular_tile;
+
+  store_grid (cache, 2, 1, NULL, tiles);
+
+  popular_tile = tiles->pdata[2];
+  for (guint i = 0; i < 3; i ++)
+    {
+      data.pending ++;
+      shumate_file_cache_get_tile_async (cache, popular_tile, NULL, on_batch_tile_retrieved, &data);
+    }
+
+  g_main_loop_run (loop);
+
+  /* Only room for two of the four tiles */
+  shumate_file_cache_set_size_limit (cache, 2 * sizeof (guint));
+  shumate_file_cache_purge_cache_async (cache, NULL, on_purged, loop);
+  g_main_loop_run (loop);
+
+  data.pending ++;
+  shumate_file_cache_get_tile_async (cache, popular_tile, NULL, on_batch_tile_retrieved, &data);
+  g_main_loop_run (loop);
+}
+
+
+typedef struct {
+  GMainLoop *loop;
+  int pending;
+  int found;
+} CountData;
+
+static void
+on_tile_counted (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  CountData *data = user_data;
+
+  bytes = shumate_file_cache_get_tile_finish ((ShumateFileCache *) object, NULL, NULL, res, &error);
+  g_assert_no_error (error);
+
+  if (bytes != NULL)
+    data->found ++;
+
+  if (--data->pending == 0)
+    g_main_loop_quit (data->loop);
+}
+
+/* Test that tiles are evicted automatically once the cache grows past its
+ * size limit */
+static void
+test_file_cache_auto_evict ()
+{
+  g_autoptr(ShumateFileCache) cache = shumate_file_cache_new_full (10 * sizeof (guint), "test", NULL);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+  CountData count = { loop, 0, 0 };
+
+  store_grid (cache, 4, 2, NULL, tiles);
+
+  for (guint i = 0; i < tiles->len; i ++)
+    {
+      count.pending ++;
+      shumate_file_cache_get_tile_async (cache, tiles->pdata[i], NULL, on_tile_counted, &count);
+    }
+
+  g_main_loop_run (loop);
+
+  g_assert_cmpint (count.found, >, 0);
+  g_assert_cmpint (count.found, <=, 10);
+}
+
+
+/* Test that tiles with the same contents, which share their data in the
+ * database, can be stored and replaced independently */
+static void
+test_file_cache_shared_contents ()
+{
+  g_autoptr(ShumateFileCache) cache = shumate_file_cache_new_full (100000000, "test", NULL);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GBytes) bytes = g_bytes_new_static (TEST_DATA, sizeof TEST_DATA);
+  g_autoptr(GBytes) other_bytes = g_bytes_new_static ("land", 4);
+
+  store_grid (cache, 2, 1, bytes, tiles);
+
+  /* Replace one of them, which must not affect the others */
+  shumate_file_cache_store_tile_async (cache, tiles->pdata[0], other_bytes, NULL, NULL, on_tile_stored, loop);
+  g_main_loop_run (loop);
+
+  for (guint i = 1; i < tiles->len; i ++)
+    {
+      shumate_file_cache_get_tile_async (cache, tiles->pdata[i], NULL, on_tile_retrieved, loop);
+      g_main_loop_run (loop);
+    }
+}
+
+
+/* Test that the files of the cache's old layout are removed */
+static void
+test_file_cache_remove_legacy ()
+{
+  g_autofree char *cache_dir = g_build_filename (g_get_user_cache_dir (), "shumate", NULL);
+  g_autofree char *column_dir = g_build_filename (cache_dir, "legacy", "3", "1", NULL);
+  g_autofree char *tile_file = g_build_filename (column_dir, "2.png", NULL);
+  g_autofree char *legacy_db = g_build_filename (cache_dir, "cache.db", NULL);
+  g_autofree char *tiles_dir = g_build_filename (cache_dir, "legacy", NULL);
+  g_autofree char *database = g_build_filename (cache_dir, "legacy.mbtiles", NULL);
+  g_autoptr(ShumateFileCache) cache = NULL;
+  g_autoptr(ShumateTile) tile = shumate_tile_new_full (0, 0, 256, 0);
+  g_autoptr(GBytes) bytes = g_bytes_new_static (TEST_DATA, sizeof TEST_DATA);
+  g_autoptr(GMainLoop) loop = NULL;
+
+  g_object_ref_sink (tile);
+
+  g_assert_cmpint (g_mkdir_with_parents (column_dir, 0700), ==, 0);
+  g_assert_true (g_file_set_contents (tile_file, TEST_DATA, -1, NULL));
+  g_assert_true (g_file_set_contents (legacy_db, TEST_DATA, -1, NULL));
+
+  cache = shumate_file_cache_new_full (100000000, "legacy", NULL);
+
+  /* Wait until the database is open */
+  loop = g_main_loop_new (NULL, TRUE);
+  shumate_file_cache_store_tile_async (cache, tile, bytes, TEST_ETAG, NULL, on_tile_stored, loop);
+  g_main_loop_run (loop);
+
+  g_assert_false (g_file_test (tile_file, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (tiles_dir, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (legacy_db, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (database, G_FILE_TEST_IS_REGULAR));
+}
+
+
+static void
+on_tile_failed (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  GMainLoop *loop = user_data;
+
+  bytes = shumate_file_cache_get_tile_finish ((ShumateFileCache *) object, NULL, NULL, res, &error);
+  g_assert_error (error, SHUMATE_FILE_CACHE_ERROR, SHUMATE_FILE_CACHE_ERROR_FAILED);
+  g_assert_null (bytes);
+
+  g_main_loop_quit (loop);
+}
+
+/* Test that a cache without a cache key fails its operations rather than
+ * crashing */
+static void
+test_file_cache_no_cache_key ()
+{
+  g_autoptr(ShumateFileCache) cache = NULL;
+  g_autoptr(ShumateTile) tile = shumate_tile_new_full (0, 0, 256, 0);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+
+  g_object_ref_sink (tile);
+
+  g_test_expect_message ("shumate", G_LOG_LEVEL_CRITICAL, "A cache key is required.");
+  cache = g_object_new (SHUMATE_TYPE_FILE_CACHE, NULL);
+  g_test_assert_expected_messages ();
+
+  shumate_file_cache_get_tile_async (cache, tile, NULL, on_tile_failed, loop);
+  g_main_loop_run (loop);
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -106,6 +383,12 @@ main (int argc, char *argv[])
 
   g_test_add_func ("/file-cache/store-retrieve", test_file_cache_store_retrieve);
   g_test_add_func ("/file-cache/miss", test_file_cache_miss);
+  g_test_add_func ("/file-cache/store-many", test_file_cache_store_many);
+  g_test_add_func ("/file-cache/popularity", test_file_cache_popularity);
+  g_test_add_func ("/file-cache/auto-evict", test_file_cache_auto_evict);
+  g_test_add_func ("/file-cache/shared-contents", test_file_cache_shared_contents);
+  g_test_add_func ("/file-cache/remove-legacy", test_file_cache_remove_legacy);
+  g_test_add_func ("/file-cache/no-cache-key", test_file_cache_no_cache_key);
 
   return g_test_run ();
 }
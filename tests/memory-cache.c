@@ -105,6 +105,82 @@ test_memory_cache_purge ()
 }
 
 
+/* Test that the cache is purged when it exceeds its byte budget */
+static void
+test_memory_cache_purge_bytes ()
+{
+  g_autoptr(ShumateMemoryCache) cache = shumate_memory_cache_new_full (100);
+  g_autoptr(ShumateTile) tile = shumate_tile_new_full (0, 0, 256, 0);
+  g_autoptr(GdkTexture) texture = create_texture ();
+  guint64 texture_size = 256 * 256 * 4;
+
+  g_object_ref_sink (tile);
+
+  /* Leave room for two textures */
+  shumate_memory_cache_set_size_limit_bytes (cache, texture_size * 2);
+
+  shumate_memory_cache_store_texture (cache, tile, texture, "A");
+  shumate_memory_cache_store_texture (cache, tile, texture, "B");
+  g_assert_cmpuint (shumate_memory_cache_get_size_bytes (cache), ==, texture_size * 2);
+
+  shumate_memory_cache_store_texture (cache, tile, texture, "C");
+  g_assert_cmpuint (shumate_memory_cache_get_size_bytes (cache), ==, texture_size * 2);
+
+  /* A was the least recently used, so it should have been dropped */
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, tile, "A"));
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, tile, "B"));
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, tile, "C"));
+
+  /* Shrinking the budget evicts immediately */
+  shumate_memory_cache_set_size_limit_bytes (cache, texture_size);
+  g_assert_cmpuint (shumate_memory_cache_get_size_bytes (cache), ==, texture_size);
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, tile, "B"));
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, tile, "C"));
+}
+
+
+/* Test that the hit, miss and eviction counters are kept */
+static void
+test_memory_cache_statistics ()
+{
+  g_autoptr(ShumateMemoryCache) cache = shumate_memory_cache_new_full (1);
+  g_autoptr(ShumateTile) tile = shumate_tile_new_full (0, 0, 256, 0);
+  g_autoptr(GdkTexture) texture = create_texture ();
+  guint64 hits, misses, evictions;
+
+  g_object_ref_sink (tile);
+
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, tile, "A"));
+  shumate_memory_cache_store_texture (cache, tile, texture, "A");
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, tile, "A"));
+  shumate_memory_cache_store_texture (cache, tile, texture, "B");
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, tile, "A"));
+
+  shumate_memory_cache_get_statistics (cache, &hits, &misses, &evictions);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (misses, ==, 2);
+  g_assert_cmpuint (evictions, ==, 1);
+}
+
+
+/* Test that the shared cache is reused while it is referenced, and freed
+ * once it isn't */
+static void
+test_memory_cache_shared ()
+{
+  ShumateMemoryCache *cache1 = shumate_memory_cache_dup_shared ();
+  ShumateMemoryCache *cache2 = shumate_memory_cache_dup_shared ();
+
+  g_assert_true (cache1 == cache2);
+
+  g_object_add_weak_pointer (G_OBJECT (cache1), (gpointer *) &cache1);
+  g_object_unref (cache2);
+  g_assert_nonnull (cache1);
+  g_object_unref (cache1);
+  g_assert_null (cache1);
+}
+
+
 /* Test that cleaning the cache works */
 static void
 test_memory_cache_clean ()
@@ -126,6 +202,41 @@ test_memory_cache_clean ()
 }
 
 
+/* Test that tiles deeper than zoom level 21, which don't fit in an integer
+ * key, are still cached and evicted */
+static void
+test_memory_cache_deep_zoom ()
+{
+  g_autoptr(ShumateMemoryCache) cache = shumate_memory_cache_new_full (2);
+  g_autoptr(ShumateTile) tile = shumate_tile_new_full (4194303, 4194303, 256, 22);
+  g_autoptr(ShumateTile) sibling = shumate_tile_new_full (4194302, 4194303, 256, 22);
+  g_autoptr(ShumateTile) shallow = shumate_tile_new_full (0, 0, 256, 0);
+  g_autoptr(GdkTexture) texture = create_texture ();
+
+  g_object_ref_sink (tile);
+  g_object_ref_sink (sibling);
+  g_object_ref_sink (shallow);
+
+  shumate_memory_cache_store_texture (cache, tile, texture, "A");
+
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, tile, "A"));
+  g_assert_true (texture == shumate_tile_get_texture (tile));
+  g_assert_true (texture == shumate_memory_cache_lookup_texture (cache, 4194303, 4194303, 22, "A"));
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, tile, "B"));
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, sibling, "A"));
+
+  /* Deep tiles take part in the same LRU queue as the others */
+  shumate_memory_cache_store_texture (cache, shallow, texture, "A");
+  shumate_memory_cache_store_texture (cache, sibling, texture, "A");
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, tile, "A"));
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, sibling, "A"));
+  g_assert_true (shumate_memory_cache_try_fill_tile (cache, shallow, "A"));
+
+  shumate_memory_cache_clean (cache);
+  g_assert_false (shumate_memory_cache_try_fill_tile (cache, sibling, "A"));
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -136,7 +247,11 @@ main (int argc, char *argv[])
   g_test_add_func ("/file-cache/miss", test_memory_cache_miss);
   g_test_add_func ("/file-cache/source-id", test_memory_cache_source_id);
   g_test_add_func ("/file-cache/purge", test_memory_cache_purge);
+  g_test_add_func ("/file-cache/purge-bytes", test_memory_cache_purge_bytes);
+  g_test_add_func ("/file-cache/statistics", test_memory_cache_statistics);
+  g_test_add_func ("/file-cache/shared", test_memory_cache_shared);
   g_test_add_func ("/file-cache/clean", test_memory_cache_clean);
+  g_test_add_func ("/file-cache/deep-zoom", test_memory_cache_deep_zoom);
 
   return g_test_run ();
 }
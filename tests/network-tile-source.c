@@ -2,6 +2,7 @@
 #include <libsoup/soup.h>
 #include <shumate/shumate.h>
 #include "test-tile-server.h"
+#include "shumate/shumate-vector-style-private.h"
 
 
 static ShumateMapSource *
@@ -188,6 +189,435 @@ test_network_tile_invalid_data (void)
 }
 
 
+static void
+on_region_downloaded (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GMainLoop *loop = user_data;
+
+  shumate_network_tile_source_download_region_finish ((ShumateNetworkTileSource *) object, res, &error);
+  g_assert_no_error (error);
+
+  g_main_loop_quit (loop);
+}
+
+static void
+on_download_progress (ShumateNetworkTileSource *source,
+                      guint64                   completed,
+                      guint64                   failed,
+                      guint64                   total,
+                      gpointer                  user_data)
+{
+  guint64 *last_completed = user_data;
+
+  g_assert_cmpuint (completed + failed, <=, total);
+  g_assert_cmpuint (failed, ==, 0);
+  g_assert_cmpuint (total, ==, 21);
+  *last_completed = completed;
+}
+
+/* Test that downloading a region fetches each of its tiles once */
+static void
+test_network_tile_source_download_region (void)
+{
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  guint64 completed = 0;
+
+  g_signal_connect (source, "download-progress", G_CALLBACK (on_download_progress), &completed);
+
+  /* The whole world at zoom levels 0 to 2 is 1 + 4 + 16 tiles */
+  shumate_network_tile_source_download_region_async (SHUMATE_NETWORK_TILE_SOURCE (source),
+                                                     -85, -180, 85, 180, 0, 2,
+                                                     NULL, on_region_downloaded, loop);
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (completed, ==, 21);
+  test_tile_server_assert_requests (server, 21);
+
+  /* Everything is in the cache now */
+  shumate_network_tile_source_download_region_async (SHUMATE_NETWORK_TILE_SOURCE (source),
+                                                     -85, -180, 85, 180, 0, 2,
+                                                     NULL, on_region_downloaded, loop);
+  g_main_loop_run (loop);
+
+  test_tile_server_assert_requests (server, 0);
+}
+
+
+static void
+on_region_download_failed (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GMainLoop *loop = user_data;
+
+  shumate_network_tile_source_download_region_finish ((ShumateNetworkTileSource *) object, res, &error);
+  g_assert_error (error, SHUMATE_NETWORK_SOURCE_ERROR, SHUMATE_NETWORK_SOURCE_ERROR_BAD_RESPONSE);
+
+  g_main_loop_quit (loop);
+}
+
+static void
+on_failed_download_progress (ShumateNetworkTileSource *source,
+                             guint64                   completed,
+                             guint64                   failed,
+                             guint64                   total,
+                             gpointer                  user_data)
+{
+  guint64 *last_failed = user_data;
+
+  g_assert_cmpuint (completed, ==, 0);
+  g_assert_cmpuint (total, ==, 21);
+  *last_failed = failed;
+}
+
+/* Test that tiles that fail to download don't stop the rest of the region,
+ * and that the region can be completed later */
+static void
+test_network_tile_source_download_region_resume (void)
+{
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  guint64 failed = 0;
+  gulong handler;
+
+  handler = g_signal_connect (source, "download-progress", G_CALLBACK (on_failed_download_progress), &failed);
+
+  /* Every tile is tried once, and every one of them fails */
+  test_tile_server_set_status (server, 404);
+  shumate_network_tile_source_download_region_async (SHUMATE_NETWORK_TILE_SOURCE (source),
+                                                     -85, -180, 85, 180, 0, 2,
+                                                     NULL, on_region_download_failed, loop);
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (failed, ==, 21);
+  test_tile_server_assert_requests (server, 21);
+
+  g_signal_handler_disconnect (source, handler);
+
+  test_tile_server_set_status (server, 200);
+  shumate_network_tile_source_download_region_async (SHUMATE_NETWORK_TILE_SOURCE (source),
+                                                     -85, -180, 85, 180, 0, 2,
+                                                     NULL, on_region_downloaded, loop);
+  g_main_loop_run (loop);
+
+  test_tile_server_assert_requests (server, 21);
+}
+
+
+static void
+on_region_counted (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  int *remaining = user_data;
+
+  shumate_network_tile_source_download_region_finish ((ShumateNetworkTileSource *) object, res, &error);
+  g_assert_no_error (error);
+
+  (*remaining) --;
+}
+
+/* Test that region downloads running at the same time each report their own
+ * progress */
+static void
+test_network_tile_source_download_region_concurrent (void)
+{
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+  guint64 completed = 0;
+  int remaining = 2;
+
+  g_signal_connect (source, "download-progress", G_CALLBACK (on_download_progress), &completed);
+
+  for (int i = 0; i < 2; i ++)
+    shumate_network_tile_source_download_region_async (SHUMATE_NETWORK_TILE_SOURCE (source),
+                                                       -85, -180, 85, 180, 0, 2,
+                                                       NULL, on_region_counted, &remaining);
+
+  while (remaining > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (completed, ==, 21);
+}
+
+
+static void
+on_tile_cancelled (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  int *remaining = user_data;
+
+  shumate_map_source_fill_tile_finish ((ShumateMapSource *) object, res, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  (*remaining) --;
+}
+
+static void
+on_tile_counted (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  int *remaining = user_data;
+
+  shumate_map_source_fill_tile_finish ((ShumateMapSource *) object, res, &error);
+  g_assert_no_error (error);
+
+  (*remaining) --;
+}
+
+/* Fills the tiles of a zoom level (all at once, like the map layer does) and
+ * returns how long that took */
+static double
+fill_zoom_level (ShumateMapSource *source, int zoom_level)
+{
+  g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GTimer) timer = g_timer_new ();
+  int n_tiles = 1 << zoom_level;
+  int remaining = n_tiles * n_tiles;
+
+  for (int x = 0; x < n_tiles; x ++)
+    for (int y = 0; y < n_tiles; y ++)
+      {
+        ShumateTile *tile = g_object_ref_sink (shumate_tile_new_full (x, y, 256, zoom_level));
+
+        g_ptr_array_add (tiles, tile);
+        shumate_map_source_fill_tile_async (source, tile, NULL, on_tile_counted, &remaining);
+      }
+
+  while (remaining > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_timer_elapsed (timer, NULL);
+}
+
+/* Test that tiles are fetched over the same connections rather than a new
+ * one per tile */
+static void
+test_network_tile_source_connection_reuse (void)
+{
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+
+  fill_zoom_level (source, 2);
+  fill_zoom_level (source, 3);
+
+  test_tile_server_assert_requests (server, 16 + 64);
+  g_assert_cmpint (test_tile_server_get_n_connections (server), <=,
+                   shumate_network_tile_source_get_max_conns (SHUMATE_NETWORK_TILE_SOURCE (source)));
+}
+
+/* Test that requests for a tile that is already being filled share the
+ * fill, and that cancelling one of them leaves the others alone */
+static void
+test_network_tile_source_coalesce (void)
+{
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+  g_autoptr(ShumateTile) tile1 = g_object_ref_sink (shumate_tile_new_full (1, 1, 256, 1));
+  g_autoptr(ShumateTile) tile2 = g_object_ref_sink (shumate_tile_new_full (1, 1, 256, 1));
+  g_autoptr(ShumateTile) tile3 = g_object_ref_sink (shumate_tile_new_full (1, 1, 256, 1));
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  int remaining = 3;
+
+  test_tile_server_set_delay (server, 50);
+
+  shumate_map_source_fill_tile_async (source, tile1, NULL, on_tile_counted, &remaining);
+  shumate_map_source_fill_tile_async (source, tile2, cancellable, on_tile_cancelled, &remaining);
+  shumate_map_source_fill_tile_async (source, tile3, NULL, on_tile_counted, &remaining);
+  g_cancellable_cancel (cancellable);
+
+  while (remaining > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  test_tile_server_assert_requests (server, 1);
+  g_assert_nonnull (shumate_tile_get_texture (tile1));
+  g_assert_true (shumate_tile_get_texture (tile1) == shumate_tile_get_texture (tile3));
+  g_assert_cmpint (shumate_tile_get_state (tile1), ==, SHUMATE_STATE_DONE);
+  g_assert_cmpint (shumate_tile_get_state (tile3), ==, SHUMATE_STATE_DONE);
+}
+
+/* Test that a fill is cancelled once all of its requests are */
+static void
+test_network_tile_source_coalesce_cancel (void)
+{
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+  g_autoptr(ShumateTile) tile1 = g_object_ref_sink (shumate_tile_new_full (1, 1, 256, 1));
+  g_autoptr(ShumateTile) tile2 = g_object_ref_sink (shumate_tile_new_full (1, 1, 256, 1));
+  g_autoptr(GCancellable) cancellable1 = g_cancellable_new ();
+  g_autoptr(GCancellable) cancellable2 = g_cancellable_new ();
+  int remaining = 2;
+
+  shumate_map_source_fill_tile_async (source, tile1, cancellable1, on_tile_cancelled, &remaining);
+  shumate_map_source_fill_tile_async (source, tile2, cancellable2, on_tile_cancelled, &remaining);
+  g_cancellable_cancel (cancellable1);
+  g_cancellable_cancel (cancellable2);
+
+  while (remaining > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_null (shumate_tile_get_texture (tile1));
+  g_assert_null (shumate_tile_get_texture (tile2));
+
+  /* The tile can be filled again afterwards */
+  remaining = 1;
+  shumate_map_source_fill_tile_async (source, tile1, NULL, on_tile_counted, &remaining);
+
+  while (remaining > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_nonnull (shumate_tile_get_texture (tile1));
+}
+
+static void
+on_tile_finished (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  int *remaining = user_data;
+
+  shumate_map_source_fill_tile_finish ((ShumateMapSource *) object, res, NULL);
+  (*remaining) --;
+}
+
+static gboolean
+cancel_fill (gpointer user_data)
+{
+  g_cancellable_cancel (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+/* Fills a screenful of tiles from a server with a round trip time of 50 ms,
+ * cancels them partway through (as when the map is scrolled away and back)
+ * and fills them again. Responses with a Content-Length are read to the end
+ * when cancelled; chunked ones are dropped along with their connection, which
+ * is how every cancelled response used to be handled. */
+static void
+test_network_tile_source_latency_benchmark (void)
+{
+  gboolean chunked[] = { TRUE, FALSE };
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Benchmarks only run in perf mode");
+      return;
+    }
+
+  for (int i = 0; i < G_N_ELEMENTS (chunked); i ++)
+    {
+      g_autoptr(TestTileServer) server = test_tile_server_new ();
+      g_autofree char *uri = test_tile_server_start (server);
+      g_autoptr(ShumateMapSource) source = create_tile_source (uri);
+      g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+      g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+      g_autoptr(GTimer) timer = g_timer_new ();
+      int remaining = 64;
+      double time;
+
+      test_tile_server_set_delay (server, 50);
+      test_tile_server_set_chunked (server, chunked[i]);
+
+      for (int x = 0; x < 8; x ++)
+        for (int y = 0; y < 8; y ++)
+          {
+            ShumateTile *tile = g_object_ref_sink (shumate_tile_new_full (x, y, 256, 3));
+
+            g_ptr_array_add (tiles, tile);
+            shumate_map_source_fill_tile_async (source, tile, cancellable, on_tile_finished, &remaining);
+          }
+
+      g_timeout_add (125, cancel_fill, cancellable);
+
+      while (remaining > 0)
+        g_main_context_iteration (NULL, TRUE);
+
+      fill_zoom_level (source, 3);
+      time = g_timer_elapsed (timer, NULL);
+
+      g_test_message ("%s: cancel and refill 64 tiles in %.2f s over %d connections",
+                      chunked[i] ? "dropping cancelled responses" : "reading cancelled responses",
+                      time, test_tile_server_get_n_connections (server));
+
+      if (!chunked[i])
+        g_test_minimized_result (time, "cancel and refill 64 tiles: %.2f s", time);
+    }
+}
+
+
+/* Tiles past the source's maximum zoom level are rendered from part of the
+ * tile on that level */
+static void
+test_network_tile_source_overzoom (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(TestTileServer) server = test_tile_server_new ();
+  g_autofree char *uri = test_tile_server_start (server);
+  g_autofree char *template = g_strdup_printf ("%s/#X#/#Y#/#Z#", uri);
+  g_autofree char *r = g_uuid_string_random ();
+  g_autofree char *id = g_strdup_printf ("test_%s", r);
+  g_autoptr(GBytes) tile_data = NULL;
+  g_autoptr(ShumateVectorStyle) style = NULL;
+  g_autoptr(ShumateVectorTile) vector_tile = NULL;
+  g_autoptr(ShumateMapSource) source = NULL;
+  g_autoptr(ShumateTile) tile = shumate_tile_new_full (1, 2, 256, 2);
+  g_autoptr(ShumateTile) sibling = shumate_tile_new_full (2, 2, 256, 2);
+  g_autoptr(GdkTexture) expected = NULL;
+  g_autoptr(GMainLoop) loop = NULL;
+  g_autofree guchar *pixels = g_malloc (256 * 256 * 4);
+  g_autofree guchar *expected_pixels = g_malloc (256 * 256 * 4);
+
+  if (!shumate_vector_style_is_supported ())
+    {
+      g_test_skip ("Vector rendering is not supported");
+      return;
+    }
+
+  g_object_ref_sink (tile);
+  g_object_ref_sink (sibling);
+
+  tile_data = g_resources_lookup_data ("/org/gnome/shumate/Tests/0.pbf", G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
+  test_tile_server_set_bytes (server, tile_data);
+
+  style = shumate_vector_style_create ("{\"layers\": [{\"type\": \"line\", \"source-layer\": \"lines\", \"paint\": {\"line-color\": \"#336699\", \"line-width\": 4}}]}", &error);
+  g_assert_no_error (error);
+
+  source = SHUMATE_MAP_SOURCE (shumate_network_tile_source_new_vector_full (id, "Test Source", NULL, NULL,
+                                                                           0, 0, 256,
+                                                                           SHUMATE_MAP_PROJECTION_MERCATOR,
+                                                                           template, style));
+
+  loop = g_main_loop_new (NULL, TRUE);
+  shumate_map_source_fill_tile_async (source, tile, NULL, on_tile_filled, loop);
+  g_main_loop_run (loop);
+
+  /* The only tile requested is the one on the maximum zoom level */
+  test_tile_server_assert_requests (server, 1);
+  g_assert_true (g_str_has_suffix (test_tile_server_get_last_path (server), "/0/0/0"));
+
+  /* It shows the part of that tile the over-zoomed tile covers */
+  vector_tile = shumate_vector_tile_new (tile_data);
+  expected = shumate_vector_style_render_tile_area (style, 256, vector_tile, 2, 2, 1, 2);
+
+  g_assert_nonnull (shumate_tile_get_texture (tile));
+  gdk_texture_download (shumate_tile_get_texture (tile), pixels, 256 * 4);
+  gdk_texture_download (expected, expected_pixels, 256 * 4);
+  g_assert_cmpmem (pixels, 256 * 256 * 4, expected_pixels, 256 * 256 * 4);
+
+  /* Its siblings are rendered from the same tile, which is in the file cache
+   * now */
+  shumate_map_source_fill_tile_async (source, sibling, NULL, on_tile_filled, loop);
+  g_main_loop_run (loop);
+
+  g_assert_nonnull (shumate_tile_get_texture (sibling));
+  test_tile_server_assert_requests (server, 0);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -201,6 +631,14 @@ main (int argc, char *argv[])
   g_test_add_func ("/network-tile-source/invalid-url", test_network_tile_invalid_url);
   g_test_add_func ("/network-tile-source/bad-response", test_network_tile_bad_response);
   g_test_add_func ("/network-tile-source/invalid-data", test_network_tile_invalid_data);
+  g_test_add_func ("/network-tile-source/download-region", test_network_tile_source_download_region);
+  g_test_add_func ("/network-tile-source/download-region-resume", test_network_tile_source_download_region_resume);
+  g_test_add_func ("/network-tile-source/download-region-concurrent", test_network_tile_source_download_region_concurrent);
+  g_test_add_func ("/network-tile-source/connection-reuse", test_network_tile_source_connection_reuse);
+  g_test_add_func ("/network-tile-source/coalesce", test_network_tile_source_coalesce);
+  g_test_add_func ("/network-tile-source/coalesce-cancel", test_network_tile_source_coalesce_cancel);
+  g_test_add_func ("/network-tile-source/overzoom", test_network_tile_source_overzoom);
+  g_test_add_func ("/network-tile-source/latency-benchmark", test_network_tile_source_latency_benchmark);
 
   return g_test_run ();
 }
@@ -15,6 +15,10 @@ struct _TestTileServer
   int requests;
   int status;
   char *etag;
+  guint delay;
+  gboolean chunked;
+  int connections;
+  char *last_path;
 };
 
 G_DEFINE_TYPE (TestTileServer, test_tile_server, G_TYPE_OBJECT)
@@ -62,6 +66,7 @@ test_tile_server_finalize (GObject *object)
   g_clear_object (&self->server);
   g_clear_pointer (&self->bytes, g_bytes_unref);
   g_clear_pointer (&self->etag, g_free);
+  g_clear_pointer (&self->last_path, g_free);
 
   G_OBJECT_CLASS (test_tile_server_parent_class)->finalize (object);
 }
@@ -83,6 +88,23 @@ test_tile_server_init (TestTileServer *self)
 }
 
 
+typedef struct {
+  SoupServer *server;
+  SoupMessage *msg;
+} DelayedResponse;
+
+static gboolean
+send_delayed_response (DelayedResponse *response)
+{
+  soup_server_unpause_message (response->server, response->msg);
+
+  g_object_unref (response->server);
+  g_object_unref (response->msg);
+  g_free (response);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 server_callback (SoupServer *server,
                  SoupMessage *msg,
@@ -97,6 +119,16 @@ server_callback (SoupServer *server,
 
   self->requests ++;
 
+  g_free (self->last_path);
+  self->last_path = g_strdup (path);
+
+  /* Count each connection the first time a request arrives on it */
+  if (!g_object_get_data (G_OBJECT (soup_client_context_get_gsocket (client)), "test-tile-server"))
+    {
+      g_object_set_data (G_OBJECT (soup_client_context_get_gsocket (client)), "test-tile-server", self);
+      self->connections ++;
+    }
+
   if (self->bytes)
     {
       data = g_bytes_get_data (self->bytes, &data_size);
@@ -104,6 +136,20 @@ server_callback (SoupServer *server,
     }
 
   soup_message_set_status (msg, self->status);
+
+  if (self->chunked)
+    soup_message_headers_set_encoding (msg->response_headers, SOUP_ENCODING_CHUNKED);
+
+  if (self->delay > 0)
+    {
+      DelayedResponse *response = g_new0 (DelayedResponse, 1);
+
+      response->server = g_object_ref (server);
+      response->msg = g_object_ref (msg);
+
+      soup_server_pause_message (server, msg);
+      g_timeout_add (self->delay, (GSourceFunc) send_delayed_response, response);
+    }
 }
 
 
@@ -145,9 +191,47 @@ test_tile_server_set_data (TestTileServer *self, const char *data)
     self->bytes = NULL;
 }
 
+/* Like test_tile_server_set_data(), for binary data such as vector tiles */
+void
+test_tile_server_set_bytes (TestTileServer *self, GBytes *bytes)
+{
+  g_clear_pointer (&self->bytes, g_bytes_unref);
+  if (bytes)
+    self->bytes = g_bytes_ref (bytes);
+}
+
+/* The path of the most recent request */
+const char *
+test_tile_server_get_last_path (TestTileServer *self)
+{
+  return self->last_path;
+}
+
 void
 test_tile_server_set_etag (TestTileServer *self, const char *etag)
 {
   g_clear_pointer (&self->etag, g_free);
   self->etag = g_strdup (etag);
 }
+
+/* Delays every response by @delay milliseconds, to simulate a distant
+ * server */
+void
+test_tile_server_set_delay (TestTileServer *self, guint delay)
+{
+  self->delay = delay;
+}
+
+/* Sends responses without a Content-Length, so the client doesn't know how
+ * large they are until they end */
+void
+test_tile_server_set_chunked (TestTileServer *self, gboolean chunked)
+{
+  self->chunked = chunked;
+}
+
+int
+test_tile_server_get_n_connections (TestTileServer *self)
+{
+  return self->connections;
+}
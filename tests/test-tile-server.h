@@ -15,6 +15,11 @@ char *test_tile_server_start (TestTileServer *self);
 void test_tile_server_assert_requests (TestTileServer *self, int times);
 void test_tile_server_set_status (TestTileServer *self, int status);
 void test_tile_server_set_data (TestTileServer *self, const char *data);
+void test_tile_server_set_bytes (TestTileServer *self, GBytes *bytes);
+const char *test_tile_server_get_last_path (TestTileServer *self);
 void test_tile_server_set_etag (TestTileServer *self, const char *etag);
+void test_tile_server_set_delay (TestTileServer *self, guint delay);
+void test_tile_server_set_chunked (TestTileServer *self, gboolean chunked);
+int test_tile_server_get_n_connections (TestTileServer *self);
 
 G_END_DECLS
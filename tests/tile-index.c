@@ -0,0 +1,253 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+#include "shumate/shumate-tile-index-private.h"
+
+
+static void
+count_destroy (gpointer data)
+{
+  (*(int *) data) ++;
+}
+
+
+static void
+test_tile_index_insert_lookup (void)
+{
+  g_autoptr(ShumateTileIndex) index = shumate_tile_index_new (NULL);
+  int values[3];
+
+  shumate_tile_index_insert (index, 0, 0, 0, &values[0]);
+  shumate_tile_index_insert (index, -1, 2, 3, &values[1]);
+  shumate_tile_index_insert (index, 2, -1, 3, &values[2]);
+
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, 3);
+  g_assert_true (shumate_tile_index_lookup (index, 0, 0, 0) == &values[0]);
+  g_assert_true (shumate_tile_index_lookup (index, -1, 2, 3) == &values[1]);
+  g_assert_true (shumate_tile_index_lookup (index, 2, -1, 3) == &values[2]);
+
+  /* Positions that differ only in one coordinate are distinct */
+  g_assert_null (shumate_tile_index_lookup (index, 0, 0, 1));
+  g_assert_null (shumate_tile_index_lookup (index, 2, -1, 2));
+  g_assert_false (shumate_tile_index_contains (index, 1, 0, 0));
+
+  /* Inserting at an existing position replaces the value */
+  shumate_tile_index_insert (index, 0, 0, 0, &values[2]);
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, 3);
+  g_assert_true (shumate_tile_index_lookup (index, 0, 0, 0) == &values[2]);
+}
+
+
+static void
+test_tile_index_remove (void)
+{
+  int destroyed = 0;
+  g_autoptr(ShumateTileIndex) index = shumate_tile_index_new (count_destroy);
+
+  /* Fill the index well past its initial capacity, then empty it again, so
+   * removal has to work across resizes and long probe sequences */
+  for (int x = -20; x < 20; x ++)
+    for (int y = -20; y < 20; y ++)
+      shumate_tile_index_insert (index, x, y, 5, &destroyed);
+
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, 1600);
+
+  for (int x = -20; x < 20; x += 2)
+    for (int y = -20; y < 20; y ++)
+      g_assert_true (shumate_tile_index_remove (index, x, y, 5));
+
+  g_assert_cmpint (destroyed, ==, 800);
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, 800);
+  g_assert_false (shumate_tile_index_remove (index, -20, -20, 5));
+
+  for (int x = -20; x < 20; x ++)
+    for (int y = -20; y < 20; y ++)
+      g_assert_cmpint (shumate_tile_index_contains (index, x, y, 5), ==, x % 2 != 0);
+
+  shumate_tile_index_remove_all (index);
+  g_assert_cmpint (destroyed, ==, 1600);
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, 0);
+  g_assert_false (shumate_tile_index_contains (index, -19, 0, 5));
+}
+
+
+static void
+test_tile_index_iter (void)
+{
+  int destroyed = 0;
+  g_autoptr(ShumateTileIndex) index = shumate_tile_index_new (count_destroy);
+  ShumateTileIndexIter iter;
+  int x, y, zoom;
+  guint seen = 0;
+
+  for (int i = 0; i < 100; i ++)
+    shumate_tile_index_insert (index, i, i * 7, i % 4, &destroyed);
+
+  /* Remove every entry on an odd zoom level while iterating */
+  shumate_tile_index_iter_init (&iter, index);
+  while (shumate_tile_index_iter_next (&iter, &x, &y, &zoom, NULL))
+    {
+      g_assert_cmpint (y, ==, x * 7);
+      g_assert_cmpint (zoom, ==, x % 4);
+      seen ++;
+
+      if (zoom % 2 == 1)
+        shumate_tile_index_iter_remove (&iter);
+    }
+
+  g_assert_cmpuint (seen, ==, 100);
+  g_assert_cmpint (destroyed, ==, 50);
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, 50);
+
+  seen = 0;
+  shumate_tile_index_iter_init (&iter, index);
+  while (shumate_tile_index_iter_next (&iter, NULL, NULL, &zoom, NULL))
+    {
+      g_assert_cmpint (zoom % 2, ==, 0);
+      seen ++;
+    }
+
+  g_assert_cmpuint (seen, ==, 50);
+}
+
+
+/* The same access pattern as the map layer's recompute_grid(): drop the
+ * positions that left the grid, then look up every cell of the grid and
+ * insert the missing ones. */
+static void
+recompute_index (ShumateTileIndex *index,
+                 int               column,
+                 int               row,
+                 int               columns,
+                 int               rows,
+                 int               zoom)
+{
+  ShumateTileIndexIter iter;
+  int x, y, z;
+
+  shumate_tile_index_iter_init (&iter, index);
+  while (shumate_tile_index_iter_next (&iter, &x, &y, &z, NULL))
+    {
+      if (z == zoom && (x < column || x >= column + columns || y < row || y >= row + rows))
+        shumate_tile_index_iter_remove (&iter);
+    }
+
+  for (x = column; x < column + columns; x ++)
+    for (y = row; y < row + rows; y ++)
+      if (!shumate_tile_index_lookup (index, x, y, zoom))
+        shumate_tile_index_insert (index, x, y, zoom, index);
+}
+
+/* The keys that the map layer used before the tile index, for comparison */
+typedef struct
+{
+  int x;
+  int y;
+  int zoom;
+} Position;
+
+static guint
+position_hash (gconstpointer pointer)
+{
+  const Position *self = pointer;
+  return self->x ^ self->y ^ self->zoom;
+}
+
+static gboolean
+position_equal (gconstpointer a, gconstpointer b)
+{
+  const Position *pos_a = a;
+  const Position *pos_b = b;
+  return pos_a->x == pos_b->x && pos_a->y == pos_b->y && pos_a->zoom == pos_b->zoom;
+}
+
+static void
+recompute_hash_table (GHashTable *table,
+                      int         column,
+                      int         row,
+                      int         columns,
+                      int         rows,
+                      int         zoom)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      Position *pos = key;
+
+      if (pos->zoom == zoom && (pos->x < column || pos->x >= column + columns || pos->y < row || pos->y >= row + rows))
+        g_hash_table_iter_remove (&iter);
+    }
+
+  for (int x = column; x < column + columns; x ++)
+    for (int y = row; y < row + rows; y ++)
+      {
+        Position *pos = g_new (Position, 1);
+
+        pos->x = x;
+        pos->y = y;
+        pos->zoom = zoom;
+
+        if (!g_hash_table_contains (table, pos))
+          g_hash_table_insert (table, pos, table);
+        else
+          g_free (pos);
+      }
+}
+
+/* Pans an 8K viewport of 256px tiles diagonally across the map, with the
+ * tiles of the previous zoom level still resident */
+#define BENCHMARK_COLUMNS (7680 / 256 + 2)
+#define BENCHMARK_ROWS (4320 / 256 + 2)
+#define BENCHMARK_STEPS 10000
+
+static void
+test_tile_index_benchmark (void)
+{
+  g_autoptr(ShumateTileIndex) index = shumate_tile_index_new (NULL);
+  g_autoptr(GHashTable) table = g_hash_table_new_full (position_hash, position_equal, g_free, NULL);
+  g_autoptr(GTimer) timer = g_timer_new ();
+  double index_time, table_time;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Benchmarks only run in perf mode");
+      return;
+    }
+
+  recompute_index (index, 0, 0, BENCHMARK_COLUMNS / 2, BENCHMARK_ROWS / 2, 14);
+  recompute_hash_table (table, 0, 0, BENCHMARK_COLUMNS / 2, BENCHMARK_ROWS / 2, 14);
+
+  g_timer_start (timer);
+  for (int i = 0; i < BENCHMARK_STEPS; i ++)
+    recompute_index (index, i / 4, i / 8, BENCHMARK_COLUMNS, BENCHMARK_ROWS, 15);
+  index_time = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (int i = 0; i < BENCHMARK_STEPS; i ++)
+    recompute_hash_table (table, i / 4, i / 8, BENCHMARK_COLUMNS, BENCHMARK_ROWS, 15);
+  table_time = g_timer_elapsed (timer, NULL);
+
+  g_assert_cmpuint (shumate_tile_index_get_size (index), ==, g_hash_table_size (table));
+
+  g_test_message ("GHashTable with heap keys: %.2f µs per recompute",
+                  table_time * G_USEC_PER_SEC / BENCHMARK_STEPS);
+  g_test_minimized_result (index_time * G_USEC_PER_SEC / BENCHMARK_STEPS,
+                           "tile index: %.2f µs per recompute",
+                           index_time * G_USEC_PER_SEC / BENCHMARK_STEPS);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/tile-index/insert-lookup", test_tile_index_insert_lookup);
+  g_test_add_func ("/tile-index/remove", test_tile_index_remove);
+  g_test_add_func ("/tile-index/iter", test_tile_index_iter);
+  g_test_add_func ("/tile-index/benchmark", test_tile_index_benchmark);
+
+  return g_test_run ();
+}
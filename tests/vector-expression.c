@@ -170,6 +170,24 @@ test_vector_expression_basic_filter (void)
 }
 
 
+static void
+test_vector_expression_nested_filter (void)
+{
+  g_assert_true  (filter ("[\"all\", [\"any\", false, [\"!\", false]], [\"none\", [\"in\", 3, 1, 2]]]"));
+  g_assert_false (filter ("[\"all\", [\"any\", false, false], [\"none\", [\"in\", 3, 1, 2]]]"));
+  g_assert_true  (filter ("[\"any\", [\"all\", true, false], [\"all\", [\"!in\", 3, 1, 2], [\">=\", 2, 1]]]"));
+  g_assert_false (filter ("[\"any\", [\"in\", [\"any\", true], false], [\"in\", 1, [\"<\", 1, 2]]]"));
+  g_assert_true  (filter ("[\"==\", [\"none\", false], [\"all\", [\"==\", 1, 1], [\"!=\", 1, 2]]]"));
+
+  /* Operands of the wrong type make the whole filter fail, including ones
+   * nested in short-circuiting operators */
+  g_assert_false (filter ("[\"!\", [\"any\", 1]]"));
+  g_assert_false (filter ("[\"!\", [\"<\", 1, \"2\"]]"));
+  g_assert_false (filter ("[\"any\", false, [\"!\", 0], true]"));
+  g_assert_true  (filter ("[\"any\", true, [\"!\", 0]]"));
+}
+
+
 static void
 test_vector_expression_feature_filter (void)
 {
@@ -177,7 +195,7 @@ test_vector_expression_feature_filter (void)
   g_autoptr(GBytes) vector_data = NULL;
   gconstpointer data;
   gsize len;
-  ShumateVectorRenderScope scope;
+  ShumateVectorRenderScope scope = { 0 };
 
   vector_data = g_resources_lookup_data ("/org/gnome/shumate/Tests/0.pbf", G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
   g_assert_no_error (error);
@@ -199,6 +217,68 @@ test_vector_expression_feature_filter (void)
   g_assert_true  (filter_with_scope (&scope, "[\"!has\", \"name:en\"]"));
   g_assert_true  (filter_with_scope (&scope, "[\"==\", \"$type\", \"Point\"]"));
   g_assert_true  (filter_with_scope (&scope, "[\"==\", \"zoom\", 10]"));
+
+  shumate_vector_render_scope_clear (&scope);
+  vector_tile__tile__free_unpacked (scope.tile, NULL);
+}
+
+
+static ShumateVectorDependency
+get_dependency (const char *json)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(JsonNode) node = json_from_string (json, NULL);
+  g_autoptr(ShumateVectorExpression) expression = shumate_vector_expression_from_json (node, &error);
+
+  g_assert_no_error (error);
+
+  return shumate_vector_expression_get_dependency (expression);
+}
+
+
+static void
+test_vector_expression_dependency (void)
+{
+  g_assert_cmpint (get_dependency ("1"), ==, SHUMATE_VECTOR_DEPENDS_NOTHING);
+  g_assert_cmpint (get_dependency ("[\"all\", [\"==\", 1, 1], [\"in\", 2, 1, 2]]"), ==, SHUMATE_VECTOR_DEPENDS_NOTHING);
+  g_assert_cmpint (get_dependency ("{\"stops\": [[12, 1], [13, 2]]}"), ==, SHUMATE_VECTOR_DEPENDS_ZOOM);
+  g_assert_cmpint (get_dependency ("[\">=\", \"zoom\", 10]"), ==, SHUMATE_VECTOR_DEPENDS_ZOOM);
+  g_assert_cmpint (get_dependency ("[\"==\", \"$type\", \"Point\"]"), ==, SHUMATE_VECTOR_DEPENDS_FEATURE);
+  g_assert_cmpint (get_dependency ("[\"all\", [\">=\", \"zoom\", 10], [\"has\", \"name\"]]"), ==,
+                   SHUMATE_VECTOR_DEPENDS_ZOOM | SHUMATE_VECTOR_DEPENDS_FEATURE);
+
+  /* Constant expressions are folded, but still evaluate the same */
+  g_assert_true  (filter ("[\"all\", [\"==\", 1, 1], [\"in\", 2, 1, 2]]"));
+  g_assert_false (filter ("[\"!\", [\"any\", 1]]"));
+}
+
+
+static void
+test_vector_expression_cached (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(JsonNode) zoom_node = json_from_string ("{\"stops\": [[12, 1], [13, 2]]}", NULL);
+  g_autoptr(JsonNode) feature_node = json_from_string ("[\"==\", \"$type\", \"Point\"]", NULL);
+  g_autoptr(ShumateVectorExpression) zoom_expression = NULL;
+  g_autoptr(ShumateVectorExpression) feature_expression = NULL;
+  ShumateVectorRenderScope scope = { 0 };
+
+  zoom_expression = shumate_vector_expression_from_json (zoom_node, &error);
+  g_assert_no_error (error);
+  feature_expression = shumate_vector_expression_from_json (feature_node, &error);
+  g_assert_no_error (error);
+
+  /* Values that only depend on the zoom level are kept for the rest of the
+   * style layer, even if the scope changes in the meantime */
+  scope.zoom_level = 12;
+  g_assert_cmpfloat (1.0, ==, shumate_vector_expression_eval_number_cached (zoom_expression, &scope, 0, -1.0));
+  scope.zoom_level = 13;
+  g_assert_cmpfloat (1.0, ==, shumate_vector_expression_eval_number_cached (zoom_expression, &scope, 0, -1.0));
+  g_assert_true (scope.properties[0].cached);
+
+  /* Values that depend on the feature are not cached */
+  g_assert_cmpfloat (-1.0, ==, shumate_vector_expression_eval_number_cached (feature_expression, &scope, 1, -1.0));
+  g_assert_false (scope.properties[1].cached);
 }
 
 
@@ -234,8 +314,11 @@ main (int argc, char *argv[])
   g_test_add_func ("/vector/expression/interpolate", test_vector_expression_interpolate);
   g_test_add_func ("/vector/expression/interpolate-color", test_vector_expression_interpolate_color);
   g_test_add_func ("/vector/expression/basic-filter", test_vector_expression_basic_filter);
+  g_test_add_func ("/vector/expression/nested-filter", test_vector_expression_nested_filter);
   g_test_add_func ("/vector/expression/feature-filter", test_vector_expression_feature_filter);
   g_test_add_func ("/vector/expression/filter-errors", test_vector_expression_filter_errors);
+  g_test_add_func ("/vector/expression/dependency", test_vector_expression_dependency);
+  g_test_add_func ("/vector/expression/cached", test_vector_expression_cached);
 
   return g_test_run ();
 }
@@ -1,5 +1,7 @@
 #include <gtk/gtk.h>
 #include <shumate/shumate.h>
+#include "shumate/shumate-vector-style-private.h"
+#include "shumate/vector/shumate-vector-layer-private.h"
 
 static void
 test_vector_style_create (void)
@@ -15,12 +17,514 @@ test_vector_style_create (void)
   g_assert_no_error (error);
 }
 
+static void
+test_vector_style_render_parsed_tile (void)
+{
+  GError *error = NULL;
+  g_autoptr(GBytes) style_json = NULL;
+  g_autoptr(GBytes) tile_data = NULL;
+  g_autoptr(ShumateVectorStyle) style = NULL;
+  g_autoptr(ShumateVectorTile) tile = NULL;
+  g_autoptr(GBytes) garbage = NULL;
+
+  style_json = g_resources_lookup_data ("/org/gnome/shumate/Tests/style.json", G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
+  tile_data = g_resources_lookup_data ("/org/gnome/shumate/Tests/0.pbf", G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
+
+  style = shumate_vector_style_create (g_bytes_get_data (style_json, NULL), &error);
+  g_assert_no_error (error);
+
+  tile = shumate_vector_tile_new (tile_data);
+  g_assert_nonnull (tile);
+  g_assert_true (shumate_vector_tile_get_data (tile) == tile_data);
+
+  /* A decoded tile can be rendered repeatedly, at different zoom levels, and
+   * gives the same result as rendering the tile data directly */
+  for (int zoom = 0; zoom < 3; zoom ++)
+    {
+      g_autoptr(GdkTexture) expected = shumate_vector_style_render (style, 256, tile_data, zoom);
+      g_autoptr(GdkTexture) texture = shumate_vector_style_render_tile (style, 256, tile, zoom);
+      g_autofree guchar *expected_pixels = g_malloc (256 * 256 * 4);
+      g_autofree guchar *pixels = g_malloc (256 * 256 * 4);
+
+      gdk_texture_download (expected, expected_pixels, 256 * 4);
+      gdk_texture_download (texture, pixels, 256 * 4);
+      g_assert_cmpmem (pixels, 256 * 256 * 4, expected_pixels, 256 * 256 * 4);
+    }
+
+  garbage = g_bytes_new_static ("\xff\xff\xff\xff", 4);
+  g_assert_null (shumate_vector_tile_new (garbage));
+}
+
+
+/* A tile with one layer, "buildings", of size × size squares laid out on a
+ * grid with gaps between them. Every square has the tags test-key-a=yes and
+ * test-key-b=yes. */
+typedef struct {
+  VectorTile__Tile tile;
+  VectorTile__Tile__Layer layer;
+  VectorTile__Tile__Layer *layers[1];
+  char *keys[2];
+  VectorTile__Tile__Value value;
+  VectorTile__Tile__Value *values[1];
+  guint32 tags[4];
+  VectorTile__Tile__Feature *features;
+  VectorTile__Tile__Feature **feature_pointers;
+  guint32 *geometry;
+} GridTile;
+
+#define SQUARE_GEOMETRY_LEN 11
+
+static guint32
+zigzag (int value)
+{
+  return ((guint32) value << 1) ^ (guint32) (value >> 31);
+}
+
+static GridTile *
+grid_tile_new (int size)
+{
+  GridTile *self = g_new0 (GridTile, 1);
+  VectorTile__Tile tile = VECTOR_TILE__TILE__INIT;
+  VectorTile__Tile__Layer layer = VECTOR_TILE__TILE__LAYER__INIT;
+  VectorTile__Tile__Value value = VECTOR_TILE__TILE__VALUE__INIT;
+  int n_features = size * size;
+  int spacing = 4096 / size;
+  int side = spacing / 2;
+
+  self->features = g_new (VectorTile__Tile__Feature, n_features);
+  self->feature_pointers = g_new (VectorTile__Tile__Feature *, n_features);
+  self->geometry = g_new (guint32, n_features * SQUARE_GEOMETRY_LEN);
+
+  for (int i = 0; i < n_features; i ++)
+    {
+      VectorTile__Tile__Feature feature = VECTOR_TILE__TILE__FEATURE__INIT;
+      guint32 *geometry = &self->geometry[i * SQUARE_GEOMETRY_LEN];
+
+      /* MoveTo the corner, three LineTos around the square, ClosePath */
+      geometry[0] = 1 | (1 << 3);
+      geometry[1] = zigzag ((i % size) * spacing + side / 2);
+      geometry[2] = zigzag ((i / size) * spacing + side / 2);
+      geometry[3] = 2 | (3 << 3);
+      geometry[4] = zigzag (side);
+      geometry[5] = 0;
+      geometry[6] = 0;
+      geometry[7] = zigzag (side);
+      geometry[8] = zigzag (-side);
+      geometry[9] = 0;
+      geometry[10] = 7 | (1 << 3);
+
+      feature.has_type = TRUE;
+      feature.type = VECTOR_TILE__TILE__GEOM_TYPE__POLYGON;
+      feature.n_geometry = SQUARE_GEOMETRY_LEN;
+      feature.geometry = geometry;
+      feature.n_tags = 4;
+      feature.tags = self->tags;
+
+      self->features[i] = feature;
+      self->feature_pointers[i] = &self->features[i];
+    }
+
+  self->keys[0] = (char *) "test-key-a";
+  self->keys[1] = (char *) "test-key-b";
+  value.string_value = (char *) "yes";
+  self->value = value;
+  self->values[0] = &self->value;
+  self->tags[0] = 0;
+  self->tags[1] = 0;
+  self->tags[2] = 1;
+  self->tags[3] = 0;
+
+  layer.name = (char *) "buildings";
+  layer.n_keys = 2;
+  layer.keys = self->keys;
+  layer.n_values = 1;
+  layer.values = self->values;
+  layer.n_features = n_features;
+  layer.features = self->feature_pointers;
+  self->layer = layer;
+  self->layers[0] = &self->layer;
+
+  tile.n_layers = 1;
+  tile.layers = self->layers;
+  self->tile = tile;
+
+  return self;
+}
+
+static void
+grid_tile_free (GridTile *self)
+{
+  g_free (self->features);
+  g_free (self->feature_pointers);
+  g_free (self->geometry);
+  g_free (self);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GridTile, grid_tile_free)
+
+
+/* Renders a single style layer and returns the number of draw calls */
+static guint
+render_layer (ShumateVectorLayer *layer, VectorTile__Tile *tile, cairo_surface_t *surface)
+{
+  ShumateVectorRenderScope scope = { 0 };
+
+  scope.cr = cairo_create (surface);
+  scope.target_size = cairo_image_surface_get_width (surface);
+  scope.zoom_level = 14;
+  scope.tile = tile;
+
+  shumate_vector_layer_render (layer, &scope);
+
+  shumate_vector_render_scope_clear (&scope);
+  cairo_destroy (scope.cr);
+
+  return scope.n_draw_calls;
+}
+
+/* Renders each feature on its own, the way fill layers did before features
+ * were batched */
+static void
+render_features_separately (VectorTile__Tile *tile, const GdkRGBA *color, cairo_surface_t *surface)
+{
+  ShumateVectorRenderScope scope = { 0 };
+
+  scope.cr = cairo_create (surface);
+  scope.tile = tile;
+  scope.layer = tile->layers[0];
+  scope.scale = (double) scope.layer->extent / cairo_image_surface_get_width (surface);
+  cairo_scale (scope.cr, 1.0 / scope.scale, 1.0 / scope.scale);
+
+  for (int i = 0; i < scope.layer->n_features; i ++)
+    {
+      scope.feature = scope.layer->features[i];
+      cairo_new_path (scope.cr);
+      shumate_vector_render_scope_exec_geometry (&scope);
+      gdk_cairo_set_source_rgba (scope.cr, color);
+      cairo_fill (scope.cr);
+    }
+
+  cairo_destroy (scope.cr);
+}
+
+static ShumateVectorLayer *
+create_layer (const char *json)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(JsonNode) node = json_from_string (json, NULL);
+  ShumateVectorLayer *layer = shumate_vector_layer_create_from_json (json_node_get_object (node), &error);
+
+  g_assert_no_error (error);
+  return layer;
+}
+
+static void
+assert_surfaces_equal (cairo_surface_t *a, cairo_surface_t *b)
+{
+  int height = cairo_image_surface_get_height (a);
+  int stride = cairo_image_surface_get_stride (a);
+
+  cairo_surface_flush (a);
+  cairo_surface_flush (b);
+  g_assert_cmpmem (cairo_image_surface_get_data (a), height * stride,
+                   cairo_image_surface_get_data (b), height * stride);
+}
+
+static void
+test_vector_style_batch_features (void)
+{
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(ShumateVectorLayer) fill = NULL;
+  g_autoptr(ShumateVectorLayer) translucent_fill = NULL;
+  g_autoptr(ShumateVectorLayer) line = NULL;
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256);
+  cairo_surface_t *expected = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256);
+  GdkRGBA color;
+
+  fill = create_layer ("{\"type\": \"fill\", \"source-layer\": \"buildings\", \"paint\": {\"fill-color\": \"#336699\"}}");
+  translucent_fill = create_layer ("{\"type\": \"fill\", \"source-layer\": \"buildings\", \"paint\": {\"fill-color\": \"#336699\", \"fill-opacity\": 0.5}}");
+  line = create_layer ("{\"type\": \"line\", \"source-layer\": \"buildings\", \"paint\": {\"line-color\": \"#336699\", \"line-width\": 1}}");
+
+  /* Opaque features with the same paint are drawn all at once, with the
+   * same result as drawing them one by one */
+  g_assert_cmpuint (render_layer (fill, &grid->tile, surface), ==, 1);
+
+  gdk_rgba_parse (&color, "#336699");
+  render_features_separately (&grid->tile, &color, expected);
+  assert_surfaces_equal (surface, expected);
+
+  /* The squares are 16 pixels apart, so their strokes can't meet even with
+   * the longest miters cairo draws */
+  g_assert_cmpuint (render_layer (line, &grid->tile, surface), ==, 1);
+
+  /* Translucent ones are not */
+  g_assert_cmpuint (render_layer (translucent_fill, &grid->tile, surface), ==, 64);
+
+  cairo_surface_destroy (surface);
+  cairo_surface_destroy (expected);
+}
+
+/* Features that share pixels must not be drawn as one path. Here each square
+ * overlaps its neighbors, and every other one is wound the other way, which
+ * would cut holes into the fill if they were batched. */
+static void
+test_vector_style_batch_overlapping (void)
+{
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(ShumateVectorLayer) fill = NULL;
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256);
+  cairo_surface_t *expected = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256);
+  int side = 768;
+  GdkRGBA color;
+
+  for (int i = 0; i < 64; i ++)
+    {
+      guint32 *geometry = &grid->geometry[i * SQUARE_GEOMETRY_LEN];
+
+      if (i % 2 == 0)
+        {
+          geometry[4] = zigzag (side);
+          geometry[5] = 0;
+          geometry[6] = 0;
+          geometry[7] = zigzag (side);
+          geometry[8] = zigzag (-side);
+          geometry[9] = 0;
+        }
+      else
+        {
+          geometry[4] = 0;
+          geometry[5] = zigzag (side);
+          geometry[6] = zigzag (side);
+          geometry[7] = 0;
+          geometry[8] = 0;
+          geometry[9] = zigzag (-side);
+        }
+    }
+
+  fill = create_layer ("{\"type\": \"fill\", \"source-layer\": \"buildings\", \"paint\": {\"fill-color\": \"#336699\"}}");
+
+  /* Each square overlaps the one before it */
+  g_assert_cmpuint (render_layer (fill, &grid->tile, surface), ==, 64);
+
+  gdk_rgba_parse (&color, "#336699");
+  render_features_separately (&grid->tile, &color, expected);
+  assert_surfaces_equal (surface, expected);
+
+  cairo_surface_destroy (surface);
+  cairo_surface_destroy (expected);
+}
+
+/* Fill and line layers without a source layer parse, but have no features
+ * to draw */
+static void
+test_vector_style_no_source_layer (void)
+{
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(ShumateVectorLayer) fill = NULL;
+  g_autoptr(ShumateVectorLayer) line = NULL;
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256);
+
+  fill = create_layer ("{\"type\": \"fill\", \"paint\": {\"fill-color\": \"#336699\"}}");
+  line = create_layer ("{\"type\": \"line\", \"paint\": {\"line-color\": \"#336699\"}}");
+
+  g_assert_cmpuint (render_layer (fill, &grid->tile, surface), ==, 0);
+  g_assert_cmpuint (render_layer (line, &grid->tile, surface), ==, 0);
+
+  cairo_surface_destroy (surface);
+}
+
+/* Keys computed at runtime are found even if no style uses them, without
+ * being interned */
+static void
+test_vector_style_runtime_keys (void)
+{
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(ShumateVectorLayer) fill = NULL;
+  cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256);
+
+  /* Every square's test-key-a is the name of its other key */
+  grid->keys[1] = (char *) "test-runtime-key";
+  grid->value.string_value = (char *) "test-runtime-key";
+  g_assert_cmpuint (g_quark_try_string ("test-runtime-key"), ==, 0);
+
+  fill = create_layer ("{\"type\": \"fill\", \"source-layer\": \"buildings\", "
+                       "\"filter\": [\"has\", [\"get\", \"test-key-a\"]], "
+                       "\"paint\": {\"fill-color\": \"#336699\"}}");
+
+  g_assert_cmpuint (render_layer (fill, &grid->tile, surface), ==, 1);
+  g_assert_cmpuint (g_quark_try_string ("test-runtime-key"), ==, 0);
+
+  cairo_surface_destroy (surface);
+}
+
+static void
+test_vector_style_batch_benchmark (void)
+{
+  g_autoptr(GridTile) grid = grid_tile_new (64);
+  g_autoptr(ShumateVectorLayer) fill = NULL;
+  g_autoptr(GTimer) timer = g_timer_new ();
+  cairo_surface_t *surface;
+  GdkRGBA color;
+  double batched_time, separate_time;
+  guint draw_calls = 0;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Benchmarks only run in perf mode");
+      return;
+    }
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 512, 512);
+  fill = create_layer ("{\"type\": \"fill\", \"source-layer\": \"buildings\", \"paint\": {\"fill-color\": \"#336699\"}}");
+  gdk_rgba_parse (&color, "#336699");
+
+  g_timer_start (timer);
+  for (int i = 0; i < 100; i ++)
+    draw_calls = render_layer (fill, &grid->tile, surface);
+  batched_time = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (int i = 0; i < 100; i ++)
+    render_features_separately (&grid->tile, &color, surface);
+  separate_time = g_timer_elapsed (timer, NULL);
+
+  g_test_message ("one draw call per feature: %d draw calls, %.2f ms per tile",
+                  64 * 64, separate_time * 1000 / 100);
+  g_test_message ("batched: %u draw calls per tile", draw_calls);
+  g_test_minimized_result (batched_time * 1000 / 100,
+                           "batched: %.2f ms per tile",
+                           batched_time * 1000 / 100);
+
+  cairo_surface_destroy (surface);
+}
+
+static GBytes *
+grid_tile_pack (GridTile *self)
+{
+  gsize len = vector_tile__tile__get_packed_size (&self->tile);
+  guint8 *data = g_malloc (len);
+
+  vector_tile__tile__pack (&self->tile, data);
+  return g_bytes_new_take (data, len);
+}
+
+static void
+test_vector_style_render_tile_area (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(GBytes) tile_data = grid_tile_pack (grid);
+  g_autoptr(ShumateVectorTile) tile = shumate_vector_tile_new (tile_data);
+  g_autoptr(ShumateVectorStyle) style = NULL;
+  g_autoptr(GdkTexture) whole = NULL;
+  g_autoptr(GdkTexture) area = NULL;
+  g_autofree guchar *whole_pixels = g_malloc (512 * 512 * 4);
+  g_autofree guchar *area_pixels = g_malloc (256 * 256 * 4);
+
+  style = shumate_vector_style_create ("{\"layers\": [{\"type\": \"line\", \"source-layer\": \"buildings\", \"paint\": {\"line-color\": \"#336699\", \"line-width\": 3}}]}", &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (tile);
+
+  /* The top right quarter of the tile, one zoom level deeper, looks the same
+   * as that quarter of the whole tile rendered at twice the size */
+  whole = shumate_vector_style_render_tile (style, 512, tile, 15);
+  area = shumate_vector_style_render_tile_area (style, 256, tile, 15, 1, 1, 0);
+
+  gdk_texture_download (whole, whole_pixels, 512 * 4);
+  gdk_texture_download (area, area_pixels, 256 * 4);
+
+  for (int row = 0; row < 256; row ++)
+    g_assert_cmpmem (&area_pixels[row * 256 * 4], 256 * 4,
+                     &whole_pixels[row * 512 * 4 + 256 * 4], 256 * 4);
+}
+
+static void
+test_vector_style_cull_features (void)
+{
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(ShumateVectorLayer) translucent_fill = NULL;
+  ShumateVectorBounds *bounds = g_new (ShumateVectorBounds, 64);
+  ShumateVectorRenderScope scope = { 0 };
+
+  translucent_fill = create_layer ("{\"type\": \"fill\", \"source-layer\": \"buildings\", \"paint\": {\"fill-color\": \"#336699\", \"fill-opacity\": 0.5}}");
+
+  for (int i = 0; i < 64; i ++)
+    shumate_vector_feature_get_bounds (grid->layer.features[i], &bounds[i]);
+
+  /* The squares are 256 units wide, 128 units in from the corners of their
+   * 512 unit cells */
+  g_assert_cmpint (bounds[9].x1, ==, 640);
+  g_assert_cmpint (bounds[9].y1, ==, 640);
+  g_assert_cmpint (bounds[9].x2, ==, 896);
+  g_assert_cmpint (bounds[9].y2, ==, 896);
+
+  /* Render the bottom left quarter of the tile at twice the size. Only the
+   * 16 features in it are drawn, each on its own since they are
+   * translucent. */
+  scope.cr = cairo_create (cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 256, 256));
+  scope.target_size = 512;
+  scope.zoom_level = 15;
+  scope.tile = &grid->tile;
+  scope.feature_bounds = &bounds;
+  scope.cull = TRUE;
+  scope.visible_area = (cairo_rectangle_t) { 0, 256, 256, 256 };
+  cairo_translate (scope.cr, 0, -256);
+
+  shumate_vector_layer_render (translucent_fill, &scope);
+  g_assert_cmpuint (scope.n_draw_calls, ==, 16);
+
+  shumate_vector_render_scope_clear (&scope);
+  cairo_surface_destroy (cairo_get_target (scope.cr));
+  cairo_destroy (scope.cr);
+  g_free (bounds);
+}
+
+/* Style layers that filter the same source layer on different keys. The
+ * first one to be rendered resolves the source layer's keys, which must
+ * include the key of the second. */
+static void
+test_vector_style_shorthand_keys (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GridTile) grid = grid_tile_new (8);
+  g_autoptr(GBytes) tile_data = grid_tile_pack (grid);
+  g_autoptr(ShumateVectorTile) tile = shumate_vector_tile_new (tile_data);
+  g_autoptr(ShumateVectorStyle) style = NULL;
+  g_autoptr(GdkTexture) texture = NULL;
+  g_autofree guchar *pixels = g_malloc (256 * 256 * 4);
+  guchar *pixel;
+
+  style = shumate_vector_style_create ("{\"layers\": ["
+                                       "{\"type\": \"fill\", \"source-layer\": \"buildings\", \"filter\": [\"==\", \"test-key-a\", \"yes\"], \"paint\": {\"fill-color\": \"#ff0000\"}},"
+                                       "{\"type\": \"fill\", \"source-layer\": \"buildings\", \"filter\": [\"==\", \"test-key-b\", \"yes\"], \"paint\": {\"fill-color\": \"#0000ff\"}}"
+                                       "]}", &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (tile);
+
+  texture = shumate_vector_style_render_tile (style, 256, tile, 14);
+  gdk_texture_download (texture, pixels, 256 * 4);
+
+  /* The middle of the first square is painted by the second layer. Pixels
+   * are in cairo's native-endian ARGB format. */
+  pixel = &pixels[(16 * 256 + 16) * 4];
+  g_assert_cmphex (*(guint32 *) pixel, ==, 0xff0000ff);
+}
+
 int
 main (int argc, char *argv[])
 {
   g_test_init (&argc, &argv, NULL);
 
   g_test_add_func ("/vector-style/create", test_vector_style_create);
+  g_test_add_func ("/vector-style/render-parsed-tile", test_vector_style_render_parsed_tile);
+  g_test_add_func ("/vector-style/batch-features", test_vector_style_batch_features);
+  g_test_add_func ("/vector-style/batch-overlapping", test_vector_style_batch_overlapping);
+  g_test_add_func ("/vector-style/no-source-layer", test_vector_style_no_source_layer);
+  g_test_add_func ("/vector-style/runtime-keys", test_vector_style_runtime_keys);
+  g_test_add_func ("/vector-style/batch-benchmark", test_vector_style_batch_benchmark);
+  g_test_add_func ("/vector-style/render-tile-area", test_vector_style_render_tile_area);
+  g_test_add_func ("/vector-style/cull-features", test_vector_style_cull_features);
+  g_test_add_func ("/vector-style/shorthand-keys", test_vector_style_shorthand_keys);
 
   return g_test_run ();
 }